@@ -0,0 +1,415 @@
+/*
+ * 一致性哈希: 把 key 分到几个进程(分片)上 每个进程各自有一个 hash_t
+ * 用 hash % N 分片的话 N 一变几乎所有的 key 都换了地方 一致性哈希只搬 1/N 左右
+ *
+ * 两种实现:
+ * RING_VNODES 哈希环 每个分片按权重放 vnodes * weight 个虚拟节点(环上的点) key 归顺时针方向的第一个点
+ *   环是按 hash 排好序的数组 查找就是二分 点的 hash 和分片号分两个数组放 二分只碰 hash 数组
+ *   增删分片任意 只有落在新点(删掉的点)前面那一段的 key 会移动
+ * RING_JUMP jump consistent hash(Lamping & Veach) 不占内存 分布完全均匀 但是分片只能是 0..N-1 连续编号
+ *   只有在末尾增删分片时才是最少移动 删除中间的分片 后面分片的编号都会变
+ *
+ * key 和虚拟节点的 hash 都用 hash hash-function.c 里的 WYHash 64 位 环上冲突的概率可以忽略
+ * ring_route_many 批量查: 一组 key 同时二分 每一步所有 key 的访存一起发出去
+ * 增删分片时修改环 查找只读 多线程查找时增删分片要由调用者同步(或者建一个新的环替换指针)
+ */
+
+// ring.h file
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct ring ring_t;
+
+typedef enum ring_mode {
+	RING_VNODES,
+	RING_JUMP,
+} ring_mode_t;
+
+// vnodes 是权重为 1 的分片放在环上的点数 RING_JUMP 时不用
+ring_t * ring_alloc(ring_mode_t mode, unsigned int vnodes);
+void ring_destroy(ring_t *r);
+
+// 分片号由调用者给 重复添加或者删除不存在的分片返回 -1
+// RING_JUMP 忽略 weight
+int ring_add_shard(ring_t *r, uint32_t shard, unsigned int weight);
+int ring_remove_shard(ring_t *r, uint32_t shard);
+size_t ring_shards(const ring_t *r);
+
+// 返回 key 所在的分片号 没有分片时返回 UINT32_MAX
+uint32_t ring_route(const ring_t *r, const void *key, size_t len);
+// key 的 hash 已经有了(比如 WYHash(key, len, RING_SEED)) 直接用
+uint32_t ring_route_hash(const ring_t *r, uint64_t h);
+void ring_route_many(const ring_t *r, const void * const *keys, const size_t *lens, size_t n, uint32_t *out);
+
+// 环上的点(RING_JUMP 是分片)占的内存
+size_t ring_memory(const ring_t *r);
+
+#define RING_SEED 0x5ca1ab1e0ddba11ull
+
+#endif
+
+// ring.c file
+
+#include "ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// 在 hash hash-function.c 里
+uint64_t WYHash(const void *key, size_t len, uint64_t seed);
+
+#define ROUTE_GROUP 16
+
+struct ring {
+	ring_mode_t mode;
+	unsigned int vnodes;
+	// 分片 RING_JUMP 时下标就是 jump hash 的桶号
+	uint32_t *shard;
+	unsigned int *weight;
+	size_t nshards;
+	size_t cap_shards;
+	// 环 point[i] 的分片是 owner[i] 按 point 升序
+	uint64_t *point;
+	uint32_t *owner;
+	size_t npoints;
+};
+
+struct vnode {
+	uint64_t point;
+	uint32_t owner;
+};
+
+ring_t *
+ring_alloc(ring_mode_t mode, unsigned int vnodes) {
+	ring_t *r = (ring_t *)calloc(1, sizeof(*r));
+	assert(r);
+	r->mode = mode;
+	r->vnodes = vnodes ? vnodes : 1;
+	return r;
+}
+
+void
+ring_destroy(ring_t *r) {
+	free(r->shard);
+	free(r->weight);
+	free(r->point);
+	free(r->owner);
+	free(r);
+}
+
+size_t
+ring_shards(const ring_t *r) {
+	return r->nshards;
+}
+
+size_t
+ring_memory(const ring_t *r) {
+	return sizeof(*r) + r->cap_shards * (sizeof(uint32_t) + sizeof(unsigned int))
+		+ r->npoints * (sizeof(uint64_t) + sizeof(uint32_t));
+}
+
+static int
+vnode_cmp(const void *a, const void *b) {
+	const struct vnode *x = (const struct vnode *)a, *y = (const struct vnode *)b;
+	if (x->point != y->point)
+		return x->point < y->point ? -1 : 1;
+	// hash 相同(几乎不会)时按分片号 保证结果和添加的顺序无关
+	return x->owner < y->owner ? -1 : x->owner > y->owner;
+}
+
+// 第 i 个点的 hash 只由 (分片号, i) 决定 同一个分片在哪台机器上重建环 点都在同样的位置
+// 新分片的点单独排好序 再和环归并 O(环的大小 + k log k) 一个一个加分片也不会是平方的
+static void
+ring_insert_points(ring_t *r, uint32_t shard, unsigned int count) {
+	struct vnode *v = (struct vnode *)malloc(count * sizeof(*v) + 1);
+	uint32_t id[2] = { shard, 0 };
+	unsigned int j;
+	assert(v);
+	for (j = 0; j < count; j++) {
+		id[1] = j;
+		v[j].point = WYHash(id, sizeof(id), RING_SEED);
+		v[j].owner = shard;
+	}
+	qsort(v, count, sizeof(*v), vnode_cmp);
+
+	size_t n = r->npoints + count, a = 0, k = 0;
+	uint64_t *point = (uint64_t *)malloc(n * sizeof(uint64_t));
+	uint32_t *owner = (uint32_t *)malloc(n * sizeof(uint32_t));
+	assert(point && owner);
+	j = 0;
+	while (k < n) {
+		if (j == count || (a < r->npoints && (r->point[a] < v[j].point
+			|| (r->point[a] == v[j].point && r->owner[a] < v[j].owner)))) {
+			point[k] = r->point[a];
+			owner[k++] = r->owner[a++];
+		} else {
+			point[k] = v[j].point;
+			owner[k++] = v[j++].owner;
+		}
+	}
+	free(r->point);
+	free(r->owner);
+	free(v);
+	r->point = point;
+	r->owner = owner;
+	r->npoints = n;
+}
+
+// 原地去掉一个分片的点 剩下的还是有序的
+static void
+ring_erase_points(ring_t *r, uint32_t shard) {
+	size_t i, k = 0;
+	for (i = 0; i < r->npoints; i++) {
+		if (r->owner[i] != shard) {
+			r->point[k] = r->point[i];
+			r->owner[k++] = r->owner[i];
+		}
+	}
+	r->npoints = k;
+}
+
+static long
+shard_index(const ring_t *r, uint32_t shard) {
+	size_t i;
+	for (i = 0; i < r->nshards; i++) {
+		if (r->shard[i] == shard)
+			return (long)i;
+	}
+	return -1;
+}
+
+int
+ring_add_shard(ring_t *r, uint32_t shard, unsigned int weight) {
+	if (shard_index(r, shard) >= 0)
+		return -1;
+	if (r->nshards == r->cap_shards) {
+		r->cap_shards = r->cap_shards ? r->cap_shards * 2 : 8;
+		r->shard = (uint32_t *)realloc(r->shard, r->cap_shards * sizeof(uint32_t));
+		r->weight = (unsigned int *)realloc(r->weight, r->cap_shards * sizeof(unsigned int));
+		assert(r->shard && r->weight);
+	}
+	r->shard[r->nshards] = shard;
+	r->weight[r->nshards] = weight ? weight : 1;
+	r->nshards++;
+	if (r->mode == RING_VNODES)
+		ring_insert_points(r, shard, r->vnodes * r->weight[r->nshards - 1]);
+	return 0;
+}
+
+int
+ring_remove_shard(ring_t *r, uint32_t shard) {
+	long i = shard_index(r, shard);
+	if (i < 0)
+		return -1;
+	// 保持顺序 RING_JUMP 删最后一个分片时其他分片的桶号不变
+	memmove(r->shard + i, r->shard + i + 1, (r->nshards - i - 1) * sizeof(uint32_t));
+	memmove(r->weight + i, r->weight + i + 1, (r->nshards - i - 1) * sizeof(unsigned int));
+	r->nshards--;
+	if (r->mode == RING_VNODES)
+		ring_erase_points(r, shard);
+	return 0;
+}
+
+// Lamping & Veach: key 从桶 b 跳到下一个桶 j 的概率使得桶数从 n 变成 n+1 时正好有 1/(n+1) 的 key 跳进新桶
+static inline uint32_t
+jump_hash(uint64_t key, uint32_t buckets) {
+	int64_t b = -1, j = 0;
+	while (j < (int64_t)buckets) {
+		b = j;
+		key = key * 2862933555777941757ull + 1;
+		j = (int64_t)((b + 1) * ((double)(1ll << 31) / (double)((key >> 33) + 1)));
+	}
+	return (uint32_t)b;
+}
+
+// 第一个 >= h 的点 没有就绕回 0 点数固定时循环次数固定 没有分支预测失败
+static inline size_t
+ring_search(const ring_t *r, uint64_t h) {
+	const uint64_t *base = r->point;
+	size_t n = r->npoints;
+	while (n > 1) {
+		size_t half = n / 2;
+		base = base[half - 1] < h ? base + half : base;
+		n -= half;
+	}
+	size_t i = (size_t)(base - r->point) + (*base < h);
+	return i == r->npoints ? 0 : i;
+}
+
+uint32_t
+ring_route_hash(const ring_t *r, uint64_t h) {
+	if (r->nshards == 0)
+		return UINT32_MAX;
+	if (r->mode == RING_JUMP)
+		return r->shard[jump_hash(h, (uint32_t)r->nshards)];
+	return r->owner[ring_search(r, h)];
+}
+
+uint32_t
+ring_route(const ring_t *r, const void *key, size_t len) {
+	return ring_route_hash(r, WYHash(key, len, RING_SEED));
+}
+
+// 每 ROUTE_GROUP 个 key 一组 先算好所有的 hash 再一起二分: 每一轮每个 key 走一步 并 prefetch 下一步要看的位置
+// 环比 cache 大的时候 一个 key 等内存的时候其他 key 的访存已经发出去了
+void
+ring_route_many(const ring_t *r, const void * const *keys, const size_t *lens, size_t n, uint32_t *out) {
+	uint64_t h[ROUTE_GROUP];
+	const uint64_t *base[ROUTE_GROUP];
+	size_t i, k;
+
+	if (r->nshards == 0 || r->mode == RING_JUMP) {
+		for (i = 0; i < n; i++)
+			out[i] = ring_route(r, keys[i], lens[i]);
+		return;
+	}
+	for (i = 0; i < n; i += ROUTE_GROUP) {
+		size_t g = n - i < ROUTE_GROUP ? n - i : ROUTE_GROUP;
+		size_t len = r->npoints;
+		for (k = 0; k < g; k++) {
+			h[k] = WYHash(keys[i + k], lens[i + k], RING_SEED);
+			base[k] = r->point;
+		}
+		// 所有 key 的剩余区间长度都一样 只有起点不同
+		while (len > 1) {
+			size_t half = len / 2;
+			for (k = 0; k < g; k++) {
+				base[k] = base[k][half - 1] < h[k] ? base[k] + half : base[k];
+				if (len - half > 1)
+					__builtin_prefetch(base[k] + (len - half) / 2 - 1);
+			}
+			len -= half;
+		}
+		for (k = 0; k < g; k++) {
+			size_t j = (size_t)(base[k] - r->point) + (*base[k] < h[k]);
+			out[i + k] = r->owner[j == r->npoints ? 0 : j];
+		}
+	}
+}
+
+// bench.c file
+
+/*
+ * 吞吐: 单个 ring_route 和 ring_route_many 每秒路由多少 key 以及各分片分到的 key 数的最大值/平均值
+ * 移动: 加一个分片 删一个分片之后换了分片的 key 的比例 理想值是 1/(N+1) 和 1/N 和 hash % N 对比
+ *   gcc -O2 ring.c bench.c "hash hash-function.c" -o ring_bench && ./ring_bench [shards] [vnodes] [keys]
+ */
+
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#define KEY_LEN 32
+#define BATCH 256
+
+uint64_t WYHash(const void *key, size_t len, uint64_t seed);
+
+static double
+now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+route_all(const ring_t *r, const void * const *keys, const size_t *lens, size_t n, uint32_t *out) {
+	size_t i;
+	for (i = 0; i < n; i += BATCH)
+		ring_route_many(r, keys + i, lens + i, n - i < BATCH ? n - i : BATCH, out + i);
+}
+
+static double
+moved(const uint32_t *a, const uint32_t *b, size_t n) {
+	size_t i, m = 0;
+	for (i = 0; i < n; i++)
+		m += a[i] != b[i];
+	return (double)m / n;
+}
+
+static void
+bench_mode(const char *name, ring_mode_t mode, unsigned int shards, unsigned int vnodes,
+	const void * const *keys, const size_t *lens, size_t n) {
+	ring_t *r = ring_alloc(mode, vnodes);
+	uint32_t *before = (uint32_t *)malloc(n * sizeof(uint32_t));
+	uint32_t *after = (uint32_t *)malloc(n * sizeof(uint32_t));
+	size_t *load = (size_t *)calloc(shards + 1, sizeof(size_t));
+	size_t i, max = 0;
+	unsigned int s;
+	double t;
+
+	for (s = 0; s < shards; s++)
+		ring_add_shard(r, s, 1);
+
+	t = now();
+	for (i = 0; i < n; i++)
+		before[i] = ring_route(r, keys[i], lens[i]);
+	double single = now() - t;
+	t = now();
+	route_all(r, keys, lens, n, after);
+	double batch = now() - t;
+	for (i = 0; i < n; i++) {
+		assert(before[i] == after[i]);
+		load[before[i]]++;
+	}
+	for (s = 0; s < shards; s++)
+		max = load[s] > max ? load[s] : max;
+
+	printf("%-7s %u shards: ring_route %6.1f Mkeys/s, ring_route_many %6.1f Mkeys/s, max/mean load %.3f, %zu bytes\n",
+		name, shards, n / single / 1e6, n / batch / 1e6, (double)max * shards / n, ring_memory(r));
+
+	ring_add_shard(r, shards, 1);
+	route_all(r, keys, lens, n, after);
+	printf("        add shard    moved %.4f (ideal %.4f)\n", moved(before, after, n), 1.0 / (shards + 1));
+	ring_remove_shard(r, shards);
+	// 删掉的是最后一个分片 jump hash 也是最少移动
+	ring_remove_shard(r, shards - 1);
+	route_all(r, keys, lens, n, after);
+	printf("        remove shard moved %.4f (ideal %.4f)\n", moved(before, after, n), 1.0 / shards);
+
+	ring_destroy(r);
+	free(before);
+	free(after);
+	free(load);
+}
+
+int
+main(int argc, char *argv[]) {
+	unsigned int shards = argc > 1 ? (unsigned int)atoi(argv[1]) : 16;
+	unsigned int vnodes = argc > 2 ? (unsigned int)atoi(argv[2]) : 160;
+	size_t n = argc > 3 ? (size_t)atol(argv[3]) : 1000000;
+	char *mem = (char *)malloc(n * KEY_LEN);
+	const void **keys = (const void **)malloc(n * sizeof(void *));
+	size_t *lens = (size_t *)malloc(n * sizeof(size_t));
+	size_t i, m = 0;
+
+	assert(shards > 1);
+	for (i = 0; i < n; i++) {
+		snprintf(mem + i * KEY_LEN, KEY_LEN, "user:%010zu", i);
+		keys[i] = mem + i * KEY_LEN;
+		lens[i] = strlen(mem + i * KEY_LEN);
+	}
+
+	bench_mode("vnodes", RING_VNODES, shards, vnodes, keys, lens, n);
+	bench_mode("jump", RING_JUMP, shards, vnodes, keys, lens, n);
+
+	// 对比: hash % N
+	for (i = 0; i < n; i++) {
+		uint64_t h = WYHash(keys[i], lens[i], RING_SEED);
+		m += h % shards != h % (shards + 1);
+	}
+	printf("modulo  add shard    moved %.4f\n", (double)m / n);
+
+	free(mem);
+	free(keys);
+	free(lens);
+	return 0;
+}
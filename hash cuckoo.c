@@ -0,0 +1,648 @@
+/*
+ * 分桶的 cuckoo hash 每个桶 4 个 slot 一个桶正好一条 cache line
+ * 每个 key 只可能在两个桶里: h1 h2 是 leveldb 的 Hash 用两个不同的 seed 算出来的
+ * 所以查找最多碰两条 cache line 最坏情况的读延迟是固定的
+ *
+ * 读不加锁: 桶按下标映射到一组版本号上(seqlock) 写之前把版本号加成奇数 写完再加成偶数
+ * 读者先读两个桶的版本号 再读桶 最后确认版本号没变 变了就重读
+ * 写者之间用一把自旋锁串行
+ *
+ * 两个桶都满时用 BFS 找一条最短的 cuckoo 路径 从路径末尾的空位开始 一个一个往后挪
+ * 每次挪动先写目标位置再清原来的位置 key 任何时候都至少在一个桶里
+ * 找不到路径就扩大一倍 新表建好后替换指针 读者可能还在读旧表 所以旧表先挂在链表上
+ * 读者查找期间处在一个 epoch 里(每个线程一条记录) 所有在读的线程都进入下一个 epoch 之后
+ * 再推进一次 旧表就没人能看到了 由后面的写操作释放
+ */
+
+// cuckoo.h file
+
+#ifndef CUCKOO_H
+#define CUCKOO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// key 是 64 位整数 0 保留用来表示空 slot
+typedef struct cuckoo cuckoo_t;
+
+cuckoo_t * cuckoo_alloc(size_t capacity);
+void cuckoo_destroy(cuckoo_t *c);
+
+// 找到返回 1 并把 value 写到 *value 里 可以和写操作并发调用
+int cuckoo_find(cuckoo_t *c, uint64_t key, uint64_t *value);
+
+// 已经存在就更新 value 返回 0 新插入返回 1
+int cuckoo_insert(cuckoo_t *c, uint64_t key, uint64_t value);
+
+// 删除成功返回 1
+int cuckoo_erase(cuckoo_t *c, uint64_t key);
+
+size_t cuckoo_size(cuckoo_t *c);
+
+#endif
+
+// cuckoo.c file
+
+#include "cuckoo.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define cpu_relax() _mm_pause()
+#else
+#define cpu_relax()
+#endif
+
+#define SLOT_PER_BUCKET 4
+#define VERSION_STRIPES 1024            // 版本号 4K 字节 常驻 L1
+#define BFS_MAX_NODES 512
+#define BFS_MAX_DEPTH 5
+#define BFS_MAX_RETRY 3                 // cuckoo 路径失效时重新搜索的次数 都失败才扩容
+#define EPOCH_MASK 0x7fffffff
+
+#define SEED1 0xbc9f1d34
+#define SEED2 0x9ae16a3b
+
+struct bucket {
+	uint64_t key[SLOT_PER_BUCKET];
+	uint64_t value[SLOT_PER_BUCKET];
+};
+
+struct table {
+	struct table *retired;              // 被替换掉的旧表 新的在前
+	unsigned epoch;                     // 被替换时的 epoch
+	size_t mask;
+	struct bucket *bucket;
+	void *mem;
+};
+
+struct cuckoo {
+	struct table * volatile t;
+	int lock;
+	size_t size;
+	uint32_t version[VERSION_STRIPES];
+};
+
+// 读者的 epoch 记录 state 高位是进入时的 epoch 最低位表示正在查找 独占一条 cache line
+// 线程第一次查找时注册 之后不释放 线程退出后一直是不活跃的 不会挡住 epoch
+struct epoch_record {
+	union {
+		struct {
+			unsigned state;
+			struct epoch_record *next;
+		} r;
+		char pad[64];
+	} u;
+};
+
+// 所有 cuckoo 表共用一个 epoch 扩容很少见
+static struct {
+	unsigned epoch;
+	int lock;
+	struct epoch_record *records;
+} E;
+
+static __thread struct epoch_record *T = NULL;
+
+// 在 hash hash-function.c 里 leveldb 的 Hash
+uint32_t LevelDBHash(const char *data, size_t n, uint32_t seed);
+
+static inline size_t
+hash1(struct table *t, uint64_t key) {
+	return LevelDBHash((const char *)&key, sizeof(key), SEED1) & t->mask;
+}
+
+// h2 和 h1 相同时把 h2 换成相邻的桶 保证 key 有两个不同的候选位置
+static inline size_t
+hash2(struct table *t, uint64_t key, size_t b1) {
+	size_t b2 = LevelDBHash((const char *)&key, sizeof(key), SEED2) & t->mask;
+	if (b2 == b1)
+		b2 = (b1 + 1) & t->mask;
+	return b2;
+}
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+static inline uint32_t *
+version_of(struct cuckoo *c, size_t bucket) {
+	return &c->version[bucket & (VERSION_STRIPES - 1)];
+}
+
+// 写者持有锁 只需要把版本号变成奇数 读者看到奇数或者前后不同就重试
+static inline void
+write_begin(struct cuckoo *c, size_t b1, size_t b2) {
+	uint32_t *v1 = version_of(c, b1);
+	uint32_t *v2 = version_of(c, b2);
+	STORE(v1, *v1 + 1);
+	if (v2 != v1)
+		STORE(v2, *v2 + 1);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+write_end(struct cuckoo *c, size_t b1, size_t b2) {
+	uint32_t *v1 = version_of(c, b1);
+	uint32_t *v2 = version_of(c, b2);
+	__atomic_store_n(v1, *v1 + 1, __ATOMIC_RELEASE);
+	if (v2 != v1)
+		__atomic_store_n(v2, *v2 + 1, __ATOMIC_RELEASE);
+}
+
+static void
+writer_lock(struct cuckoo *c) {
+	while (__atomic_exchange_n(&c->lock, 1, __ATOMIC_ACQUIRE)) {
+		while (LOAD(&c->lock))
+			cpu_relax();
+	}
+}
+
+static void
+writer_unlock(struct cuckoo *c) {
+	__atomic_store_n(&c->lock, 0, __ATOMIC_RELEASE);
+}
+
+static struct epoch_record *
+epoch_register(void) {
+	struct epoch_record *r;
+	void *p;
+	if (posix_memalign(&p, 64, sizeof(*r)) != 0)
+		return NULL;
+	r = (struct epoch_record *)p;
+	r->u.r.state = 0;
+	r->u.r.next = LOAD(&E.records);
+	while (!__atomic_compare_exchange_n(&E.records, &r->u.r.next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	T = r;
+	return r;
+}
+
+// state 写下去之后才能读 c->t 否则写者推进 epoch 时可能看不到这个读者
+static inline void
+epoch_enter(void) {
+	struct epoch_record *r = T;
+	if (r == NULL) {
+		r = epoch_register();
+		assert(r);
+	}
+	STORE(&r->u.r.state, (LOAD(&E.epoch) << 1) | 1);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void
+epoch_exit(void) {
+	__atomic_store_n(&T->u.r.state, 0, __ATOMIC_RELEASE);
+}
+
+// 正在查找的读者都已经进入当前 epoch 才能推进 返回当前的 epoch
+static unsigned
+epoch_try_advance(void) {
+	struct epoch_record *r;
+	unsigned g;
+	while (__atomic_exchange_n(&E.lock, 1, __ATOMIC_ACQUIRE))
+		cpu_relax();
+	g = LOAD(&E.epoch);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (r = __atomic_load_n(&E.records, __ATOMIC_ACQUIRE); r; r = r->u.r.next) {
+		unsigned s = LOAD(&r->u.r.state);
+		if ((s & 1) && (s >> 1) != g)
+			break;
+	}
+	if (r == NULL) {
+		g = (g + 1) & EPOCH_MASK;
+		__atomic_store_n(&E.epoch, g, __ATOMIC_SEQ_CST);
+	}
+	__atomic_store_n(&E.lock, 0, __ATOMIC_RELEASE);
+	return g;
+}
+
+static void
+free_table(struct table *t) {
+	free(t->mem);
+	free(t);
+}
+
+// 写者持有锁时调用 退役时的 epoch 之后又推进了两次 说明那时在读的读者都已经离开
+// 链表是按退役时间从新到旧排的 找到第一张可以释放的 后面的都可以释放
+static void
+reclaim(struct cuckoo *c) {
+	struct table *t = c->t;
+	unsigned g;
+	if (t->retired == NULL)
+		return;
+	g = epoch_try_advance();
+	while (t->retired && ((g - t->retired->epoch) & EPOCH_MASK) < 2)
+		t = t->retired;
+	struct table *old = t->retired;
+	t->retired = NULL;
+	while (old) {
+		struct table *next = old->retired;
+		free_table(old);
+		old = next;
+	}
+}
+
+static struct table *
+new_table(size_t nbucket) {
+	struct table *t = (struct table *)malloc(sizeof(*t));
+	assert(t);
+	t->mem = malloc(nbucket * sizeof(struct bucket) + 63);
+	assert(t->mem);
+	t->bucket = (struct bucket *)(((uintptr_t)t->mem + 63) & ~(uintptr_t)63);
+	memset(t->bucket, 0, nbucket * sizeof(struct bucket));
+	t->mask = nbucket - 1;
+	t->retired = NULL;
+	t->epoch = 0;
+	return t;
+}
+
+cuckoo_t *
+cuckoo_alloc(size_t capacity) {
+	size_t nbucket = 2;
+	while (nbucket * SLOT_PER_BUCKET < capacity)
+		nbucket *= 2;
+	struct cuckoo *c = (struct cuckoo *)malloc(sizeof(*c));
+	assert(c);
+	memset(c, 0, sizeof(*c));
+	c->t = new_table(nbucket);
+	return c;
+}
+
+// 调用者保证已经没有读者了 还没到期的旧表也一起释放
+void
+cuckoo_destroy(cuckoo_t *c) {
+	struct table *t = c->t;
+	while (t) {
+		struct table *next = t->retired;
+		free_table(t);
+		t = next;
+	}
+	free(c);
+}
+
+size_t
+cuckoo_size(cuckoo_t *c) {
+	return LOAD(&c->size);
+}
+
+static inline int
+bucket_find(struct bucket *b, uint64_t key) {
+	int i;
+	for (i=0;i<SLOT_PER_BUCKET;i++) {
+		if (LOAD(&b->key[i]) == key)
+			return i;
+	}
+	return -1;
+}
+
+int
+cuckoo_find(cuckoo_t *c, uint64_t key, uint64_t *value) {
+	assert(key != 0);
+	epoch_enter();
+	for (;;) {
+		struct table *t = __atomic_load_n(&c->t, __ATOMIC_ACQUIRE);
+		size_t b1 = hash1(t, key);
+		size_t b2 = hash2(t, key, b1);
+		uint32_t *pv1 = version_of(c, b1);
+		uint32_t *pv2 = version_of(c, b2);
+		uint32_t v1 = __atomic_load_n(pv1, __ATOMIC_ACQUIRE);
+		uint32_t v2 = __atomic_load_n(pv2, __ATOMIC_ACQUIRE);
+		if ((v1 | v2) & 1) {
+			cpu_relax();
+			continue;
+		}
+		int found = 0;
+		uint64_t v = 0;
+		int i = bucket_find(&t->bucket[b1], key);
+		if (i >= 0) {
+			v = LOAD(&t->bucket[b1].value[i]);
+			found = 1;
+		} else {
+			i = bucket_find(&t->bucket[b2], key);
+			if (i >= 0) {
+				v = LOAD(&t->bucket[b2].value[i]);
+				found = 1;
+			}
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (LOAD(pv1) != v1 || LOAD(pv2) != v2 || LOAD(&c->t) != t)
+			continue;
+		epoch_exit();
+		if (found && value)
+			*value = v;
+		return found;
+	}
+}
+
+// BFS 的节点: 桶 前一个节点 以及前一个桶里是哪个 slot 被挪到这个桶
+struct bfs_node {
+	size_t bucket;
+	int parent;
+	int slot;
+	int depth;
+};
+
+// node 到根的路径上有没有 bucket 路径上一个桶出现两次的话 前面的挪动会换掉后面要挪的元素
+static inline int
+bfs_on_path(struct bfs_node *queue, int node, size_t bucket) {
+	for (; node >= 0; node = queue[node].parent) {
+		if (queue[node].bucket == bucket)
+			return 1;
+	}
+	return 0;
+}
+
+// 找一条从 b1/b2 出发到空 slot 的最短路径 返回终点节点下标 没有返回 -1
+static int
+bfs_search(struct table *t, size_t b1, size_t b2, struct bfs_node *queue, int *empty_slot) {
+	int head = 0, tail = 0;
+	queue[tail].bucket = b1; queue[tail].parent = -1; queue[tail].slot = -1; queue[tail].depth = 0; tail++;
+	queue[tail].bucket = b2; queue[tail].parent = -1; queue[tail].slot = -1; queue[tail].depth = 0; tail++;
+	while (head < tail) {
+		struct bfs_node *n = &queue[head];
+		struct bucket *b = &t->bucket[n->bucket];
+		int i;
+		for (i=0;i<SLOT_PER_BUCKET;i++) {
+			if (b->key[i] == 0) {
+				*empty_slot = i;
+				return head;
+			}
+		}
+		if (n->depth < BFS_MAX_DEPTH) {
+			for (i=0;i<SLOT_PER_BUCKET && tail < BFS_MAX_NODES;i++) {
+				uint64_t key = b->key[i];
+				size_t h1 = hash1(t, key);
+				size_t alt = (h1 == n->bucket) ? hash2(t, key, h1) : h1;
+				if (bfs_on_path(queue, head, alt))
+					continue;
+				queue[tail].bucket = alt;
+				queue[tail].parent = head;
+				queue[tail].slot = i;
+				queue[tail].depth = n->depth + 1;
+				tail++;
+			}
+		}
+		head++;
+	}
+	return -1;
+}
+
+// 沿路径从空位往回挪 最后 b1/b2 中的一个桶会空出一个 slot 返回 slot 桶放在 *bucket
+// bfs_search 不会让同一个桶在路径上出现两次 这里仍然确认要挪的元素的另一个桶是目标桶 不是就放弃 返回 -1
+static int
+cuckoo_move(struct cuckoo *c, struct table *t, struct bfs_node *queue, int node, int empty, size_t *bucket) {
+	while (queue[node].parent >= 0) {
+		struct bfs_node *n = &queue[node];
+		struct bfs_node *p = &queue[n->parent];
+		struct bucket *from = &t->bucket[p->bucket];
+		struct bucket *to = &t->bucket[n->bucket];
+		uint64_t key = from->key[n->slot];
+		size_t h1 = hash1(t, key);
+		size_t alt = (h1 == p->bucket) ? hash2(t, key, h1) : h1;
+		if (alt != n->bucket)
+			return -1;
+		write_begin(c, p->bucket, n->bucket);
+		STORE(&to->value[empty], from->value[n->slot]);
+		STORE(&to->key[empty], from->key[n->slot]);
+		STORE(&from->key[n->slot], 0);
+		write_end(c, p->bucket, n->bucket);
+		empty = n->slot;
+		node = n->parent;
+	}
+	*bucket = queue[node].bucket;
+	return empty;
+}
+
+static int table_insert(struct cuckoo *c, struct table *t, uint64_t key, uint64_t value);
+
+// 扩大一倍 新表换上去之前读者看不到 期间版本号的变动只会让读者多重试几次
+static void
+cuckoo_grow(struct cuckoo *c) {
+	struct table *old = c->t;
+	struct table *t;
+	size_t nbucket = (old->mask + 1) * 2;
+	for (;;) {
+		size_t i;
+		int j;
+		int ok = 1;
+		t = new_table(nbucket);
+		for (i=0;i<=old->mask && ok;i++) {
+			for (j=0;j<SLOT_PER_BUCKET;j++) {
+				uint64_t key = old->bucket[i].key[j];
+				if (key && !table_insert(c, t, key, old->bucket[i].value[j])) {
+					ok = 0;
+					break;
+				}
+			}
+		}
+		if (ok)
+			break;
+		free_table(t);
+		nbucket *= 2;
+	}
+	t->retired = old;
+	__atomic_store_n(&c->t, t, __ATOMIC_SEQ_CST);
+	// 替换之后再取 epoch 这个 epoch 里的读者可能拿着旧表
+	old->epoch = __atomic_load_n(&E.epoch, __ATOMIC_SEQ_CST);
+	reclaim(c);
+}
+
+// key 不在表里 插入成功返回 1 表太满返回 0
+static int
+table_insert(struct cuckoo *c, struct table *t, uint64_t key, uint64_t value) {
+	struct bfs_node queue[BFS_MAX_NODES];
+	size_t b1 = hash1(t, key);
+	size_t b2 = hash2(t, key, b1);
+	size_t b;
+	int empty = -1;
+	int retry;
+	// 路径失效时已经挪过的元素都在合法的位置上 重新搜索一次 多半能找到更短的路径
+	for (retry=0;retry<BFS_MAX_RETRY && empty<0;retry++) {
+		int node = bfs_search(t, b1, b2, queue, &empty);
+		if (node < 0)
+			return 0;
+		empty = cuckoo_move(c, t, queue, node, empty, &b);
+	}
+	if (empty < 0)
+		return 0;
+	write_begin(c, b, b);
+	STORE(&t->bucket[b].value[empty], value);
+	STORE(&t->bucket[b].key[empty], key);
+	write_end(c, b, b);
+	return 1;
+}
+
+int
+cuckoo_insert(cuckoo_t *c, uint64_t key, uint64_t value) {
+	assert(key != 0);
+	writer_lock(c);
+	struct table *t = c->t;
+	size_t b1 = hash1(t, key);
+	size_t b2 = hash2(t, key, b1);
+	size_t b = b1;
+	int i = bucket_find(&t->bucket[b1], key);
+	if (i < 0) {
+		b = b2;
+		i = bucket_find(&t->bucket[b2], key);
+	}
+	if (i >= 0) {
+		write_begin(c, b, b);
+		STORE(&t->bucket[b].value[i], value);
+		write_end(c, b, b);
+		writer_unlock(c);
+		return 0;
+	}
+	while (!table_insert(c, c->t, key, value))
+		cuckoo_grow(c);
+	STORE(&c->size, c->size + 1);
+	reclaim(c);
+	writer_unlock(c);
+	return 1;
+}
+
+int
+cuckoo_erase(cuckoo_t *c, uint64_t key) {
+	assert(key != 0);
+	writer_lock(c);
+	struct table *t = c->t;
+	size_t b1 = hash1(t, key);
+	size_t b2 = hash2(t, key, b1);
+	size_t b = b1;
+	int i = bucket_find(&t->bucket[b1], key);
+	if (i < 0) {
+		b = b2;
+		i = bucket_find(&t->bucket[b2], key);
+	}
+	if (i >= 0) {
+		write_begin(c, b, b);
+		STORE(&t->bucket[b].key[i], 0);
+		write_end(c, b, b);
+		STORE(&c->size, c->size - 1);
+	}
+	reclaim(c);
+	writer_unlock(c);
+	return i >= 0;
+}
+
+// test.c file
+
+/*
+ * 单线程和 std 行为对比 然后一个写线程不停的增删(会触发 cuckoo 路径和扩容)
+ * 几个读线程反复查一批一直存在的 key 任何一次查不到或者 value 不对都是错误
+ *   gcc -O2 -pthread cuckoo.c test.c "hash hash-function.c" -o cuckoo_test && ./cuckoo_test [readers]
+ */
+
+#include "cuckoo.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#define STABLE_KEYS 100000
+#define CHURN_KEYS 400000
+#define CHURN_ROUNDS 3
+
+static cuckoo_t *C;
+static volatile int Done;
+
+static uint64_t
+stable_key(int i) {
+	return (uint64_t)i * 2 + 1;
+}
+
+static void *
+reader(void *arg) {
+	long ops = 0;
+	unsigned int r = (unsigned int)(uintptr_t)arg;
+	while (!Done) {
+		int i;
+		for (i=0;i<1000;i++) {
+			uint64_t v;
+			r = r * 1103515245 + 12345;
+			uint64_t key = stable_key(r % STABLE_KEYS);
+			if (!cuckoo_find(C, key, &v) || v != key * 3) {
+				fprintf(stderr, "lost key %llu\n", (unsigned long long)key);
+				exit(1);
+			}
+		}
+		ops += 1000;
+	}
+	return (void *)ops;
+}
+
+static void
+test_single(void) {
+	cuckoo_t *c = cuckoo_alloc(16);
+	static unsigned char present[CHURN_KEYS];
+	int i;
+	srand(1);
+	for (i=0;i<2000000;i++) {
+		uint64_t key = rand() % CHURN_KEYS + 1;
+		uint64_t v;
+		int r;
+		// 调用不能放在 assert 里 -DNDEBUG 时会整个消失
+		switch (rand() % 3) {
+		case 0:
+			r = cuckoo_insert(c, key, key * 7);
+			assert(r == !present[key - 1]);
+			present[key - 1] = 1;
+			break;
+		case 1:
+			r = cuckoo_erase(c, key);
+			assert(r == present[key - 1]);
+			present[key - 1] = 0;
+			break;
+		default:
+			r = cuckoo_find(c, key, &v);
+			assert(r == present[key - 1]);
+			assert(!present[key - 1] || v == key * 7);
+			break;
+		}
+		(void)r;
+	}
+	printf("single thread ok, size %zu\n", cuckoo_size(c));
+	cuckoo_destroy(c);
+}
+
+int
+main(int argc, char *argv[]) {
+	int nreader = argc > 1 ? atoi(argv[1]) : 4;
+	pthread_t pid[64];
+	struct timespec t0, t1;
+	long total = 0;
+	int i, round;
+
+	test_single();
+
+	C = cuckoo_alloc(16);
+	for (i=0;i<STABLE_KEYS;i++)
+		cuckoo_insert(C, stable_key(i), stable_key(i) * 3);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i=0;i<nreader;i++)
+		pthread_create(&pid[i], NULL, reader, (void *)(uintptr_t)(i + 1));
+
+	for (round=0;round<CHURN_ROUNDS;round++) {
+		for (i=1;i<=CHURN_KEYS;i++)
+			cuckoo_insert(C, (uint64_t)i * 2, i);
+		for (i=1;i<=CHURN_KEYS;i++)
+			cuckoo_erase(C, (uint64_t)i * 2);
+	}
+	Done = 1;
+	for (i=0;i<nreader;i++) {
+		void *ops;
+		pthread_join(pid[i], &ops);
+		total += (long)ops;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%d readers: %.1f M lookups/s during %d churn rounds, size %zu\n",
+		nreader, total / sec / 1e6, CHURN_ROUNDS, cuckoo_size(C));
+	cuckoo_destroy(C);
+	return 0;
+}
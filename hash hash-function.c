@@ -1,7 +1,27 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// leveldb 里 DecodeFixed32 在 util/coding.h FALLTHROUGH_INTENDED 在 port/port.h 这里给出小端机器上的等价定义
+static inline uint32_t DecodeFixed32(const char* ptr)
+{
+  uint32_t result;
+  memcpy(&result, ptr, sizeof(result));
+  return result;
+}
+// 支持 fallthrough 属性的编译器(gcc 7+ clang 10+)上告诉 -Wimplicit-fallthrough 这里是故意的 否则退回 leveldb 的空语句
+#if defined(__has_attribute)
+#if __has_attribute(fallthrough)
+#define FALLTHROUGH_INTENDED __attribute__((fallthrough))
+#endif
+#endif
+#ifndef FALLTHROUGH_INTENDED
+#define FALLTHROUGH_INTENDED do { } while (0)
+#endif
 
 // =======================================================================================================
 // leveldb 中的哈希函数
-inline uint32_t Hash(const char* data, size_t n, uint32_t seed) 
+static inline uint32_t Hash(const char* data, size_t n, uint32_t seed) 
 {
   // Similar to murmur hash
   const uint32_t m = 0xc6a4a793;
@@ -34,6 +54,12 @@ inline uint32_t Hash(const char* data, size_t n, uint32_t seed)
   }
   return h;
 }
+
+// Hash 是 static inline 的 给别的文件链接用的入口(cuckoo.c 用两个 seed 算两个桶)
+uint32_t LevelDBHash(const char* data, size_t n, uint32_t seed)
+{
+  return Hash(data, n, seed);
+}
 // ================================================================================================
 unsigned int SDBMHash(char *str)
 {
@@ -156,4 +182,485 @@ unsigned int APHash(char *str)
     }
  
     return (hash & 0x7FFFFFFF);
-}
\ No newline at end of file
+}
+// =======================================================================================
+// hash_many: 一次算一批 key 的 leveldb Hash(seed 为 0) 结果和逐个调用 Hash 完全一样
+// AVX2 下 8 个 key 一组 每个 32 位 lane 算一个 key: 每轮从 8 个 key 里各取 4 字节拼成一个向量
+// 做 h += w; h *= m; h ^= h >> 16 已经取完的 lane 用掩码保持不变 最后 1~3 个字节也按 lane 处理
+// 一组的耗时由最长的 key 决定 长度差不多的 key 放在一批里效果最好
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// 和 Hash 的尾部处理一样 data[i] 是 char 符号扩展也要保持一致
+static inline uint32_t hash_tail(const char* data, size_t rest)
+{
+  uint32_t t = 0;
+  switch (rest) {
+    case 3:
+      t += data[2] << 16;
+      FALLTHROUGH_INTENDED;
+    case 2:
+      t += data[1] << 8;
+      FALLTHROUGH_INTENDED;
+    case 1:
+      t += data[0];
+      break;
+  }
+  return t;
+}
+
+#ifdef __AVX2__
+// groups 组(每组 8 个)一起算 乘法延迟有 10 个周期 两组交错可以把它藏起来 groups 是常量 内联后循环会展开
+static inline void hash_many_avx2(const char* const* keys, const size_t* lens, uint32_t* out, int groups)
+{
+  const uint32_t m = 0xc6a4a793;
+  const __m256i vm = _mm256_set1_epi32((int)m);
+  const __m256i four = _mm256_set1_epi64x(4);
+  __m256i h[2], vn[2], lo[2], hi[2], tail[2], hastail[2];
+  size_t maxw = 0, w;
+  int g, j;
+
+  for (g = 0; g < groups; g++) {
+    uint32_t seeds[8], nwords[8], tails[8], mask[8];
+    for (j = 0; j < 8; j++) {
+      size_t len = lens[g * 8 + j];
+      seeds[j] = (uint32_t)(len * m);
+      nwords[j] = (uint32_t)(len / 4);
+      tails[j] = hash_tail(keys[g * 8 + j] + len / 4 * 4, len & 3);
+      mask[j] = (len & 3) ? 0xffffffff : 0;
+      if (len / 4 > maxw)
+        maxw = len / 4;
+    }
+    h[g] = _mm256_loadu_si256((const __m256i*)seeds);
+    vn[g] = _mm256_loadu_si256((const __m256i*)nwords);
+    tail[g] = _mm256_loadu_si256((const __m256i*)tails);
+    hastail[g] = _mm256_loadu_si256((const __m256i*)mask);
+    // 两组 4 个 64 位指针 每轮加 4 用 gather 直接按地址取 取完的 lane 被掩码挡住 不会越界读
+    lo[g] = _mm256_loadu_si256((const __m256i*)(keys + g * 8));
+    hi[g] = _mm256_loadu_si256((const __m256i*)(keys + g * 8 + 4));
+  }
+
+  for (w = 0; w < maxw; w++) {
+    __m256i vw = _mm256_set1_epi32((int)w);
+    for (g = 0; g < groups; g++) {
+      __m256i active = _mm256_cmpgt_epi32(vn[g], vw);
+      __m128i wlo = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), (const int*)0, lo[g],
+          _mm256_castsi256_si128(active), 1);
+      __m128i whi = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), (const int*)0, hi[g],
+          _mm256_extracti128_si256(active, 1), 1);
+      __m256i x = _mm256_add_epi32(h[g], _mm256_inserti128_si256(_mm256_castsi128_si256(wlo), whi, 1));
+      x = _mm256_mullo_epi32(x, vm);
+      x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+      h[g] = _mm256_blendv_epi8(h[g], x, active);       // nwords > w 的 lane 才更新
+      lo[g] = _mm256_add_epi64(lo[g], four);
+      hi[g] = _mm256_add_epi64(hi[g], four);
+    }
+  }
+
+  // 有尾巴的 lane 再做一次 h += t; h *= m; h ^= h >> 24
+  for (g = 0; g < groups; g++) {
+    __m256i x = _mm256_add_epi32(h[g], tail[g]);
+    x = _mm256_mullo_epi32(x, vm);
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 24));
+    _mm256_storeu_si256((__m256i*)(out + g * 8), _mm256_blendv_epi8(h[g], x, hastail[g]));
+  }
+}
+#endif
+
+void hash_many(const char* const* keys, const size_t* lens, size_t n, uint32_t* out)
+{
+  size_t i = 0;
+#ifdef __AVX2__
+  for (; i + 16 <= n; i += 16)
+    hash_many_avx2(keys + i, lens + i, out + i, 2);
+  for (; i + 8 <= n; i += 8)
+    hash_many_avx2(keys + i, lens + i, out + i, 1);
+#endif
+  for (; i < n; i++)
+    out[i] = Hash(keys[i], lens[i], 0);
+}
+// =======================================================================================
+// WYHash: 64 位带 seed 的哈希 按 wyhash(Wang Yi, public domain) final4 的结构实现
+// 核心是 mum: 两个 64 位数相乘 得到 128 位结果的高低两半再异或 一次就能把 128 位输入充分混合
+// 长度 <= 16 的 key 只读两三次 4/8 字节 不走循环 更长的每轮三条独立的链各吃 16 字节(一轮 48 字节)
+static const uint64_t wyp[4] = {
+  0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+static inline void wymum(uint64_t* a, uint64_t* b)
+{
+#if defined(__SIZEOF_INT128__)
+  __uint128_t r = (__uint128_t)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  *a = _umul128(*a, *b, b);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32), lo, hi;
+  uint64_t c = t < rl;
+  lo = t + (rm1 << 32);
+  c += lo < t;
+  hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+  *a = lo;
+  *b = hi;
+#endif
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b)
+{
+  wymum(&a, &b);
+  return a ^ b;
+}
+
+static inline uint64_t wyr8(const uint8_t* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint64_t wyr4(const uint8_t* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline uint64_t wyr3(const uint8_t* p, size_t k)
+{
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint64_t WYHash(const void* key, size_t len, uint64_t seed)
+{
+  const uint8_t* p = (const uint8_t*)key;
+  uint64_t a, b;
+  seed ^= wymix(seed ^ wyp[0], wyp[1]);
+  if (len <= 16) {
+    if (len >= 4) {
+      // 4~16 字节: 头尾各取两个 4 字节 有重叠也没关系
+      a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+      b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = wyr3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+        see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+        see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    // 最后 16 字节 可能和前面读过的重叠
+    a = wyr8(p + i - 16);
+    b = wyr8(p + i - 8);
+  }
+  a ^= wyp[1];
+  b ^= seed;
+  wymum(&a, &b);
+  return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+// =======================================================================================
+// 给 hashfunc_t(unsigned int buckets, void* key) 的表用的哈希函数族 运行时按名字选
+//   hash_t* h = hash_alloc(1024, hash_family("wyhash")->str);
+// hashfunc_t 只传 key 指针 所以每族按 key 的类型给出几个适配函数: 以 0 结尾的字符串 / 4 字节整数
+// seed 是全局的 程序启动时用 hash_set_seed 设成随机数 客户端就构造不出必然冲突的 key
+#ifndef _HASH_H_
+typedef unsigned int (*hashfunc_t)(unsigned int, void*);
+#endif
+
+typedef struct hash_family
+{
+  const char* name;
+  hashfunc_t str;
+  hashfunc_t u32;
+} hash_family_t;
+
+static uint64_t hash_seed;
+
+void hash_set_seed(uint64_t seed)
+{
+  hash_seed = seed;
+}
+
+// 64 位结果取高 32 位乘 buckets 再取高 32 位 映射到 [0, buckets) 比 % 快 也不要求 buckets 是质数
+static inline unsigned int hash_reduce64(uint64_t h, unsigned int buckets)
+{
+  return (unsigned int)(((h >> 32) * buckets) >> 32);
+}
+
+static unsigned int hash_str_wyhash(unsigned int buckets, void* key)
+{
+  return hash_reduce64(WYHash(key, strlen((const char*)key), hash_seed), buckets);
+}
+
+static unsigned int hash_u32_wyhash(unsigned int buckets, void* key)
+{
+  return hash_reduce64(WYHash(key, 4, hash_seed), buckets);
+}
+
+static unsigned int hash_str_leveldb(unsigned int buckets, void* key)
+{
+  return Hash((const char*)key, strlen((const char*)key), (uint32_t)hash_seed) % buckets;
+}
+
+static unsigned int hash_u32_leveldb(unsigned int buckets, void* key)
+{
+  return Hash((const char*)key, 4, (uint32_t)hash_seed) % buckets;
+}
+
+static unsigned int hash_str_bkdr(unsigned int buckets, void* key)
+{
+  return BKDRHash((char*)key) % buckets;
+}
+
+static const hash_family_t hash_families[] = {
+  { "wyhash", hash_str_wyhash, hash_u32_wyhash },
+  { "leveldb", hash_str_leveldb, hash_u32_leveldb },
+  { "bkdr", hash_str_bkdr, NULL },              // 没有 seed 只有字符串版本
+};
+
+// 没有这个名字返回 NULL
+const hash_family_t* hash_family(const char* name)
+{
+  size_t i;
+  for (i = 0; i < sizeof(hash_families) / sizeof(hash_families[0]); i++) {
+    if (strcmp(hash_families[i].name, name) == 0)
+      return &hash_families[i];
+  }
+  return NULL;
+}
+// =======================================================================================
+/*
+ * bench: 每个函数在几种 key 长度分布下的吞吐(GB/s) 以及分布质量 wyhash 只取低 32 位参加比较
+ *   avalanche: 随机 16 字节 key 翻转每一个输入位 统计低 31 位每一位翻转的概率 报告和 0.5 的平均偏差和最大偏差
+ *              (字符串哈希都把最高位清掉了 所以只看低 31 位)
+ *   chi-square: "key000000" 这样连续编号的 key 放进 2^16 个桶(取低位 和表里 & mask 一样)
+ *              报告 (chi2 - B) / sqrt(2B) 均匀分布时大致在 [-3, 3] 之间
+ *   gcc -O2 -mavx2 -x c "hash hash-function.c" -DHASH_FUNCTION_BENCH -o hash_bench && ./hash_bench
+ */
+#ifdef HASH_FUNCTION_BENCH
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#define BENCH_KEYS (1 << 16)
+#define BENCH_BYTES (64 << 20)          // 每个函数每种分布至少处理这么多字节
+#define CHI_BUCKETS (1 << 16)
+#define CHI_KEYS (1 << 20)
+#define AVALANCHE_KEYS 2000
+
+typedef uint32_t (*bench_hash_t)(const char* key, size_t len);
+
+static uint32_t bench_leveldb(const char* key, size_t len) { return Hash(key, len, 0); }
+static uint32_t bench_wyhash(const char* key, size_t len) { return (uint32_t)WYHash(key, len, 0); }
+static uint32_t bench_sdbm(const char* key, size_t len) { (void)len; return SDBMHash((char*)key); }
+static uint32_t bench_rs(const char* key, size_t len) { (void)len; return RSHash((char*)key); }
+static uint32_t bench_js(const char* key, size_t len) { (void)len; return JSHash((char*)key); }
+static uint32_t bench_pjw(const char* key, size_t len) { (void)len; return PJWHash((char*)key); }
+static uint32_t bench_elf(const char* key, size_t len) { (void)len; return ELFHash((char*)key); }
+static uint32_t bench_bkdr(const char* key, size_t len) { (void)len; return BKDRHash((char*)key); }
+static uint32_t bench_djb(const char* key, size_t len) { (void)len; return DJBHash((char*)key); }
+static uint32_t bench_ap(const char* key, size_t len) { (void)len; return APHash((char*)key); }
+
+static struct {
+  const char* name;
+  bench_hash_t func;
+} bench_funcs[] = {
+  { "leveldb", bench_leveldb },
+  { "hash_many", NULL },                // 批量接口 单独处理
+  { "wyhash", bench_wyhash },
+  { "SDBM", bench_sdbm },
+  { "RS", bench_rs },
+  { "JS", bench_js },
+  { "PJW", bench_pjw },
+  { "ELF", bench_elf },
+  { "BKDR", bench_bkdr },
+  { "DJB", bench_djb },
+  { "AP", bench_ap },
+};
+#define BENCH_FUNCS (sizeof(bench_funcs) / sizeof(bench_funcs[0]))
+
+static struct {
+  const char* name;
+  size_t min, max;
+} bench_dists[] = {
+  { "4-12", 4, 12 },
+  { "8", 8, 8 },
+  { "16", 16, 16 },
+  { "16-64", 16, 64 },
+  { "256", 256, 256 },
+};
+#define BENCH_DISTS (sizeof(bench_dists) / sizeof(bench_dists[0]))
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 可打印字符 字符串哈希要以 0 结尾
+static void random_key(char* key, size_t len)
+{
+  size_t i;
+  for (i = 0; i < len; i++)
+    key[i] = (char)(0x21 + rand() % 94);
+  key[len] = 0;
+}
+
+static double bench_throughput(int f, char** keys, size_t* lens, size_t bytes)
+{
+  static uint32_t out[BENCH_KEYS];
+  volatile uint32_t sink = 0;
+  size_t done = 0;
+  double t = now();
+  while (done < BENCH_BYTES) {
+    if (bench_funcs[f].func) {
+      size_t i;
+      uint32_t h = 0;
+      for (i = 0; i < BENCH_KEYS; i++)
+        h ^= bench_funcs[f].func(keys[i], lens[i]);
+      sink ^= h;
+    } else {
+      hash_many((const char* const*)keys, lens, BENCH_KEYS, out);
+      sink ^= out[BENCH_KEYS - 1];
+    }
+    done += bytes;
+  }
+  (void)sink;
+  return done / (now() - t) / 1e9;
+}
+
+static uint32_t bench_one(int f, const char* key, size_t len)
+{
+  uint32_t h;
+  if (bench_funcs[f].func)
+    return bench_funcs[f].func(key, len);
+  hash_many(&key, &len, 1, &h);
+  return h;
+}
+
+static void bench_avalanche(int f, double* mean, double* worst)
+{
+  static int flips[16 * 8][31];
+  int trials[16 * 8] = {0};
+  char key[17];
+  int i, bit, o;
+  memset(flips, 0, sizeof(flips));
+  srand(2);
+  for (i = 0; i < AVALANCHE_KEYS; i++) {
+    random_key(key, 16);
+    uint32_t h = bench_one(f, key, 16);
+    for (bit = 0; bit < 16 * 8; bit++) {
+      key[bit / 8] ^= (char)(1 << (bit % 8));
+      if (key[bit / 8] != 0) {                    // 翻成 0 字符串就截断了 跳过
+        uint32_t d = h ^ bench_one(f, key, 16);
+        for (o = 0; o < 31; o++)
+          flips[bit][o] += (d >> o) & 1;
+        trials[bit]++;
+      }
+      key[bit / 8] ^= (char)(1 << (bit % 8));
+    }
+  }
+  *mean = 0;
+  *worst = 0;
+  for (bit = 0; bit < 16 * 8; bit++) {
+    for (o = 0; o < 31; o++) {
+      double bias = fabs((double)flips[bit][o] / trials[bit] - 0.5);
+      *mean += bias;
+      if (bias > *worst)
+        *worst = bias;
+    }
+  }
+  *mean /= 16 * 8 * 31;
+}
+
+static double bench_chi_square(int f)
+{
+  static int count[CHI_BUCKETS];
+  char key[16];
+  int i;
+  double chi2 = 0, expect = (double)CHI_KEYS / CHI_BUCKETS;
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < CHI_KEYS; i++) {
+    int len = sprintf(key, "key%07d", i);
+    count[bench_one(f, key, len) & (CHI_BUCKETS - 1)]++;
+  }
+  for (i = 0; i < CHI_BUCKETS; i++)
+    chi2 += (count[i] - expect) * (count[i] - expect) / expect;
+  return (chi2 - CHI_BUCKETS) / sqrt(2.0 * CHI_BUCKETS);
+}
+
+int main(void)
+{
+  static char* keys[BENCH_DISTS][BENCH_KEYS];
+  static size_t lens[BENCH_DISTS][BENCH_KEYS];
+  size_t bytes[BENCH_DISTS];
+  size_t d, i;
+  int f;
+
+  srand(1);
+  for (d = 0; d < BENCH_DISTS; d++) {
+    bytes[d] = 0;
+    for (i = 0; i < BENCH_KEYS; i++) {
+      size_t len = bench_dists[d].min + rand() % (bench_dists[d].max - bench_dists[d].min + 1);
+      keys[d][i] = (char*)malloc(len + 1);
+      random_key(keys[d][i], len);
+      lens[d][i] = len;
+      bytes[d] += len;
+    }
+  }
+
+  // wyhash final4 的测试向量 seed 取下标
+  if (WYHash("", 0, 0) != 0x93228a4de0eec5a2ull || WYHash("a", 1, 1) != 0xc5bac3db178713c4ull
+      || WYHash("abc", 3, 2) != 0xa97f2f7b1d9b3314ull) {
+    fprintf(stderr, "WYHash test vector mismatch\n");
+    return 1;
+  }
+
+  // hash_many 必须和 Hash 一致 包括 >= 0x80 的字节
+  for (i = 0; i < BENCH_KEYS; i++) {
+    uint32_t h;
+    char key[40];
+    size_t len = i % 37, j;
+    const char* p = key;
+    for (j = 0; j < len; j++)
+      key[j] = (char)rand();
+    hash_many(&p, &len, 1, &h);
+    if (h != Hash(key, len, 0)) {
+      fprintf(stderr, "hash_many mismatch\n");
+      return 1;
+    }
+  }
+  {
+    static uint32_t out[BENCH_KEYS];
+    hash_many((const char* const*)keys[3], lens[3], BENCH_KEYS, out);
+    for (i = 0; i < BENCH_KEYS; i++) {
+      if (out[i] != Hash(keys[3][i], lens[3][i], 0)) {
+        fprintf(stderr, "hash_many mismatch at %zu\n", i);
+        return 1;
+      }
+    }
+  }
+
+  printf("%-10s", "GB/s");
+  for (d = 0; d < BENCH_DISTS; d++)
+    printf(" %8s", bench_dists[d].name);
+  printf("   aval-mean aval-worst  chi2-z\n");
+  for (f = 0; f < (int)BENCH_FUNCS; f++) {
+    double mean, worst;
+    printf("%-10s", bench_funcs[f].name);
+    for (d = 0; d < BENCH_DISTS; d++)
+      printf(" %8.2f", bench_throughput(f, keys[d], lens[d], bytes[d]));
+    bench_avalanche(f, &mean, &worst);
+    printf("   %9.3f %10.3f %7.1f\n", mean, worst, bench_chi_square(f));
+  }
+  return 0;
+}
+#endif
@@ -31,6 +31,7 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include <windows.h>
 #define inline __inline
+#define THREAD_LOCAL __declspec(thread)
 
 #define atom_cas_long(ptr, oval, nval) (InterlockedCompareExchange((LONG volatile *)ptr, nval, oval) == oval)
 #define atom_cas_pointer(ptr, oval, nval) (InterlockedCompareExchangePointer((PVOID volatile *)ptr, nval, oval) == oval)
@@ -39,9 +40,16 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define atom_sync() MemoryBarrier()
 #define atom_spinlock(ptr) while (InterlockedExchange((LONG volatile *)ptr , 1)) {}
 #define atom_spinunlock(ptr) InterlockedExchange((LONG volatile *)ptr, 0)
+#define atom_xchg(ptr, nval) InterlockedExchange((LONG volatile *)ptr, nval)
+
+// no futex, waiters just give up their time slice
+#define futex_wait(ptr, val) Sleep(0)
+#define futex_wake(ptr, n)
 
 #else
 
+#define THREAD_LOCAL __thread
+
 #define atom_cas_long(ptr, oval, nval) __sync_bool_compare_and_swap(ptr, oval, nval)
 #define atom_cas_pointer(ptr, oval, nval) __sync_bool_compare_and_swap(ptr, oval, nval)
 #define atom_inc(ptr) __sync_add_and_fetch(ptr, 1)
@@ -49,57 +57,169 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #define atom_sync() __sync_synchronize()
 #define atom_spinlock(ptr) while (__sync_lock_test_and_set(ptr,1)) {}
 #define atom_spinunlock(ptr) __sync_lock_release(ptr)
+// full barrier, unlike __sync_lock_test_and_set
+#define atom_xchg(ptr, nval) __atomic_exchange_n(ptr, nval, __ATOMIC_SEQ_CST)
+
+#ifdef __linux__
+
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define futex_wait(ptr, val) syscall(SYS_futex, ptr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0)
+#define futex_wake(ptr, n) syscall(SYS_futex, ptr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0)
+
+#else
+
+#include <sched.h>
+
+#define futex_wait(ptr, val) sched_yield()
+#define futex_wake(ptr, n)
 
 #endif
 
+#endif
+
+#ifndef INT_MAX
+#define INT_MAX 0x7fffffff
+#endif
+
+#define CACHE_LINE 64
+
 /* spin lock */
 #define spin_lock(Q) atom_spinlock(&(Q)->lock)
 #define spin_unlock(Q) atom_spinunlock(&(Q)->lock)
 
 /* read write lock */
 
+/*
+	A big-reader lock: each reader thread is bound to one of RWLOCK_SLOTS
+	counters (round robin on its first rlock, so with no more threads than
+	slots every thread, and thus every cpu, has its own), each on its own
+	cache line. rlock/runlock only touch that line.
+
+	write is 0 (free), 1 (held) or 2 (held, and someone may sleep on it).
+	Once a writer has set it, new readers back off and sleep until it is
+	released, so a stream of readers can't starve writers. The writer then
+	waits for every reader counter to drain, sleeping on the counter after
+	RWLOCK_SPIN tries; the reader that brings it to 0 wakes it up.
+ */
+
+// must be pow of 2
+#ifndef RWLOCK_SLOTS
+#define RWLOCK_SLOTS 32
+#endif
+#define RWLOCK_SPIN 128
+
+struct rwlock_reader {
+	int read;
+	char pad[CACHE_LINE - sizeof(int)];
+};
+
 struct rwlock {
+	struct rwlock_reader reader[RWLOCK_SLOTS];
 	int write;
-	int read;
+	char pad[CACHE_LINE - sizeof(int)];
 };
 
+static THREAD_LOCAL int rwlock_slot = -1;
+static int rwlock_nextslot = 0;
+
+static inline int *
+rwlock_counter(struct rwlock *lock) {
+	if (rwlock_slot < 0) {
+		rwlock_slot = atom_inc(&rwlock_nextslot) & (RWLOCK_SLOTS - 1);
+	}
+	return &lock->reader[rwlock_slot].read;
+}
+
 static inline void
 rwlock_init(struct rwlock *lock) {
+	int i;
+	for (i=0;i<RWLOCK_SLOTS;i++) {
+		lock->reader[i].read = 0;
+	}
 	lock->write = 0;
-	lock->read = 0;
 }
 
+// wait until no writer holds the lock
 static inline void
-rwlock_rlock(struct rwlock *lock) {
-	for (;;) {
-		while(lock->write) {
+rwlock_waitwrite(struct rwlock *lock) {
+	int w, spin = 0;
+	while ((w = lock->write) != 0) {
+		if (++spin < RWLOCK_SPIN) {
 			atom_sync();
+		} else if (w == 2 || atom_cas_long(&lock->write, 1, 2)) {
+			futex_wait(&lock->write, 2);
 		}
-		atom_inc(&lock->read);
-		if (lock->write) {
-			atom_dec(&lock->read);
-		} else {
+	}
+}
+
+// call with write set, wait for all the readers to leave
+static inline void
+rwlock_drain(struct rwlock *lock) {
+	int i, n;
+	for (i=0;i<RWLOCK_SLOTS;i++) {
+		int spin = 0;
+		while ((n = lock->reader[i].read) != 0) {
+			if (++spin < RWLOCK_SPIN) {
+				atom_sync();
+			} else {
+				futex_wait(&lock->reader[i].read, n);
+			}
+		}
+	}
+}
+
+static inline void
+rwlock_rlock(struct rwlock *lock) {
+	int * read = rwlock_counter(lock);
+	for (;;) {
+		atom_inc(read);
+		if (lock->write == 0)
 			break;
+		// a writer is in, or waiting for the readers to leave
+		if (atom_dec(read) == 0) {
+			futex_wake(read, 1);
 		}
+		rwlock_waitwrite(lock);
 	}
 }
 
 static inline void
-rwlock_wlock(struct rwlock *lock) {
-	atom_spinlock(&lock->write);
-	while(lock->read) {
-		atom_sync();
+rwlock_runlock(struct rwlock *lock) {
+	int * read = &lock->reader[rwlock_slot].read;
+	if (atom_dec(read) == 0 && lock->write) {
+		futex_wake(read, 1);
 	}
 }
 
 static inline void
-rwlock_wunlock(struct rwlock *lock) {
-	atom_spinunlock(&lock->write);
+rwlock_wlock(struct rwlock *lock) {
+	if (!atom_cas_long(&lock->write, 0, 1)) {
+		int spin = 0;
+		for (;;) {
+			if (lock->write == 0 && atom_cas_long(&lock->write, 0, 1))
+				break;
+			if (++spin < RWLOCK_SPIN) {
+				atom_sync();
+				continue;
+			}
+			// we can't tell whether others sleep too, so keep it 2
+			if (atom_xchg(&lock->write, 2) == 0)
+				break;
+			futex_wait(&lock->write, 2);
+		}
+	}
+	rwlock_drain(lock);
 }
 
 static inline void
-rwlock_runlock(struct rwlock *lock) {
-	atom_dec(&lock->read);
+rwlock_wunlock(struct rwlock *lock) {
+	if (atom_xchg(&lock->write, 0) == 2) {
+		futex_wake(&lock->write, INT_MAX);
+	}
 }
 
 #endif
@@ -122,6 +242,12 @@ handleid handlemap_new(struct handlemap *, void *ud);
 void * handlemap_grab(struct handlemap *, handleid id);
 void * handlemap_release(struct handlemap *, handleid id);
 
+// Resolve n ids in one go. ud[i] gets what handlemap_grab / handlemap_release
+// would return for id[i] (NULL on failure), the return value is how many
+// of them are not NULL.
+int handlemap_grab_n(struct handlemap *, const handleid *id, int n, void **ud);
+int handlemap_release_n(struct handlemap *, const handleid *id, int n, void **ud);
+
 #endif
 
 
@@ -135,21 +261,196 @@ void * handlemap_release(struct handlemap *, handleid id);
 
 // must be pow of 2
 #define INIT_SLOTS 16
+// slots moved from the old array per handlemap_new / delete during expansion
+#define MIGRATE_STEP 4
+// handlemap_grab_n prefetches this many slots ahead
+#define GRAB_BATCH 16
+
+#ifdef _MSC_VER
+#include <xmmintrin.h>
+#define prefetch(addr) _mm_prefetch((const char *)(addr), _MM_HINT_T0)
+#else
+#define prefetch(addr) __builtin_prefetch((const void *)(addr))
+#endif
+
+/*
+	Readers (handlemap_grab / release_ref) never write shared memory except
+	the ref count of the slot they touch. They enter an epoch, look the slot
+	up through m->array (and m->old during an expansion), and leave. Writers
+	(new / delete / expand) still serialize on the write side of m->lock,
+	and never free a slot or a slot array directly: they retire it, and it
+	is freed only after every reader that could have seen it has left its
+	epoch.
+
+	Define HANDLEMAP_RWLOCK to get the old behaviour (readers take the read
+	lock, retired memory is freed at once), e.g. for benchmark comparison.
+ */
+
+struct epoch_node {
+	struct epoch_node * next;
+};
+
+#ifdef HANDLEMAP_RWLOCK
+
+#define read_begin(m) (rwlock_rlock(&(m)->lock), 1)
+#define read_end(m) rwlock_runlock(&(m)->lock)
+#define retire(node) free(node)
+#define epoch_collect()
+
+#else
+
+// epoch counter is kept in the high bits of epoch_record.state, bit 0 is 'active'
+#define EPOCH_MASK 0x7fffffff
+
+struct epoch_record {
+	union {
+		struct {
+			volatile unsigned state;
+			struct epoch_record * next;
+		} r;
+		char pad[CACHE_LINE];
+	} u;
+};
+
+// One global domain shared by all handlemaps, writers are rare.
+static struct {
+	volatile unsigned epoch;
+	int lock;
+	struct epoch_record * volatile records;
+	struct epoch_node * limbo[3];
+} E;
+
+static THREAD_LOCAL struct epoch_record * T = NULL;
+
+// The record is never freed; after the thread exits it stays inactive and
+// does not hold back the epoch.
+static struct epoch_record *
+epoch_register() {
+	char * p = (char *)malloc(sizeof(struct epoch_record) + CACHE_LINE);
+	struct epoch_record * r;
+	struct epoch_record * head;
+	if (p == NULL)
+		return NULL;
+	r = (struct epoch_record *)(p + CACHE_LINE - ((size_t)p & (CACHE_LINE - 1)));
+	r->u.r.state = 0;
+	do {
+		head = E.records;
+		r->u.r.next = head;
+	} while (!atom_cas_pointer(&E.records, head, r));
+	T = r;
+	return r;
+}
+
+static inline int
+epoch_enter() {
+	struct epoch_record * r = T;
+	if (r == NULL && (r = epoch_register()) == NULL)
+		return 0;
+	r->u.r.state = (E.epoch << 1) | 1;
+	atom_sync();
+	return 1;
+}
+
+static inline void
+epoch_exit() {
+	atom_sync();
+	T->u.r.state = 0;
+}
+
+static void
+free_list(struct epoch_node * n) {
+	while (n) {
+		struct epoch_node * next = n->next;
+		free(n);
+		n = next;
+	}
+}
+
+// call with E.lock held
+static int
+epoch_try_advance() {
+	unsigned g = E.epoch;
+	unsigned next = (g + 1) & EPOCH_MASK;
+	struct epoch_record * r;
+	atom_sync();
+	for (r = E.records; r; r = r->u.r.next) {
+		unsigned s = r->u.r.state;
+		if ((s & 1) && (s >> 1) != g)
+			return 0;
+	}
+	E.epoch = next;
+	atom_sync();
+	// everything retired two epochs ago is unreachable now
+	free_list(E.limbo[next % 3]);
+	E.limbo[next % 3] = NULL;
+	return 1;
+}
+
+static void
+retire(struct epoch_node * n) {
+	spin_lock(&E);
+	n->next = E.limbo[E.epoch % 3];
+	E.limbo[E.epoch % 3] = n;
+	epoch_try_advance();
+	spin_unlock(&E);
+}
+
+static void
+epoch_collect() {
+	int i;
+	spin_lock(&E);
+	for (i=0;i<3;i++) {
+		if (!epoch_try_advance())
+			break;
+	}
+	spin_unlock(&E);
+}
+
+#define read_begin(m) epoch_enter()
+#define read_end(m) epoch_exit()
+
+#endif
 
 struct handleslot {
+	struct epoch_node node;
 	handleid id;
 	int ref;
 	void * ud;
 };
 
+struct slotarray {
+	struct epoch_node node;
+	int cap;
+	struct handleslot * volatile slot[1];
+};
+
+/*
+	expand_map doesn't rehash in one go: it publishes a new array twice as
+	big and keeps the previous one in m->old. Each write that holds the
+	write lock anyway (handlemap_new, and the deletes of release) moves
+	MIGRATE_STEP slots over, starting from m->migrate. Readers never take
+	part, they only check both arrays. A slot is stored in the new array
+	before it is cleared from the old one, so a lookup that checks old first
+	and then array always finds it.
+ */
 struct handlemap {
 	handleid lastid;
 	struct rwlock lock;
-	int cap;
 	int n;
-	struct handleslot * slot;
+	int migrate;
+	struct slotarray * volatile array;
+	struct slotarray * volatile old;
 };
 
+static struct slotarray *
+new_array(int cap) {
+	struct slotarray * a = (struct slotarray *)calloc(1, sizeof(*a) + (cap - 1) * sizeof(a->slot[0]));
+	if (a == NULL)
+		return NULL;
+	a->cap = cap;
+	return a;
+}
+
 struct handlemap * 
 handlemap_init() {
 	struct handlemap * m = (struct handlemap *)malloc(sizeof(*m));
@@ -157,10 +458,11 @@ handlemap_init() {
 		return NULL;
 	m->lastid = 0;
 	rwlock_init(&m->lock);
-	m->cap = INIT_SLOTS;
 	m->n = 0;
-	m->slot = (struct handleslot *)calloc(m->cap, sizeof(*m->slot));
-	if (m->slot == NULL) {
+	m->migrate = 0;
+	m->old = NULL;
+	m->array = new_array(INIT_SLOTS);
+	if (m->array == NULL) {
 		free(m);
 		return NULL;
 	}
@@ -170,57 +472,106 @@ handlemap_init() {
 void
 handlemap_exit(struct handlemap *m) {
 	if (m) {
-		free(m->slot);
+		int i;
+		if (m->old) {
+			for (i=0;i<m->old->cap;i++) {
+				free(m->old->slot[i]);
+			}
+			free(m->old);
+		}
+		for (i=0;i<m->array->cap;i++) {
+			free(m->array->slot[i]);
+		}
+		free(m->array);
 		free(m);
+		epoch_collect();
+	}
+}
+
+// call with the write lock held
+static void
+migrate_slots(struct handlemap *m, int step) {
+	struct slotarray * oa = m->old;
+	struct slotarray * na = m->array;
+	int i;
+	if (oa == NULL)
+		return;
+	for (i = m->migrate; i < oa->cap && step > 0; i++) {
+		struct handleslot * s = oa->slot[i];
+		if (s) {
+			na->slot[s->id & (na->cap - 1)] = s;
+			atom_sync();
+			oa->slot[i] = NULL;
+			--step;
+		}
+	}
+	m->migrate = i;
+	if (i == oa->cap) {
+		m->old = NULL;
+		atom_sync();
+		retire(&oa->node);
 	}
 }
 
 static struct handlemap *
 expand_map(struct handlemap *m) {
-	int i,cap = m->cap;
-	struct handleslot * nslot;
-	nslot = (struct handleslot *)calloc(cap * 2, sizeof(*nslot));
-	if (nslot == NULL) {
-		return NULL;
+	struct slotarray * oa;
+	struct slotarray * na;
+	if (m->old) {
+		// the table grew faster than the migration, finish it first
+		migrate_slots(m, m->old->cap);
 	}
-	for (i=0;i<cap;i++) {
-		struct handleslot * os = &m->slot[i];
-		struct handleslot * ns = &nslot[os->id & (cap * 2 -1)];
-		*ns = *os;
+	oa = m->array;
+	na = new_array(oa->cap * 2);
+	if (na == NULL) {
+		return NULL;
 	}
-	free(m->slot);
-	m->slot = nslot;
-	m->cap = cap * 2;
+	m->migrate = 0;
+	m->old = oa;
+	atom_sync();
+	m->array = na;
 	return m;
 }
 
 handleid
 handlemap_new(struct handlemap *m, void *ud) {
-	int i;
 	if (ud == NULL)
 		return 0;
 	rwlock_wlock(&m->lock);
-	if (m->n >= m->cap * 3 / 4) {
+	if (m->n >= m->array->cap * 3 / 4) {
 		if (expand_map(m) == NULL) {
 			// memory overflow
 			rwlock_wunlock(&m->lock);
 			return 0;
 		}
 	}
+	migrate_slots(m, MIGRATE_STEP);
 	
-	for (i=0;;i++) {
+	for (;;) {
+		struct slotarray * a = m->array;
+		struct slotarray * oa = m->old;
 		struct handleslot *slot;
 		handleid id = ++m->lastid;
 		if (id == 0) {
 			// 0 is reserved for invalid id
 			id = ++m->lastid;
 		}
-		slot = &m->slot[id & (m->cap - 1)];
-		if (slot->id)
+		if (a->slot[id & (a->cap - 1)])
 			continue;
+		// a slot not migrated yet may land on the same index later
+		if (oa && oa->slot[id & (oa->cap - 1)])
+			continue;
+		slot = (struct handleslot *)malloc(sizeof(*slot));
+		if (slot == NULL) {
+			rwlock_wunlock(&m->lock);
+			return 0;
+		}
 		slot->id = id;
 		slot->ref = 1;
 		slot->ud = ud;
+		// slot must be complete before readers can see it
+		atom_sync();
+		a->slot[id & (a->cap - 1)] = slot;
 		++m->n;
 
 		rwlock_wunlock(&m->lock);
@@ -228,25 +579,78 @@ handlemap_new(struct handlemap *m, void *ud) {
 	}
 }
 
+// call inside read_begin/read_end, each cell is read only once
+static inline struct handleslot *
+find_slot(struct handlemap *m, handleid id) {
+	for (;;) {
+		struct slotarray * a = m->array;
+		struct slotarray * oa = m->old;
+		struct handleslot * slot;
+		if (oa) {
+			slot = oa->slot[id & (oa->cap - 1)];
+			if (slot && slot->id == id)
+				return slot;
+		}
+		slot = a->slot[id & (a->cap - 1)];
+		if (slot && slot->id == id)
+			return slot;
+		// an expansion started (or finished) under us, look again
+		if (a == m->array)
+			return NULL;
+	}
+}
+
+// call with the write lock held
+static struct handleslot * volatile *
+find_cell(struct handlemap *m, handleid id) {
+	struct slotarray * oa = m->old;
+	struct handleslot * volatile * cell;
+	if (oa) {
+		cell = &oa->slot[id & (oa->cap - 1)];
+		if (*cell && (*cell)->id == id)
+			return cell;
+	}
+	cell = &m->array->slot[id & (m->array->cap - 1)];
+	if (*cell && (*cell)->id == id)
+		return cell;
+	return NULL;
+}
+
 static void *
 release_ref(struct handlemap *m, handleid id) {
 	struct handleslot * slot;
 	void * ud = NULL;
 	if (id == 0)
 		return NULL;
-	rwlock_rlock(&m->lock);
-	slot = &m->slot[id & (m->cap - 1)];
-	if (slot->id != id) {
-		rwlock_runlock(&m->lock);
+	if (!read_begin(m))
+		return NULL;
+	slot = find_slot(m, id);
+	if (slot == NULL) {
+		read_end(m);
 		return NULL;
 	}
 	if (atom_dec(&slot->ref) <= 0) {
 		ud = slot->ud;
 	}
-	rwlock_runlock(&m->lock);
+	read_end(m);
 	return ud;
 }
 
+// call with the write lock held, the caller retires the slot returned
+static struct handleslot *
+delete_slot(struct handlemap *m, handleid id) {
+	struct handleslot * volatile * cell = find_cell(m, id);
+	struct handleslot * slot;
+	if (cell == NULL)
+		return NULL;
+	slot = *cell;
+	if (slot->ref > 0)
+		return NULL;
+	*cell = NULL;
+	--m->n;
+	return slot;
+}
+
 static void *
 try_delete(struct handlemap *m, handleid id) {
 	struct handleslot * slot;
@@ -254,37 +658,41 @@ try_delete(struct handlemap *m, handleid id) {
 	if (id == 0)
 		return NULL;
 	rwlock_wlock(&m->lock);
-	slot = &m->slot[id & (m->cap - 1)];
-	if (slot->id != id) {
-		rwlock_wunlock(&m->lock);
-		return NULL;
-	}
-	if (slot->ref > 0) {
-		rwlock_wunlock(&m->lock);
+	slot = delete_slot(m, id);
+	migrate_slots(m, MIGRATE_STEP);
+	rwlock_wunlock(&m->lock);
+	if (slot == NULL)
 		return NULL;
-	}
 	ud = slot->ud;
-	slot->id = 0;
-	--m->n;
-	rwlock_wunlock(&m->lock);
+	retire(&slot->node);
 	return ud;
 }
 
+static inline void *
+grab_slot(struct handleslot * slot) {
+	// a slot whose ref has dropped to 0 is being deleted, never revive it
+	int ref;
+	while ((ref = slot->ref) > 0) {
+		if (atom_cas_long(&slot->ref, ref, ref + 1)) {
+			return slot->ud;
+		}
+	}
+	return NULL;
+}
+
 void *
 handlemap_grab(struct handlemap *m, handleid id) {
 	struct handleslot * slot;
-	void * ud;
+	void * ud = NULL;
 	if (id == 0)
 		return NULL;
-	rwlock_rlock(&m->lock);
-	slot = &m->slot[id & (m->cap - 1)];
-	if (slot->id != id) {
-		rwlock_runlock(&m->lock);
+	if (!read_begin(m))
 		return NULL;
+	slot = find_slot(m, id);
+	if (slot) {
+		ud = grab_slot(slot);
 	}
-	atom_inc(&slot->ref);
-	ud = slot->ud;
-	rwlock_runlock(&m->lock);
+	read_end(m);
 	return ud;
 }
 
@@ -297,6 +705,374 @@ handlemap_release(struct handlemap *m, handleid id) {
 	}
 }
 
+// the cells an id may be in, read before any slot is dereferenced
+struct slotref {
+	struct handleslot * old;
+	struct handleslot * cur;
+};
+
+/*
+	A batch lookup runs in three stages so that the misses of one stage
+	overlap: prefetch the array cells of id[0..n), read the raw slot
+	pointers out of them and prefetch the slots, then (resolve_slot) check
+	the ids. Cells are read in the same order as find_slot: m->array before
+	m->old, the old cell before the new one. Returns the array it used.
+ */
+static struct slotarray *
+prefetch_slots(struct handlemap *m, const handleid *id, int n, struct slotref *ref) {
+	struct slotarray * a = m->array;
+	struct slotarray * oa = m->old;
+	int i;
+	for (i=0;i<n;i++) {
+		prefetch(&a->slot[id[i] & (a->cap - 1)]);
+		if (oa) {
+			prefetch(&oa->slot[id[i] & (oa->cap - 1)]);
+		}
+	}
+	for (i=0;i<n;i++) {
+		ref[i].old = oa ? oa->slot[id[i] & (oa->cap - 1)] : NULL;
+		ref[i].cur = a->slot[id[i] & (a->cap - 1)];
+		if (ref[i].old) {
+			prefetch(ref[i].old);
+		}
+		if (ref[i].cur) {
+			prefetch(ref[i].cur);
+		}
+	}
+	return a;
+}
+
+static inline struct handleslot *
+resolve_slot(struct handlemap *m, struct slotarray *a, handleid id, const struct slotref *ref) {
+	if (id == 0)
+		return NULL;
+	if (ref->old && ref->old->id == id)
+		return ref->old;
+	if (ref->cur && ref->cur->id == id)
+		return ref->cur;
+	// an expansion started (or finished) after the cells were read
+	if (a != m->array)
+		return find_slot(m, id);
+	return NULL;
+}
+
+int
+handlemap_grab_n(struct handlemap *m, const handleid *id, int n, void **ud) {
+	struct slotref ref[GRAB_BATCH];
+	int i, j, count = 0;
+	if (!read_begin(m)) {
+		for (i=0;i<n;i++) {
+			ud[i] = NULL;
+		}
+		return 0;
+	}
+	for (i=0;i<n;i+=GRAB_BATCH) {
+		int batch = n - i < GRAB_BATCH ? n - i : GRAB_BATCH;
+		struct slotarray * a = prefetch_slots(m, id + i, batch, ref);
+		for (j=0;j<batch;j++) {
+			struct handleslot * slot = resolve_slot(m, a, id[i+j], &ref[j]);
+			ud[i+j] = slot ? grab_slot(slot) : NULL;
+			if (ud[i+j])
+				++count;
+		}
+	}
+	read_end(m);
+	return count;
+}
+
+int
+handlemap_release_n(struct handlemap *m, const handleid *id, int n, void **ud) {
+	struct slotref ref[GRAB_BATCH];
+	int i, j, dead = 0, count = 0;
+	if (!read_begin(m)) {
+		for (i=0;i<n;i++) {
+			ud[i] = NULL;
+		}
+		return 0;
+	}
+	for (i=0;i<n;i+=GRAB_BATCH) {
+		int batch = n - i < GRAB_BATCH ? n - i : GRAB_BATCH;
+		struct slotarray * a = prefetch_slots(m, id + i, batch, ref);
+		for (j=0;j<batch;j++) {
+			struct handleslot * slot = resolve_slot(m, a, id[i+j], &ref[j]);
+			// mark the ones to delete, as in release_ref
+			ud[i+j] = slot && atom_dec(&slot->ref) <= 0 ? (void *)1 : NULL;
+			dead += ud[i+j] != NULL;
+		}
+	}
+	read_end(m);
+	if (dead == 0)
+		return 0;
+
+	rwlock_wlock(&m->lock);
+	for (i=0;i<n;i++) {
+		if (ud[i]) {
+			struct handleslot * s = delete_slot(m, id[i]);
+			ud[i] = s;
+		}
+	}
+	migrate_slots(m, MIGRATE_STEP);
+	rwlock_wunlock(&m->lock);
+	for (i=0;i<n;i++) {
+		if (ud[i]) {
+			struct handleslot * s = (struct handleslot *)ud[i];
+			ud[i] = s->ud;
+			retire(&s->node);
+			++count;
+		}
+	}
+	return count;
+}
+
+// slotmap.h file
+
+#ifndef SLOT_MAP_H
+#define SLOT_MAP_H
+
+#include <stdint.h>
+
+/*
+	A handlemap alternative for large, churning handle sets. An id is
+	(generation << 32 | index): index picks an entry of the sparse array,
+	which points into a packed array of live values. new and delete are
+	O(1) with no probing (free indices are kept on a list, deletion moves
+	the last value into the hole), a stale id never matches once its entry
+	is reused because the generation has moved on, and slotmap_foreach
+	walks the live values contiguously.
+ */
+
+typedef uint64_t slotid;
+
+struct slotmap;
+
+typedef void (*slotmap_cb)(void *ud, slotid id, void *value);
+
+struct slotmap * slotmap_init();
+void slotmap_exit(struct slotmap *);
+
+slotid slotmap_new(struct slotmap *, void *value);
+void * slotmap_grab(struct slotmap *, slotid id);
+void * slotmap_release(struct slotmap *, slotid id);
+
+// live handle count
+int slotmap_size(struct slotmap *);
+// cb runs under the read lock, it must not call slotmap_new/release
+void slotmap_foreach(struct slotmap *, slotmap_cb cb, void *ud);
+
+#endif
+
+
+// slotmap.c file
+
+#include "slotmap.h"
+#include "simplelock.h"
+
+#include <stdlib.h>
+
+#define SLOTMAP_INIT 16
+#define SLOTMAP_INDEX(id) ((unsigned int)((id) & 0xffffffff))
+#define SLOTMAP_GEN(id) ((unsigned int)((id) >> 32))
+
+struct slotentry {
+	// odd while the entry is live, bumped on every new and delete
+	unsigned int gen;
+	// position in slotmap.value when live, next free index + 1 otherwise
+	unsigned int next;
+};
+
+struct slotvalue {
+	slotid id;
+	int ref;
+	void * value;
+};
+
+struct slotmap {
+	struct rwlock lock;
+	unsigned int n;
+	unsigned int cap;
+	unsigned int freelist;
+	struct slotentry * entry;
+	struct slotvalue * value;
+};
+
+// push entry[from..to) on the free list, call with the write lock held
+static void
+free_range(struct slotmap *m, unsigned int from, unsigned int to) {
+	unsigned int i;
+	for (i=to;i>from;i--) {
+		m->entry[i-1].gen = 0;
+		m->entry[i-1].next = m->freelist;
+		m->freelist = i;
+	}
+}
+
+struct slotmap *
+slotmap_init() {
+	struct slotmap * m = (struct slotmap *)malloc(sizeof(*m));
+	if (m == NULL)
+		return NULL;
+	rwlock_init(&m->lock);
+	m->n = 0;
+	m->cap = SLOTMAP_INIT;
+	m->freelist = 0;
+	m->entry = (struct slotentry *)malloc(m->cap * sizeof(*m->entry));
+	m->value = (struct slotvalue *)malloc(m->cap * sizeof(*m->value));
+	if (m->entry == NULL || m->value == NULL) {
+		free(m->entry);
+		free(m->value);
+		free(m);
+		return NULL;
+	}
+	free_range(m, 0, m->cap);
+	return m;
+}
+
+void
+slotmap_exit(struct slotmap *m) {
+	if (m) {
+		free(m->entry);
+		free(m->value);
+		free(m);
+	}
+}
+
+static int
+expand_slotmap(struct slotmap *m) {
+	unsigned int cap = m->cap * 2;
+	struct slotentry * entry;
+	struct slotvalue * value;
+	if (cap <= m->cap)
+		return 0;
+	entry = (struct slotentry *)realloc(m->entry, cap * sizeof(*entry));
+	if (entry == NULL)
+		return 0;
+	m->entry = entry;
+	value = (struct slotvalue *)realloc(m->value, cap * sizeof(*value));
+	if (value == NULL)
+		return 0;
+	m->value = value;
+	free_range(m, m->cap, cap);
+	m->cap = cap;
+	return 1;
+}
+
+slotid
+slotmap_new(struct slotmap *m, void *value) {
+	struct slotentry * e;
+	struct slotvalue * v;
+	unsigned int index;
+	if (value == NULL)
+		return 0;
+	rwlock_wlock(&m->lock);
+	if (m->freelist == 0 && !expand_slotmap(m)) {
+		// memory overflow
+		rwlock_wunlock(&m->lock);
+		return 0;
+	}
+	index = m->freelist - 1;
+	e = &m->entry[index];
+	m->freelist = e->next;
+	++e->gen;
+	e->next = m->n;
+	v = &m->value[m->n++];
+	v->id = (slotid)e->gen << 32 | index;
+	v->ref = 1;
+	v->value = value;
+	rwlock_wunlock(&m->lock);
+	return v->id;
+}
+
+// call with the lock held
+static inline struct slotvalue *
+find_value(struct slotmap *m, slotid id) {
+	unsigned int index = SLOTMAP_INDEX(id);
+	struct slotentry * e;
+	if (index >= m->cap)
+		return NULL;
+	e = &m->entry[index];
+	if (e->gen != SLOTMAP_GEN(id) || !(e->gen & 1))
+		return NULL;
+	return &m->value[e->next];
+}
+
+void *
+slotmap_grab(struct slotmap *m, slotid id) {
+	struct slotvalue * v;
+	void * value = NULL;
+	rwlock_rlock(&m->lock);
+	v = find_value(m, id);
+	if (v) {
+		// don't revive a value whose ref has dropped to 0
+		int ref;
+		while ((ref = v->ref) > 0) {
+			if (atom_cas_long(&v->ref, ref, ref + 1)) {
+				value = v->value;
+				break;
+			}
+		}
+	}
+	rwlock_runlock(&m->lock);
+	return value;
+}
+
+static void *
+try_remove(struct slotmap *m, slotid id) {
+	struct slotvalue * v;
+	struct slotvalue * last;
+	struct slotentry * e;
+	void * value;
+	rwlock_wlock(&m->lock);
+	v = find_value(m, id);
+	if (v == NULL || v->ref > 0) {
+		rwlock_wunlock(&m->lock);
+		return NULL;
+	}
+	value = v->value;
+	e = &m->entry[SLOTMAP_INDEX(id)];
+	// keep the values packed: move the last one into the hole
+	last = &m->value[--m->n];
+	if (last != v) {
+		*v = *last;
+		m->entry[SLOTMAP_INDEX(v->id)].next = e->next;
+	}
+	++e->gen;
+	e->next = m->freelist;
+	m->freelist = SLOTMAP_INDEX(id) + 1;
+	rwlock_wunlock(&m->lock);
+	return value;
+}
+
+void *
+slotmap_release(struct slotmap *m, slotid id) {
+	struct slotvalue * v;
+	int dead = 0;
+	rwlock_rlock(&m->lock);
+	v = find_value(m, id);
+	if (v && atom_dec(&v->ref) <= 0) {
+		dead = 1;
+	}
+	rwlock_runlock(&m->lock);
+	return dead ? try_remove(m, id) : NULL;
+}
+
+int
+slotmap_size(struct slotmap *m) {
+	return m->n;
+}
+
+void
+slotmap_foreach(struct slotmap *m, slotmap_cb cb, void *ud) {
+	unsigned int i;
+	rwlock_rlock(&m->lock);
+	for (i=0;i<m->n;i++) {
+		struct slotvalue * v = &m->value[i];
+		if (v->ref > 0) {
+			cb(ud, v->id, v->value);
+		}
+	}
+	rwlock_runlock(&m->lock);
+}
+
 // test.c file 
 
 /*
@@ -442,3 +1218,233 @@ main() {
 
 	return 0;
 }
+
+
+// bench.c file
+
+/*
+
+Grab/release throughput with N reader threads, compare the epoch read path
+with the rwlock one:
+	gcc -O2 handlemap.c bench.c -lpthread -o bench_epoch
+	gcc -O2 -DHANDLEMAP_RWLOCK handlemap.c bench.c -lpthread -o bench_rwlock
+	./bench_epoch 32
+	./bench_epoch 32 64	# handlemap_grab_n / release_n, 64 ids per call
+
+A writer thread keeps creating handles (up to BENCH_GROW live ones) so the
+map expands many times while the readers are busy; every 16th grab is timed
+to report the latency percentiles.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "handlemap.h"
+
+#define BENCH_HANDLES 4096
+#define BENCH_OPS 2000000
+#define BENCH_GROW (1 << 20)
+// latency histogram, bucket i counts grabs taking [i*LAT_NS, (i+1)*LAT_NS) ns
+#define LAT_NS 16
+#define LAT_BUCKETS 4096
+
+static handleid bench_pool[BENCH_HANDLES];
+static handleid bench_grow[BENCH_GROW];
+static volatile int bench_stop = 0;
+
+#define BENCH_MAXBATCH 256
+
+static int bench_batch = 1;
+
+struct bench_reader_arg {
+	struct handlemap *m;
+	unsigned int lat[LAT_BUCKETS];
+};
+
+static uint64_t
+now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+bench_reader_n(void *p) {
+	struct bench_reader_arg *arg = p;
+	unsigned int seed = (unsigned int)(uintptr_t)&seed;
+	handleid id[BENCH_MAXBATCH];
+	void * ud[BENCH_MAXBATCH];
+	int i, j;
+	for (i=0;i<BENCH_OPS;i+=bench_batch) {
+		uint64_t t;
+		for (j=0;j<bench_batch;j++) {
+			id[j] = bench_pool[rand_r(&seed) % BENCH_HANDLES];
+		}
+		t = now_ns();
+		handlemap_grab_n(arg->m, id, bench_batch, ud);
+		// per id latency
+		t = (now_ns() - t) / bench_batch / LAT_NS;
+		arg->lat[t < LAT_BUCKETS ? t : LAT_BUCKETS - 1] += bench_batch / 16 + 1;
+		handlemap_release_n(arg->m, id, bench_batch, ud);
+	}
+	return NULL;
+}
+
+static void *
+bench_reader(void *p) {
+	struct bench_reader_arg *arg = p;
+	unsigned int seed = (unsigned int)(uintptr_t)&seed;
+	int i;
+	for (i=0;i<BENCH_OPS;i++) {
+		handleid id = bench_pool[rand_r(&seed) % BENCH_HANDLES];
+		void * ud;
+		if ((i & 15) == 0) {
+			uint64_t t = now_ns();
+			ud = handlemap_grab(arg->m, id);
+			t = (now_ns() - t) / LAT_NS;
+			++arg->lat[t < LAT_BUCKETS ? t : LAT_BUCKETS - 1];
+		} else {
+			ud = handlemap_grab(arg->m, id);
+		}
+		if (ud) {
+			handlemap_release(arg->m, id);
+		}
+	}
+	return NULL;
+}
+
+static void *
+bench_writer(void *p) {
+	struct handlemap *m = p;
+	int i;
+	for (i=0;i<BENCH_GROW && !bench_stop;i++) {
+		bench_grow[i] = handlemap_new(m, (void *)1);
+	}
+	return NULL;
+}
+
+static unsigned int
+percentile(unsigned int *lat, uint64_t total, double p) {
+	uint64_t sum = 0;
+	int i;
+	for (i=0;i<LAT_BUCKETS;i++) {
+		sum += lat[i];
+		if (sum >= total * p)
+			break;
+	}
+	return (i + 1) * LAT_NS;
+}
+
+int
+main(int argc, char *argv[]) {
+	int i, j, nthread = argc > 1 ? atoi(argv[1]) : 4;
+	pthread_t writer;
+	pthread_t *readers;
+	struct bench_reader_arg *args;
+	struct handlemap * m = handlemap_init();
+	static unsigned int lat[LAT_BUCKETS];
+	uint64_t t, samples = 0;
+
+	if (nthread <= 0)
+		nthread = 1;
+	if (argc > 2)
+		bench_batch = atoi(argv[2]);
+	if (bench_batch <= 0 || bench_batch > BENCH_MAXBATCH)
+		bench_batch = 1;
+	readers = (pthread_t *)malloc(nthread * sizeof(pthread_t));
+	args = (struct bench_reader_arg *)calloc(nthread, sizeof(*args));
+	for (i=0;i<BENCH_HANDLES;i++) {
+		bench_pool[i] = handlemap_new(m, (void *)((intptr_t)i+1));
+	}
+
+	pthread_create(&writer, NULL, bench_writer, m);
+	t = now_ns();
+	for (i=0;i<nthread;i++) {
+		args[i].m = m;
+		pthread_create(&readers[i], NULL, bench_batch > 1 ? bench_reader_n : bench_reader, &args[i]);
+	}
+	for (i=0;i<nthread;i++) {
+		pthread_join(readers[i], NULL);
+		for (j=0;j<LAT_BUCKETS;j++) {
+			lat[j] += args[i].lat[j];
+			samples += args[i].lat[j];
+		}
+	}
+	t = now_ns() - t;
+	bench_stop = 1;
+	pthread_join(writer, NULL);
+
+#ifdef HANDLEMAP_RWLOCK
+	printf("rwlock: ");
+#else
+	printf("epoch: ");
+#endif
+	printf("%d threads, batch %d, %.2f M grab+release/s, grab p50 %uns p99 %uns p99.9 %uns\n",
+		nthread, bench_batch, (double)nthread * BENCH_OPS * 1000 / t,
+		percentile(lat, samples, 0.5), percentile(lat, samples, 0.99), percentile(lat, samples, 0.999));
+
+	for (i=0;i<BENCH_HANDLES;i++) {
+		handlemap_release(m, bench_pool[i]);
+	}
+	for (i=0;i<BENCH_GROW;i++) {
+		handlemap_release(m, bench_grow[i]);
+	}
+	handlemap_exit(m);
+	free(args);
+	free(readers);
+	return 0;
+}
+
+
+// slotmap_test.c file
+
+/*
+
+	gcc slotmap.c slotmap_test.c -lpthread
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "slotmap.h"
+
+#define SLOT_N 1000
+
+static slotid slots[SLOT_N];
+
+static void
+sweep(void *ud, slotid id, void *value) {
+	int * count = ud;
+	(void)id;
+	(void)value;
+	++*count;
+}
+
+int
+main() {
+	struct slotmap * m = slotmap_init();
+	int i, count = 0;
+	for (i=0;i<SLOT_N;i++) {
+		slots[i] = slotmap_new(m, (void *)((intptr_t)i+1));
+	}
+	// drop every other handle, their entries get reused by the next batch
+	for (i=0;i<SLOT_N;i+=2) {
+		slotmap_release(m, slots[i]);
+	}
+	for (i=0;i<SLOT_N/2;i++) {
+		slotmap_new(m, (void *)((intptr_t)i+1));
+	}
+	printf("stale id %llx grab = %p\n", (unsigned long long)slots[0], slotmap_grab(m, slots[0]));
+	printf("live id %llx grab = %p\n", (unsigned long long)slots[1], slotmap_grab(m, slots[1]));
+	slotmap_release(m, slots[1]);
+
+	slotmap_foreach(m, sweep, &count);
+	printf("size = %d, foreach = %d\n", slotmap_size(m), count);
+
+	slotmap_exit(m);
+	return 0;
+}
@@ -1,4 +1,24 @@
 
+#include <string>
+#include <cstring>
+#include <cassert>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+
+// Hash DecodeFixed32 FALLTHROUGH_INTENDED 都在这里 它的 bench main 在 HASH_FUNCTION_BENCH 后面 不会重复定义
+#include "hash hash-function.c"
+
+using std::string;
+
 // LRU cache implementation
 
 // An entry is a variable length heap-allocated structure.  Entries
@@ -18,6 +38,8 @@ struct LRUHandle
   size_t key_length;   
   uint32_t refs;      
   uint32_t hash;      // Hash of key();  
+  bool in_cache;      // 是否还在 cache 里(hash 表和 LRUCache 的某个链表上)
+  uint32_t segment;   // TinyLFUCache 中所在的段
   char key_data[1];  
   
   string key() const {  
@@ -30,7 +52,104 @@ struct LRUHandle
   }
 };
 
+// 分块 Bloom filter(split block bloom filter): 每个块 256 位 = 8 个 32 位字 按 32 字节对齐 不会跨 cache line
+// 一个 key 只落在一个块里 块里的每个字各置一位 位置由 hash 乘上各自的奇数 salt 取高 5 位得到
+// 查询只读一个块 AVX2 下 8 个字的位一次算出来用 testc 比较 其他平台逐字比较
+// 误判率比普通 Bloom filter 略高(同样每 key 10 位大约 1% 左右) 换来每次查询只碰一条 cache line
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+class BlockedBloom {
+ public:
+  BlockedBloom() : blocks_(NULL), num_blocks_(0) { }
+  ~BlockedBloom() { free(blocks_); }
+
+  // 按 keys 个 key 每个 bits_per_key 位分配 全部清零
+  void Init(uint32_t keys, uint32_t bits_per_key) {
+    free(blocks_);
+    num_blocks_ = (uint32_t)(((uint64_t)keys * bits_per_key + 255) / 256);
+    if (num_blocks_ == 0) {
+      num_blocks_ = 1;
+    }
+    blocks_ = reinterpret_cast<uint32_t*>(aligned_alloc(32, (size_t)num_blocks_ * 32));
+    assert(blocks_ != NULL);
+    memset(blocks_, 0, (size_t)num_blocks_ * 32);
+  }
+  void Clear() {
+    free(blocks_);
+    blocks_ = NULL;
+    num_blocks_ = 0;
+  }
+  bool Empty() const { return blocks_ == NULL; }
+  void Swap(BlockedBloom& other) {
+    std::swap(blocks_, other.blocks_);
+    std::swap(num_blocks_, other.num_blocks_);
+  }
+
+  void Add(uint32_t hash) {
+    uint32_t* b = Block(hash);
+    for (int i = 0; i < 8; i++) {
+      b[i] |= 1u << ((hash * kSalt[i]) >> 27);
+    }
+  }
+
+  bool MayContain(uint32_t hash) const {
+    const uint32_t* b = Block(hash);
+#ifdef __AVX2__
+    const __m256i salt = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(kSalt));
+    __m256i shift = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(hash), salt), 27);
+    __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), shift);
+    // testc: (~block & mask) 全 0 即 mask 的位在块里都是 1
+    return _mm256_testc_si256(_mm256_load_si256(reinterpret_cast<const __m256i*>(b)), mask);
+#else
+    for (int i = 0; i < 8; i++) {
+      if ((b[i] & (1u << ((hash * kSalt[i]) >> 27))) == 0) {
+        return false;
+      }
+    }
+    return true;
+#endif
+  }
+
+  void Prefetch(uint32_t hash) const { __builtin_prefetch(Block(hash)); }
+
+  size_t Bytes() const { return (size_t)num_blocks_ * 32; }
+
+  // 随机一个不在集合里的 hash 被误判的概率: 落到每个块的概率相同 块内 8 个字各自命中的概率是 置位数/32
+  double EstimatedFpr() const {
+    double sum = 0;
+    for (uint32_t i = 0; i < num_blocks_; i++) {
+      double p = 1;
+      for (int j = 0; j < 8; j++) {
+        p *= __builtin_popcount(blocks_[i * 8 + j]) / 32.0;
+      }
+      sum += p;
+    }
+    return num_blocks_ == 0 ? 0 : sum / num_blocks_;
+  }
+
+ private:
+  static const uint32_t kSalt[8];
+
+  // 块号用 hash 的高位做 multiply-shift 桶号用的是低位 两者不相关
+  uint32_t* Block(uint32_t hash) const {
+    return blocks_ + (((uint64_t)hash * num_blocks_) >> 32) * 8;
+  }
+
+  uint32_t* blocks_;
+  uint32_t num_blocks_;
+};
+
+const uint32_t BlockedBloom::kSalt[8] = {
+  0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+  0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
 // 这里的hashtable 不负责释放保存指针指向的内存块
+// 扩容是渐进式的(和 redis 的 dict 一样): Resize 只分配新的桶数组 旧数组保存在 old_list_
+// 之后每次 Insert/Lookup/Remove 搬 kRehashStep 个旧桶 搬完之前 FindPointer 两个数组都要查
+// 这样单次 Insert 的最坏耗时不再和元素个数成正比
 class HandleTable {
 private:
  // The table consists of an array of buckets where each bucket is
@@ -39,30 +158,135 @@ private:
  uint32_t elems_;   
  LRUHandle** list_; 
 
-public:
-  HandleTable() : length_(0), elems_(0), list_(NULL) { Resize(); }
-  ~HandleTable() { delete[] list_; }
+ // 正在搬迁的旧桶数组 没有在扩容时为 NULL
+ // old_list_[0, rehash_index_) 已经搬空了
+ uint32_t old_length_;
+ uint32_t rehash_index_;
+ LRUHandle** old_list_;
+
+ static const uint32_t kRehashStep = 2;
+ static const uint32_t kBloomScanStep = 8;
+
+ // 可选的 Bloom filter bits_per_key_ 为 0 时不启用
+ // bloom_ 覆盖 list_ 里的节点 按 length_ 分配 扩容中 old_bloom_ 覆盖还没搬走的 old_list_
+ // 搬一个节点就往 bloom_ 里加一个 搬完 old_bloom_ 释放 这样扩容也顺带把删掉的 key 留下的位清掉了
+ // 删除不能清位 删除次数超过桶数时往 new_bloom_ 里重建 只重建 filter 不动桶数组:
+ // 之后每次 Insert/Remove 扫 kBloomScanStep 个 list_ 的桶 期间插入的和从旧桶搬过来的节点也加进 new_bloom_
+ // 扫完 new_bloom_ 换下 bloom_ 重建中又扩容的话 新的 bloom_ 本来就是从空的开始建的 直接放弃这次重建
+ uint32_t bits_per_key_;
+ BlockedBloom bloom_;
+ BlockedBloom old_bloom_;
+ BlockedBloom new_bloom_;
+ uint32_t bloom_scan_;       // new_bloom_ 下一个要扫的桶
+ uint32_t bloom_removed_;
+ uint64_t bloom_queries_;
+ uint64_t bloom_rejected_;
+ uint64_t bloom_false_positives_;
+ uint64_t bloom_rebuilds_;
 
-   LRUHandle* Lookup(const string& key, uint32_t hash) {
-    return *FindPointer(key, hash);
+#ifdef HASH_STATS
+ // 扩容分两部分: Resize 分配新数组 RehashStep 搬桶 两部分的时间都算
+ uint64_t resizes_;
+ std::chrono::steady_clock::duration resize_time_;
+#endif
+
+public:
+  HandleTable() : length_(0), elems_(0), list_(NULL),
+                  old_length_(0), rehash_index_(0), old_list_(NULL),
+                  bits_per_key_(0), bloom_scan_(0), bloom_removed_(0),
+                  bloom_queries_(0), bloom_rejected_(0), bloom_false_positives_(0),
+                  bloom_rebuilds_(0) {
+#ifdef HASH_STATS
+    resizes_ = 0;
+    resize_time_ = std::chrono::steady_clock::duration::zero();
+#endif
+    Resize();
   }
+  ~HandleTable() { delete[] list_; delete[] old_list_; }
+
+  LRUHandle* Lookup(const string& key, uint32_t hash);
   LRUHandle* Insert(LRUHandle* h);  
   LRUHandle* Remove(const string& key, uint32_t hash);
+  // 一次查 n 个 key 结果放在 out[i] 中 没找到为 NULL
+  void LookupBatch(const string* keys, const uint32_t* hashes, size_t n, LRUHandle** out);
+
+  // 打开(bits_per_key > 0)或关闭 Bloom filter 打开时用现有的节点建一次 O(n) 统计清零
+  // 之后 Lookup/Remove/LookupBatch 先查 filter 不在的 key 不会碰桶和链表
+  void EnableBloom(uint32_t bits_per_key);
+
+  struct BloomStats {
+    size_t bytes;               // filter 占用的内存 扩容中包括旧的
+    uint64_t queries;           // 查过 filter 的次数
+    uint64_t rejected;          // 被 filter 直接拒绝的
+    uint64_t false_positives;   // filter 放行了但链表里没有的
+    double fpr;                 // 实测误判率 false_positives / (rejected + false_positives)
+    double estimated_fpr;       // 按当前 filter 里置位的情况估算的误判率
+    uint64_t rebuilds;          // 删除太多后重建完成的次数 不算在扩容次数里
+  };
+  BloomStats GetBloomStats() const;
+
+#ifdef HASH_STATS
+  // 定义 HASH_STATS 时才有 链表长度分布等都是调用时遍历桶数组现算的 O(length_)
+  // 常驻的计数只有扩容次数和时间 不定义时这些成员和计时的代码都不编译
+  static const int kStatsHist = 16;
+  struct Stats {
+    uint64_t chain_hist[kStatsHist]; // 链表长度为 i 的桶数 最后一格包括更长的 扩容中旧数组没搬的桶也算
+    uint32_t elems;
+    uint32_t buckets;               // 扩容中是新数组的桶数
+    double load_factor;
+    uint64_t resizes;
+    double resize_seconds;          // Resize 加上之后 RehashStep 搬桶的时间
+    uint64_t tombstones;            // 链地址法 删除直接摘链 总是 0
+    size_t bytes;                   // 桶数组和 Bloom filter 节点是调用者分配的不算
+  };
+  Stats GetStats() const;
+#endif
 
 private:
   LRUHandle** FindPointer(const string& key, uint32_t hash);
   void Resize();  
+  void RehashStep(uint32_t n);
+  void BloomRebuildStep(uint32_t n);
+  bool BloomMayContain(uint32_t hash) const {
+    return bloom_.MayContain(hash) || (!old_bloom_.Empty() && old_bloom_.MayContain(hash));
+  }
 }; 
 
 // 哈希表的实现 据说随机读比g++内置的高%5的效率
 // 冲突时使用了链表来解决 这个hashtable 并不赋值释放这些节点的空间 仅仅是保存了这些节点的指针
  // 在对应的桶链表中 找到可以用的NULL节点(最后一个)或者重复的节点(替换掉) 这里二级指针的使用
+LRUHandle* HandleTable::Lookup(const string& key, uint32_t hash)
+{
+    RehashStep(kRehashStep);
+    if (bits_per_key_ == 0) {
+      return *FindPointer(key, hash);
+    }
+    bloom_queries_++;
+    if (!BloomMayContain(hash)) {
+      bloom_rejected_++;
+      return NULL;
+    }
+    LRUHandle* e = *FindPointer(key, hash);
+    if (e == NULL) {
+      bloom_false_positives_++;
+    }
+    return e;
+}
+
 LRUHandle* HandleTable::Insert(LRUHandle* h)
 {
+    RehashStep(kRehashStep);
     LRUHandle** ptr = FindPointer(h->key(), h->hash); //
     LRUHandle* old = *ptr;
     h->next_hash = (old == NULL ? NULL : old->next_hash);
     *ptr = h;
+    if (bits_per_key_ != 0) {
+      bloom_.Add(h->hash);
+      if (!new_bloom_.Empty()) {
+        new_bloom_.Add(h->hash);
+        BloomRebuildStep(kBloomScanStep);
+      }
+    }
     if (old == NULL) {
       ++elems_;
       if (elems_ > length_) {
@@ -73,57 +297,1107 @@ LRUHandle* HandleTable::Insert(LRUHandle* h)
 }
   // 这里依旧是二级指针来删除 而不是使用prev节点 对于二级指针的理解 可以看成一个*表示类型void* *p实际上就是这个链表对应的某个节点直接改变它的值就行了 而不用prev节点
 LRUHandle* HandleTable::Remove(const string& key, uint32_t hash) {
+    RehashStep(kRehashStep);
+    if (bits_per_key_ != 0) {
+      bloom_queries_++;
+      if (!BloomMayContain(hash)) {
+        bloom_rejected_++;
+        return NULL;
+      }
+    }
     LRUHandle** ptr = FindPointer(key, hash);
     LRUHandle* result = *ptr;
     if (result != NULL) {
       *ptr = result->next_hash;
       --elems_;
+      if (bits_per_key_ != 0 && ++bloom_removed_ > length_ && new_bloom_.Empty()) {
+        // 删掉的 key 的位太多了 开始重建 filter
+        new_bloom_.Init(length_, bits_per_key_);
+        bloom_scan_ = 0;
+        bloom_removed_ = 0;
+      }
+    } else if (bits_per_key_ != 0) {
+      bloom_false_positives_++;
+    }
+    if (!new_bloom_.Empty()) {
+      BloomRebuildStep(kBloomScanStep);
     }
     return result;
 }
 
+// 把 list_ 的 n 个桶加进 new_bloom_ 全部扫完就换下 bloom_
+// old_list_ 里还没搬的节点仍由 old_bloom_ 负责 它们搬过来时 RehashStep 会加进 new_bloom_
+void HandleTable::BloomRebuildStep(uint32_t n)
+{
+    for (; n > 0 && bloom_scan_ < length_; n--, bloom_scan_++) {
+      for (LRUHandle* h = list_[bloom_scan_]; h != NULL; h = h->next_hash) {
+        new_bloom_.Add(h->hash);
+      }
+    }
+    if (bloom_scan_ == length_) {
+      bloom_.Swap(new_bloom_);
+      new_bloom_.Clear();
+      bloom_rebuilds_++;
+    }
+}
+
+void HandleTable::EnableBloom(uint32_t bits_per_key)
+{
+    bits_per_key_ = bits_per_key;
+    bloom_removed_ = 0;
+    bloom_queries_ = bloom_rejected_ = bloom_false_positives_ = bloom_rebuilds_ = 0;
+    old_bloom_.Clear();
+    new_bloom_.Clear();
+    if (bits_per_key == 0) {
+      bloom_.Clear();
+      return;
+    }
+    while (old_list_ != NULL) {
+      RehashStep(kRehashStep);
+    }
+    bloom_.Init(length_, bits_per_key);
+    for (uint32_t i = 0; i < length_; i++) {
+      for (LRUHandle* h = list_[i]; h != NULL; h = h->next_hash) {
+        bloom_.Add(h->hash);
+      }
+    }
+}
+
+HandleTable::BloomStats HandleTable::GetBloomStats() const
+{
+    BloomStats st;
+    st.bytes = bloom_.Bytes() + old_bloom_.Bytes() + new_bloom_.Bytes();
+    st.queries = bloom_queries_;
+    st.rejected = bloom_rejected_;
+    st.false_positives = bloom_false_positives_;
+    uint64_t negatives = bloom_rejected_ + bloom_false_positives_;
+    st.fpr = negatives == 0 ? 0 : (double)bloom_false_positives_ / negatives;
+    st.estimated_fpr = bloom_.EstimatedFpr();
+    st.rebuilds = bloom_rebuilds_;
+    return st;
+}
+
   // Return a pointer to slot that points to a cache entry that
   // matches key/hash.  If there is no such cache entry, return a
   // pointer to the trailing slot in the corresponding linked list.
   // 返回指向slot的指针 该slot指向对应的entry(key-value)
   // 如果没有匹配的尾指针
+  // 扩容中 还没搬走的旧桶先查 没有的话返回新表里的位置 所以新插入的节点总是进新表
 LRUHandle** HandleTable::FindPointer(const string& key, uint32_t hash) 
 {
-    LRUHandle** ptr = &list_[hash & (length_ - 1)]; // 这里桶的计算方法都是 [hash & (length_ - 1)]
+    LRUHandle** ptr;
+    if (old_list_ != NULL && (hash & (old_length_ - 1)) >= rehash_index_) {
+      ptr = &old_list_[hash & (old_length_ - 1)];
+      while (*ptr != NULL &&
+             ((*ptr)->hash != hash || key != (*ptr)->key())) {
+        ptr = &(*ptr)->next_hash;
+      }
+      if (*ptr != NULL) {
+        return ptr;
+      }
+    }
+    ptr = &list_[hash & (length_ - 1)]; // 这里桶的计算方法都是 [hash & (length_ - 1)]
     while (*ptr != NULL &&
            ((*ptr)->hash != hash || key != (*ptr)->key())) {
       ptr = &(*ptr)->next_hash;
     }
     return ptr;
 }
-  
-// 2倍大小重新设置大小
-void HandleTable::Resize() 
+
+// 批量查找: 每 kBatchGroup 个 key 一组 先算出所有的桶地址并 prefetch 再取出链表头并 prefetch
+// 最后轮流让每个 key 在自己的链表上走一步(走之前 prefetch 下一个节点)
+// 这样一个 key 等待 cache miss 的时候 其他 key 的内存访问已经在路上了 而不是一个一个串行地等
+static const size_t kBatchGroup = 16;
+
+void HandleTable::LookupBatch(const string* keys, const uint32_t* hashes, size_t n, LRUHandle** out)
 {
-    uint32_t new_length = 4; // 也就是默认是4
-    while (new_length < elems_) {
-      new_length *= 2;
+    LRUHandle** bucket[kBatchGroup];
+    LRUHandle* cur[kBatchGroup];
+    bool in_old[kBatchGroup];
+    bool done[kBatchGroup];
+
+    RehashStep(kRehashStep);
+    for (size_t base = 0; base < n; base += kBatchGroup) {
+      size_t g = n - base < kBatchGroup ? n - base : kBatchGroup;
+      size_t left = g;
+
+      // 0. 有 Bloom filter 时先 prefetch 所有的块 再把不在的 key 剔掉 它们的桶都不用碰
+      if (bits_per_key_ != 0) {
+        for (size_t i = 0; i < g; i++) {
+          bloom_.Prefetch(hashes[base + i]);
+        }
+        bloom_queries_ += g;
+      }
+      for (size_t i = 0; i < g; i++) {
+        done[i] = bits_per_key_ != 0 && !BloomMayContain(hashes[base + i]);
+        if (done[i]) {
+          out[base + i] = NULL;
+          bloom_rejected_++;
+          left--;
+        }
+      }
+
+      // 1. 桶的地址 扩容中还没搬走的旧桶先查
+      for (size_t i = 0; i < g; i++) {
+        if (done[i]) {
+          continue;
+        }
+        uint32_t hash = hashes[base + i];
+        in_old[i] = old_list_ != NULL && (hash & (old_length_ - 1)) >= rehash_index_;
+        bucket[i] = in_old[i] ? &old_list_[hash & (old_length_ - 1)] : &list_[hash & (length_ - 1)];
+        __builtin_prefetch(bucket[i]);
+      }
+      // 2. 链表头
+      for (size_t i = 0; i < g; i++) {
+        if (done[i]) {
+          continue;
+        }
+        cur[i] = *bucket[i];
+        if (cur[i] != NULL) {
+          __builtin_prefetch(cur[i]);
+        }
+      }
+      // 3. 交替地沿着各自的链表走
+      while (left > 0) {
+        for (size_t i = 0; i < g; i++) {
+          if (done[i]) {
+            continue;
+          }
+          LRUHandle* e = cur[i];
+          uint32_t hash = hashes[base + i];
+          if (e == NULL) {
+            if (in_old[i]) {
+              // 旧桶里没有 再查新表
+              in_old[i] = false;
+              cur[i] = list_[hash & (length_ - 1)];
+              if (cur[i] != NULL) {
+                __builtin_prefetch(cur[i]);
+              }
+              continue;
+            }
+            out[base + i] = NULL;
+            if (bits_per_key_ != 0) {
+              bloom_false_positives_++;
+            }
+          } else if (e->hash == hash && keys[base + i] == e->key()) {
+            out[base + i] = e;
+          } else {
+            cur[i] = e->next_hash;
+            if (cur[i] != NULL) {
+              __builtin_prefetch(cur[i]);
+            }
+            continue;
+          }
+          done[i] = true;
+          left--;
+        }
+      }
     }
-    LRUHandle** new_list = new LRUHandle*[new_length]; // malloc(length*sizeof(LRUHandle*))
-    memset(new_list, 0, sizeof(new_list[0]) * new_length);
-    uint32_t count = 0;
-  
-    for (uint32_t i = 0; i < length_; i++) // 重新hash一次执行完毕
-  {
-      LRUHandle* h = list_[i]; // 一个bucket 实际上就是一个链表
+}
+
+// 从 old_list_ 搬 n 个非空桶到 list_ 最多跳过 n*10 个空桶 免得一次走太久
+void HandleTable::RehashStep(uint32_t n)
+{
+#ifdef HASH_STATS
+    if (old_list_ == NULL) {
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+#endif
+    uint32_t empty_visits = n * 10;
+    while (n > 0 && empty_visits > 0 && old_list_ != NULL) {
+      LRUHandle* h = old_list_[rehash_index_];
+      if (h == NULL) {
+        empty_visits--;
+      } else {
+        n--;
+      }
       while (h != NULL)
       {
         LRUHandle* next = h->next_hash;
-        uint32_t hash = h->hash; 
-        LRUHandle** ptr = &new_list[hash & (new_length - 1)]; // 重新计算hash值
-        h->next_hash = *ptr;  // 放到新bucket的开头，*ptr为指针数组的一个指针值
+        LRUHandle** ptr = &list_[h->hash & (length_ - 1)];
+        h->next_hash = *ptr;  // 放到新bucket的开头
         *ptr = h;
+        if (bits_per_key_ != 0) {
+          bloom_.Add(h->hash);
+          if (!new_bloom_.Empty()) {
+            new_bloom_.Add(h->hash);
+          }
+        }
         h = next;
-        count++;
+      }
+      old_list_[rehash_index_++] = NULL;
+      if (rehash_index_ == old_length_) {
+        delete[] old_list_; // 删除旧的hash
+        old_list_ = NULL;
+        old_length_ = 0;
+        rehash_index_ = 0;
+        old_bloom_.Clear();
       }
     }
-    assert(elems_ == count);
-    delete[] list_; // 删除旧的hash
+#ifdef HASH_STATS
+    resize_time_ += std::chrono::steady_clock::now() - start;
+#endif
+}
+
+// 2倍大小重新设置大小 只分配新数组 元素由 RehashStep 慢慢搬过去
+void HandleTable::Resize() 
+{
+    while (old_list_ != NULL) {
+      // 上一次扩容还没搬完 先搬完
+      RehashStep(kRehashStep);
+    }
+#ifdef HASH_STATS
+    auto start = std::chrono::steady_clock::now();
+#endif
+    uint32_t new_length = 4; // 也就是默认是4
+    while (new_length < elems_) {
+      new_length *= 2;
+    }
+    LRUHandle** new_list = new LRUHandle*[new_length]; // malloc(length*sizeof(LRUHandle*))
+    memset(new_list, 0, sizeof(new_list[0]) * new_length);
+    if (bits_per_key_ != 0) {
+      // 旧 filter 留给还没搬走的节点 新 filter 从空的开始 搬过来的和新插入的节点才加进去
+      old_bloom_.Swap(bloom_);
+      bloom_.Init(new_length, bits_per_key_);
+      new_bloom_.Clear();
+      bloom_removed_ = 0;
+    }
+    if (length_ == 0) {
+      old_bloom_.Clear();
+      list_ = new_list; // 第一次分配 没有要搬的
+      length_ = new_length;
+      return;
+    }
+    old_list_ = list_;
+    old_length_ = length_;
+    rehash_index_ = 0;
     list_ = new_list; // 新的hash
     length_ = new_length;
+#ifdef HASH_STATS
+    resizes_++;
+    resize_time_ += std::chrono::steady_clock::now() - start;
+#endif
+}
+
+#ifdef HASH_STATS
+HandleTable::Stats HandleTable::GetStats() const
+{
+    Stats st;
+    memset(&st, 0, sizeof(st));
+    for (uint32_t i = 0; i < length_; i++) {
+      uint32_t len = 0;
+      for (LRUHandle* h = list_[i]; h != NULL; h = h->next_hash) {
+        len++;
+      }
+      st.chain_hist[len < kStatsHist ? len : kStatsHist - 1]++;
+    }
+    for (uint32_t i = rehash_index_; old_list_ != NULL && i < old_length_; i++) {
+      uint32_t len = 0;
+      for (LRUHandle* h = old_list_[i]; h != NULL; h = h->next_hash) {
+        len++;
+      }
+      st.chain_hist[len < kStatsHist ? len : kStatsHist - 1]++;
+    }
+    st.elems = elems_;
+    st.buckets = length_;
+    st.load_factor = (double)elems_ / length_;
+    st.resizes = resizes_;
+    st.resize_seconds = std::chrono::duration<double>(resize_time_).count();
+    st.tombstones = 0;
+    st.bytes = sizeof(*this) + (length_ + old_length_) * sizeof(LRUHandle*)
+               + bloom_.Bytes() + old_bloom_.Bytes();
+    return st;
+}
+#endif
+
+// =======================================================================================================
+// LRU cache 每个 LRUCache 有自己的锁 容量按 charge 计算 ShardedLRUCache 按 hash 的高位把 key 分到 kNumShards 个 LRUCache 上 减少锁竞争
+
+class LRUCache {
+ public:
+  LRUCache();
+  ~LRUCache();
+
+  // Separate from constructor so caller can easily make an array of LRUCache
+  void SetCapacity(size_t capacity) { capacity_ = capacity; }
+
+  // 返回的 handle 已经被引用了一次 用完要调用 Release
+  LRUHandle* Insert(const string& key, uint32_t hash,
+                    void* value, size_t charge,
+                    void (*deleter)(const string& key, void* value));
+  LRUHandle* Lookup(const string& key, uint32_t hash);
+  void Release(LRUHandle* handle);
+  void Erase(const string& key, uint32_t hash);
+  size_t TotalCharge() {
+    std::lock_guard<std::mutex> l(mutex_);
+    return usage_;
+  }
+
+ private:
+  void LRU_Remove(LRUHandle* e);
+  void LRU_Append(LRUHandle* list, LRUHandle* e);
+  void Ref(LRUHandle* e);
+  void Unref(LRUHandle* e);
+  void FinishErase(LRUHandle* e);
+
+  // Initialized before use.
+  size_t capacity_;
+
+  // mutex_ protects the following state.
+  std::mutex mutex_;
+  size_t usage_;
+
+  // Dummy head of LRU list.
+  // lru.prev is newest entry, lru.next is oldest entry.
+  // 只放 refs == 1 的 entry(只有 cache 自己引用) 被淘汰的总是 lru_.next 这一端(最久没有访问的)
+  LRUHandle lru_;
+
+  // 外部还持有 handle 的 entry 放这里 顺序没有意义 淘汰不会碰到它们
+  // 用完 Release 回到 refs == 1 时再挪回 lru_
+  LRUHandle in_use_;
+
+  HandleTable table_;
+};
+
+LRUCache::LRUCache()
+    : usage_(0) {
+  // Make empty circular linked list
+  lru_.next = &lru_;
+  lru_.prev = &lru_;
+  in_use_.next = &in_use_;
+  in_use_.prev = &in_use_;
+}
+
+LRUCache::~LRUCache() {
+  assert(in_use_.next == &in_use_);  // Error if caller has an unreleased handle
+  for (LRUHandle* e = lru_.next; e != &lru_; ) {
+    LRUHandle* next = e->next;
+    assert(e->in_cache);
+    e->in_cache = false;
+    assert(e->refs == 1);
+    Unref(e);
+    e = next;
+  }
+}
+
+// cache 本身持有一次引用 每个外部 handle 持有一次 第一次被外部引用时从 lru_ 挪到 in_use_
+void LRUCache::Ref(LRUHandle* e) {
+  if (e->refs == 1 && e->in_cache) {
+    LRU_Remove(e);
+    LRU_Append(&in_use_, e);
+  }
+  e->refs++;
+}
+
+// 引用计数为0 时才真正释放 这时 entry 已经离开 cache usage_ 在 FinishErase 里就减掉了
+void LRUCache::Unref(LRUHandle* e) {
+  assert(e->refs > 0);
+  e->refs--;
+  if (e->refs == 0) {
+    assert(!e->in_cache);
+    (*e->deleter)(e->key(), e->value);
+    free(e);
+  } else if (e->in_cache && e->refs == 1) {
+    // 外部引用都释放了 重新参与淘汰
+    LRU_Remove(e);
+    LRU_Append(&lru_, e);
+  }
+}
+
+// e 已经从 hash 表中摘掉 再从链表中摘掉 charge 马上从 usage_ 里减掉
+// 被外部 pin 住的旧 entry 不再占 cache 的容量 它的内存等最后一个 Release 时释放
+void LRUCache::FinishErase(LRUHandle* e) {
+  if (e != NULL) {
+    assert(e->in_cache);
+    LRU_Remove(e);
+    e->in_cache = false;
+    usage_ -= e->charge;
+    Unref(e);
+  }
+}
+
+void LRUCache::LRU_Remove(LRUHandle* e) {
+  e->next->prev = e->prev;
+  e->prev->next = e->next;
+}
+
+void LRUCache::LRU_Append(LRUHandle* list, LRUHandle* e) {
+  // Make "e" newest entry by inserting just before *list
+  e->next = list;
+  e->prev = list->prev;
+  e->prev->next = e;
+  e->next->prev = e;
+}
+
+LRUHandle* LRUCache::Lookup(const string& key, uint32_t hash) {
+  std::lock_guard<std::mutex> l(mutex_);
+  LRUHandle* e = table_.Lookup(key, hash);
+  if (e != NULL) {
+    // 挪到 in_use_ 上 Release 之后回到 lru_ 最新的一端
+    Ref(e);
+  }
+  return e;
+}
+
+void LRUCache::Release(LRUHandle* handle) {
+  std::lock_guard<std::mutex> l(mutex_);
+  Unref(handle);
+}
+
+LRUHandle* LRUCache::Insert(
+    const string& key, uint32_t hash, void* value, size_t charge,
+    void (*deleter)(const string& key, void* value)) {
+  std::lock_guard<std::mutex> l(mutex_);
+
+  LRUHandle* e = reinterpret_cast<LRUHandle*>(
+      malloc(sizeof(LRUHandle)-1 + key.size()));
+  e->value = value;
+  e->deleter = deleter;
+  e->charge = charge;
+  e->key_length = key.size();
+  e->hash = hash;
+  e->refs = 2;  // One from LRUCache, one for the returned handle
+  e->in_cache = true;
+  memcpy(e->key_data, key.data(), key.size());
+  LRU_Append(&in_use_, e);
+  usage_ += charge;
+
+  // 同一个 key 的旧 entry 从链表和 hash 表里摘掉 等它的引用都释放了再删除
+  FinishErase(table_.Insert(e));
+
+  // 超出容量 从 lru_ 最旧的一端开始淘汰 in_use_ 上被 pin 住的(包括刚插入的 e)不动
+  while (usage_ > capacity_ && lru_.next != &lru_) {
+    LRUHandle* old = lru_.next;
+    assert(old->refs == 1);
+    FinishErase(table_.Remove(old->key(), old->hash));
+  }
+
+  return e;
+}
+
+void LRUCache::Erase(const string& key, uint32_t hash) {
+  std::lock_guard<std::mutex> l(mutex_);
+  FinishErase(table_.Remove(key, hash));
+}
+
+static const int kNumShardBits = 4;
+static const int kNumShards = 1 << kNumShardBits;
+
+class ShardedLRUCache {
+ private:
+  LRUCache shard_[kNumShards];
+  std::mutex id_mutex_;
+  uint64_t last_id_;
+
+  static inline uint32_t HashSlice(const string& s) {
+    return Hash(s.data(), s.size(), 0);
+  }
+
+  // 用 hash 的高位选 shard 低位留给 HandleTable 选 bucket
+  static uint32_t Shard(uint32_t hash) {
+    return hash >> (32 - kNumShardBits);
+  }
+
+ public:
+  explicit ShardedLRUCache(size_t capacity)
+      : last_id_(0) {
+    const size_t per_shard = (capacity + (kNumShards - 1)) / kNumShards;
+    for (int s = 0; s < kNumShards; s++) {
+      shard_[s].SetCapacity(per_shard);
+    }
+  }
+  ~ShardedLRUCache() { }
+  LRUHandle* Insert(const string& key, void* value, size_t charge,
+                    void (*deleter)(const string& key, void* value)) {
+    const uint32_t hash = HashSlice(key);
+    return shard_[Shard(hash)].Insert(key, hash, value, charge, deleter);
+  }
+  LRUHandle* Lookup(const string& key) {
+    const uint32_t hash = HashSlice(key);
+    return shard_[Shard(hash)].Lookup(key, hash);
+  }
+  void Release(LRUHandle* handle) {
+    shard_[Shard(handle->hash)].Release(handle);
+  }
+  void Erase(const string& key) {
+    const uint32_t hash = HashSlice(key);
+    shard_[Shard(hash)].Erase(key, hash);
+  }
+  void* Value(LRUHandle* handle) {
+    return handle->value;
+  }
+  uint64_t NewId() {
+    std::lock_guard<std::mutex> l(id_mutex_);
+    return ++(last_id_);
+  }
+  size_t TotalCharge() {
+    size_t total = 0;
+    for (int s = 0; s < kNumShards; s++) {
+      total += shard_[s].TotalCharge();
+    }
+    return total;
+  }
+};
+
+// =======================================================================================================
+// W-TinyLFU 准入策略
+// 纯 LRU 遇到一次性的扫描(每个 key 只访问一次)会把热点数据全部挤出去
+// 这里把容量分成三段: window LRU(1%) 和 main 区(分成 probation 20% 与 protected 80% 的 SLRU)
+// 新 entry 先进 window 从 window 挤出来的 candidate 要和 probation 最旧的 victim 比较访问频率
+// 频率更高才能进入 main 区 否则直接淘汰 频率由 count-min sketch 估计 计数器只有 4 bit 定期减半(老化)
+
+// 4 行 每行 width 个 4 bit 计数器 一个 uint64_t 放 16 个
+class FrequencySketch {
+ public:
+  FrequencySketch() : width_(0), sample_size_(0), additions_(0) { }
+
+  // 按预计的 entry 个数设置宽度 取 2 的幂
+  void SetCapacity(size_t entries) {
+    width_ = 16;
+    while (width_ < entries) {
+      width_ *= 2;
+    }
+    table_.assign(kDepth * width_ / 16, 0);
+    sample_size_ = 10 * width_;
+    additions_ = 0;
+  }
+
+  // 每一行取一个计数器 估计值是其中最小的那个
+  int Frequency(uint32_t hash) const {
+    int freq = 15;
+    for (int i = 0; i < kDepth; i++) {
+      int c = Counter(i, Index(hash, i));
+      if (c < freq) {
+        freq = c;
+      }
+    }
+    return freq;
+  }
+
+  void Increment(uint32_t hash) {
+    bool added = false;
+    for (int i = 0; i < kDepth; i++) {
+      size_t j = Index(hash, i);
+      uint64_t& word = table_[i * (width_ / 16) + j / 16];
+      int shift = (j & 15) * 4;
+      if (((word >> shift) & 0xf) < 15) {
+        word += (uint64_t)1 << shift;
+        added = true;
+      }
+    }
+    if (added && ++additions_ >= sample_size_) {
+      Reset();
+    }
+  }
+
+ private:
+  static const int kDepth = 4;
+
+  // 用 hash 和它的一个变形做 double hashing 得到每一行的下标
+  size_t Index(uint32_t hash, int i) const {
+    uint32_t h2 = (hash >> 17) | (hash << 15);
+    return (hash + i * h2) & (width_ - 1);
+  }
+
+  int Counter(int i, size_t j) const {
+    return (table_[i * (width_ / 16) + j / 16] >> ((j & 15) * 4)) & 0xf;
+  }
+
+  // 老化 所有计数器减半 旧的热点慢慢降温
+  void Reset() {
+    for (size_t i = 0; i < table_.size(); i++) {
+      table_[i] = (table_[i] >> 1) & 0x7777777777777777ULL;
+    }
+    additions_ /= 2;
+  }
+
+  std::vector<uint64_t> table_;
+  size_t width_;
+  size_t sample_size_;
+  size_t additions_;
+};
+
+class TinyLFUCache {
+ public:
+  explicit TinyLFUCache(size_t capacity);
+  ~TinyLFUCache();
+
+  // 接口和 LRUCache 一样 Lookup 不论是否命中都记一次访问频率
+  LRUHandle* Insert(const string& key, uint32_t hash,
+                    void* value, size_t charge,
+                    void (*deleter)(const string& key, void* value));
+  LRUHandle* Lookup(const string& key, uint32_t hash);
+  void Release(LRUHandle* handle);
+  void Erase(const string& key, uint32_t hash);
+  size_t TotalCharge() {
+    std::lock_guard<std::mutex> l(mutex_);
+    return usage_[kWindow] + usage_[kProbation] + usage_[kProtected];
+  }
+
+ private:
+  enum Segment { kWindow = 0, kProbation = 1, kProtected = 2, kNumSegments = 3 };
+
+  void List_Remove(LRUHandle* e);
+  void List_Append(LRUHandle* e, uint32_t segment);
+  void Evict(LRUHandle* e);
+  void Unref(LRUHandle* e);
+  void Admit();
+
+  size_t capacity_;
+  size_t window_capacity_;
+  size_t protected_capacity_;
+
+  std::mutex mutex_;
+  size_t usage_[kNumSegments];
+  // 每段一个环形链表 和 LRUCache::lru_ 一样 next 是最旧的 prev 是最新的
+  LRUHandle lru_[kNumSegments];
+  HandleTable table_;
+  FrequencySketch sketch_;
+};
+
+TinyLFUCache::TinyLFUCache(size_t capacity)
+    : capacity_(capacity) {
+  window_capacity_ = capacity / 100 > 0 ? capacity / 100 : 1;
+  protected_capacity_ = (capacity - window_capacity_) * 8 / 10;
+  for (int i = 0; i < kNumSegments; i++) {
+    usage_[i] = 0;
+    lru_[i].next = &lru_[i];
+    lru_[i].prev = &lru_[i];
+  }
+  sketch_.SetCapacity(capacity);
+}
+
+TinyLFUCache::~TinyLFUCache() {
+  for (int i = 0; i < kNumSegments; i++) {
+    for (LRUHandle* e = lru_[i].next; e != &lru_[i]; ) {
+      LRUHandle* next = e->next;
+      assert(e->refs == 1);  // Error if caller has an unreleased handle
+      Unref(e);
+      e = next;
+    }
+  }
+}
+
+void TinyLFUCache::Unref(LRUHandle* e) {
+  assert(e->refs > 0);
+  e->refs--;
+  if (e->refs <= 0) {
+    (*e->deleter)(e->key(), e->value);
+    free(e);
+  }
+}
+
+void TinyLFUCache::List_Remove(LRUHandle* e) {
+  e->next->prev = e->prev;
+  e->prev->next = e->next;
+  usage_[e->segment] -= e->charge;
+}
+
+void TinyLFUCache::List_Append(LRUHandle* e, uint32_t segment) {
+  LRUHandle* head = &lru_[segment];
+  e->segment = segment;
+  e->next = head;
+  e->prev = head->prev;
+  e->prev->next = e;
+  e->next->prev = e;
+  usage_[segment] += e->charge;
+}
+
+// 从 cache 中拿掉 还有外部引用的话等 Release 时再删除
+void TinyLFUCache::Evict(LRUHandle* e) {
+  List_Remove(e);
+  table_.Remove(e->key(), e->hash);
+  Unref(e);
+}
+
+// window 超出容量时 把最旧的 candidate 交给准入策略
+void TinyLFUCache::Admit() {
+  while (usage_[kWindow] > window_capacity_) {
+    LRUHandle* candidate = lru_[kWindow].next;
+    List_Remove(candidate);
+    size_t main_capacity = capacity_ - window_capacity_;
+    int freq = sketch_.Frequency(candidate->hash);
+    bool admit = true;
+    // 先只看不动: 腾出 candidate 的空间要淘汰哪些 victim(优先从 probation 的最旧一端选)
+    // 其中任何一个的频率不低于 candidate 就拒绝 candidate main 区保持原样
+    size_t usage = usage_[kProbation] + usage_[kProtected];
+    LRUHandle* head = &lru_[kProbation];
+    LRUHandle* victim = head->next;
+    while (usage + candidate->charge > main_capacity) {
+      if (victim == head) {
+        if (head == &lru_[kProtected]) {
+          admit = false;  // main 区全清空也放不下
+          break;
+        }
+        head = &lru_[kProtected];
+        victim = head->next;
+        continue;
+      }
+      if (sketch_.Frequency(victim->hash) >= freq) {
+        admit = false;
+        break;
+      }
+      usage -= victim->charge;
+      victim = victim->next;
+    }
+    if (admit) {
+      // 和上面同样的顺序真正淘汰
+      while (usage_[kProbation] + usage_[kProtected] + candidate->charge > main_capacity) {
+        head = lru_[kProbation].next != &lru_[kProbation] ? &lru_[kProbation] : &lru_[kProtected];
+        Evict(head->next);
+      }
+      List_Append(candidate, kProbation);
+    } else {
+      // candidate 已经不在链表上了 直接从 hash 表中拿掉
+      table_.Remove(candidate->key(), candidate->hash);
+      Unref(candidate);
+    }
+  }
+}
+
+LRUHandle* TinyLFUCache::Lookup(const string& key, uint32_t hash) {
+  std::lock_guard<std::mutex> l(mutex_);
+  sketch_.Increment(hash);
+  LRUHandle* e = table_.Lookup(key, hash);
+  if (e != NULL) {
+    e->refs++;
+    uint32_t segment = e->segment;
+    List_Remove(e);
+    if (segment == kWindow) {
+      List_Append(e, kWindow);
+    } else {
+      // probation 中再次被访问的升级到 protected protected 满了就把最旧的降回 probation
+      List_Append(e, kProtected);
+      while (usage_[kProtected] > protected_capacity_) {
+        LRUHandle* old = lru_[kProtected].next;
+        List_Remove(old);
+        List_Append(old, kProbation);
+      }
+    }
+  }
+  return e;
+}
+
+void TinyLFUCache::Release(LRUHandle* handle) {
+  std::lock_guard<std::mutex> l(mutex_);
+  Unref(handle);
+}
+
+LRUHandle* TinyLFUCache::Insert(
+    const string& key, uint32_t hash, void* value, size_t charge,
+    void (*deleter)(const string& key, void* value)) {
+  std::lock_guard<std::mutex> l(mutex_);
+
+  LRUHandle* e = reinterpret_cast<LRUHandle*>(
+      malloc(sizeof(LRUHandle)-1 + key.size()));
+  e->value = value;
+  e->deleter = deleter;
+  e->charge = charge;
+  e->key_length = key.size();
+  e->hash = hash;
+  e->refs = 2;  // One from TinyLFUCache, one for the returned handle
+  memcpy(e->key_data, key.data(), key.size());
+  List_Append(e, kWindow);
+
+  LRUHandle* old = table_.Insert(e);
+  if (old != NULL) {
+    List_Remove(old);
+    Unref(old);
+  }
+  Admit();
+  return e;
+}
+
+void TinyLFUCache::Erase(const string& key, uint32_t hash) {
+  std::lock_guard<std::mutex> l(mutex_);
+  LRUHandle* e = table_.Remove(key, hash);
+  if (e != NULL) {
+    List_Remove(e);
+    Unref(e);
+  }
+}
+
+// =======================================================================================================
+// 多线程 hit/miss 测试 key 服从 Zipf 分布 miss 的时候插入 charge 为 1
+// g++ -O2 -std=c++11 -pthread -x c++ "hash leveldb hashtable.c" 和 "hash hash-function.c" 放在同一个目录
+// ./a.out [threads] [capacity] [keys] [zipf s]
+// ./a.out batch [entries] [batch]   HandleTable::Lookup 和 LookupBatch 的对比 加 -DHASH_STATS 时再打印表的统计
+// ./a.out tinylfu [capacity] [keys]  Zipf 加周期性扫描 LRUCache 和 TinyLFUCache 的命中率与吞吐
+// ./a.out bloom [entries] [bits_per_key]  全部 miss 的 Lookup 有没有 Bloom filter 的对比
+
+static void DeleteNothing(const string&, void*) { }
+
+struct ZipfGenerator {
+  std::vector<double> cdf;
+
+  ZipfGenerator(int n, double s) : cdf(n) {
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+      sum += 1.0 / pow(i + 1, s);
+      cdf[i] = sum;
+    }
+    for (int i = 0; i < n; i++) {
+      cdf[i] /= sum;
+    }
+  }
+
+  // 第 i 个 key 被取到的概率正比于 1/(i+1)^s
+  int Next(std::mt19937_64& rnd) const {
+    double u = std::uniform_real_distribution<double>(0, 1)(rnd);
+    return std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+  }
+};
+
+// 表里放 entries 个 key 随机查 一半命中一半不命中
+static int BenchLookupBatch(int entries, int batch) {
+  const int kLookups = 4000000;
+  HandleTable table;
+  std::vector<LRUHandle*> handles(entries);
+  std::vector<string> keys(kLookups);
+  std::vector<uint32_t> hashes(kLookups);
+  std::vector<LRUHandle*> out(batch);
+  std::mt19937_64 rnd(1);
+  char buf[16];
+
+  for (int i = 0; i < entries; i++) {
+    snprintf(buf, sizeof(buf), "%015d", i);
+    LRUHandle* e = reinterpret_cast<LRUHandle*>(malloc(sizeof(LRUHandle)-1 + 15));
+    e->key_length = 15;
+    e->hash = Hash(buf, 15, 0);
+    e->next = e->prev = NULL;
+    memcpy(e->key_data, buf, 15);
+    table.Insert(e);
+    handles[i] = e;
+  }
+  for (int i = 0; i < kLookups; i++) {
+    snprintf(buf, sizeof(buf), "%015d", (int)(rnd() % (2 * (uint64_t)entries)));
+    keys[i].assign(buf, 15);
+    hashes[i] = Hash(buf, 15, 0);
+  }
+
+  size_t found = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kLookups; i++) {
+    found += table.Lookup(keys[i], hashes[i]) != NULL;
+  }
+  double single = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  size_t found_batch = 0;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kLookups; i += batch) {
+    int n = kLookups - i < batch ? kLookups - i : batch;
+    table.LookupBatch(&keys[i], &hashes[i], n, &out[0]);
+    for (int j = 0; j < n; j++) {
+      found_batch += out[j] != NULL;
+    }
+  }
+  double batched = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  assert(found == found_batch);
+  printf("%d entries, batch %d: Lookup %.1f ns/key, LookupBatch %.1f ns/key, speedup %.2fx\n",
+         entries, batch, single * 1e9 / kLookups, batched * 1e9 / kLookups, single / batched);
+#ifdef HASH_STATS
+  HandleTable::Stats st = table.GetStats();
+  printf("load %.2f, %llu resizes %.2f ms, %zu bytes, chains:", st.load_factor,
+         (unsigned long long)st.resizes, st.resize_seconds * 1e3, st.bytes);
+  for (int i = 0; i < HandleTable::kStatsHist; i++) {
+    printf(" %.3f", (double)st.chain_hist[i] / st.buckets);
+  }
+  printf("\n");
+#endif
+
+  // HandleTable 不管 entry 的内存 Lookup/LookupBatch 也不加引用 测完统一释放
+  for (int i = 0; i < entries; i++) {
+    free(handles[i]);
+  }
+  return 0;
+}
+
+static LRUHandle* NewBenchHandle(const char* key, size_t len) {
+  LRUHandle* e = reinterpret_cast<LRUHandle*>(malloc(sizeof(LRUHandle)-1 + len));
+  e->key_length = len;
+  e->hash = Hash(key, len, 0);
+  e->next = e->prev = NULL;
+  memcpy(e->key_data, key, len);
+  return e;
+}
+
+static double TimeMisses(HandleTable& table, const std::vector<string>& keys, const std::vector<uint32_t>& hashes) {
+  size_t found = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < keys.size(); i++) {
+    found += table.Lookup(keys[i], hashes[i]) != NULL;
+  }
+  double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  assert(found == 0);
+  return sec * 1e9 / keys.size();
+}
+
+// 表里放 entries 个 key(边插边开着 filter 经过多次扩容) 先检查没有漏报 再查 kLookups 个不存在的 key
+// 之后删掉一半再插回来 重复 kChurnRounds 轮 删除次数超过桶数 检查删除触发的重建
+static int BenchBloom(int entries, int bits_per_key) {
+  const int kLookups = 4000000;
+  const int kChurnRounds = 3;
+  HandleTable table;
+  std::vector<LRUHandle*> handles(entries);
+  std::vector<string> keys(kLookups);
+  std::vector<uint32_t> hashes(kLookups);
+  std::mt19937_64 rnd(1);
+  char buf[16];
+
+  table.EnableBloom(bits_per_key);
+  for (int i = 0; i < entries; i++) {
+    snprintf(buf, sizeof(buf), "%015d", i);
+    handles[i] = NewBenchHandle(buf, 15);
+    table.Insert(handles[i]);
+  }
+  for (int round = 0; round < kChurnRounds; round++) {
+    for (int i = round % 2; i < entries; i += 2) {
+      LRUHandle* e = table.Remove(handles[i]->key(), handles[i]->hash);
+      assert(e == handles[i]);
+    }
+    for (int i = 0; i < entries; i++) {
+      LRUHandle* e = table.Lookup(handles[i]->key(), handles[i]->hash);
+      assert(e == (i % 2 != round % 2 ? handles[i] : NULL));
+    }
+    for (int i = round % 2; i < entries; i += 2) {
+      table.Insert(handles[i]);
+    }
+    for (int i = 0; i < entries; i++) {
+      assert(table.Lookup(handles[i]->key(), handles[i]->hash) == handles[i]);
+    }
+  }
+  uint64_t rebuilds = table.GetBloomStats().rebuilds;
+
+  for (int i = 0; i < kLookups; i++) {
+    snprintf(buf, sizeof(buf), "%015d", entries + (int)(rnd() % (uint64_t)entries));
+    keys[i].assign(buf, 15);
+    hashes[i] = Hash(buf, 15, 0);
+  }
+  table.EnableBloom(0);
+  double plain = TimeMisses(table, keys, hashes);
+  table.EnableBloom(bits_per_key);
+  double filtered = TimeMisses(table, keys, hashes);
+
+  HandleTable::BloomStats st = table.GetBloomStats();
+  printf("%d entries, %d bits/key: miss Lookup %.1f ns/key, with bloom %.1f ns/key, speedup %.2fx\n",
+         entries, bits_per_key, plain, filtered, plain / filtered);
+  printf("bloom %zu bytes (%.2f bits/entry), fpr %.4f, estimated %.4f, rejected %llu of %llu, %llu rebuilds\n",
+         st.bytes, st.bytes * 8.0 / entries, st.fpr, st.estimated_fpr,
+         (unsigned long long)st.rejected, (unsigned long long)st.queries,
+         (unsigned long long)rebuilds);
+
+  for (int i = 0; i < entries; i++) {
+    free(handles[i]);
+  }
+  return 0;
+}
+
+// 每 kScanEvery 次 Zipf 访问之后插入一段 kScanLength 个只出现一次的 key
+template <class Cache>
+static void RunTrace(const char* name, Cache& cache, const std::vector<string>& trace) {
+  size_t hits = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < trace.size(); i++) {
+    const string& key = trace[i];
+    uint32_t hash = Hash(key.data(), key.size(), 0);
+    LRUHandle* h = cache.Lookup(key, hash);
+    if (h != NULL) {
+      hits++;
+    } else {
+      h = cache.Insert(key, hash, NULL, 1, DeleteNothing);
+    }
+    cache.Release(h);
+  }
+  double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%-8s hit ratio %.4f, %.2f Mops/s\n", name, (double)hits / trace.size(), trace.size() / sec / 1e6);
+}
+
+static int BenchTinyLFU(size_t capacity, int keys) {
+  const int kOps = 4000000;
+  const int kScanEvery = 20000;
+  const int kScanLength = 5000;
+  ZipfGenerator zipf(keys, 0.9);
+  std::mt19937_64 rnd(1);
+  std::vector<string> trace;
+  char buf[32];
+  int scan = 0;
+
+  trace.reserve(kOps + kOps / kScanEvery * kScanLength);
+  for (int i = 0; i < kOps; i++) {
+    snprintf(buf, sizeof(buf), "%015d", zipf.Next(rnd));
+    trace.push_back(buf);
+    if ((i + 1) % kScanEvery == 0) {
+      for (int j = 0; j < kScanLength; j++) {
+        snprintf(buf, sizeof(buf), "scan%011d", scan++);
+        trace.push_back(buf);
+      }
+    }
+  }
+
+  printf("capacity %zu, %d keys, zipf 0.90, scan %d every %d\n", capacity, keys, kScanLength, kScanEvery);
+  LRUCache lru;
+  lru.SetCapacity(capacity);
+  RunTrace("lru", lru, trace);
+  TinyLFUCache tinylfu(capacity);
+  RunTrace("tinylfu", tinylfu, trace);
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1 && strcmp(argv[1], "tinylfu") == 0) {
+    return BenchTinyLFU(argc > 2 ? atoi(argv[2]) : 10000,
+                        argc > 3 ? atoi(argv[3]) : 1000000);
+  }
+  if (argc > 1 && strcmp(argv[1], "bloom") == 0) {
+    return BenchBloom(argc > 2 ? atoi(argv[2]) : 4000000,
+                      argc > 3 ? atoi(argv[3]) : 10);
+  }
+  if (argc > 1 && strcmp(argv[1], "batch") == 0) {
+    return BenchLookupBatch(argc > 2 ? atoi(argv[2]) : 8000000,
+                            argc > 3 ? atoi(argv[3]) : 128);
+  }
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+  size_t capacity = argc > 2 ? atoi(argv[2]) : 10000;
+  int keys = argc > 3 ? atoi(argv[3]) : 1000000;
+  double s = argc > 4 ? atof(argv[4]) : 0.99;
+  const int kOps = 1000000;
+
+  ShardedLRUCache cache(capacity);
+  ZipfGenerator zipf(keys, s);
+  std::atomic<uint64_t> hits(0), misses(0);
+  std::vector<std::thread> workers;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int t = 0; t < threads; t++) {
+    workers.push_back(std::thread([&, t]() {
+      std::mt19937_64 rnd(t + 1);
+      uint64_t hit = 0, miss = 0;
+      char buf[16];
+      for (int i = 0; i < kOps; i++) {
+        snprintf(buf, sizeof(buf), "%015d", zipf.Next(rnd));
+        string key(buf, 15);
+        LRUHandle* h = cache.Lookup(key);
+        if (h != NULL) {
+          hit++;
+        } else {
+          miss++;
+          h = cache.Insert(key, NULL, 1, DeleteNothing);
+        }
+        cache.Release(h);
+      }
+      hits += hit;
+      misses += miss;
+    }));
+  }
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+  double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("%d threads, capacity %zu, %d keys, zipf %.2f: hit ratio %.4f, %.2f Mops/s\n",
+         threads, capacity, keys, s,
+         (double)hits / (hits + misses), threads * kOps / sec / 1e6);
+  return 0;
 }
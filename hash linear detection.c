@@ -1,23 +1,13 @@
 #ifndef _HASHENTRY_H_
 #define _HASHENTRY_H_
 
-typedef struct node
-{
-    void* key;
-    void* value;
-}node_t;
-
 typedef void (*ForeachFunc)(void*);
 typedef int (*HashFunc)(int, void*);
-typedef struct hash
-{
-    node_t* nodes;
-    int bucketsSize;
-    HashFunc hashFunc;
-}hash_t;
+typedef struct hash hash_t;
 
 hash_t* Hash_alloc(int bucketsSize, HashFunc hashFunc);
 
+// 返回的 value 指针在下一次 Hash_add_entry / Hash_free_entry 之前有效(扩容 robin hood 删除都会挪动元素)
 void* Hash_find_entry(hash_t* hash, void* key, int keySize);
 
 void Hash_add_entry(hash_t* hash, void* key, int keySize, void* value, int valueSize);
@@ -28,6 +18,29 @@ void Hash_destroy(hash_t* hash);
 
 void Hash_foreach(hash_t* hash, ForeachFunc KeyForeachFunc, ForeachFunc ValueForeachFunc);
 
+// 查找 key 要看几个位置(swiss table 是几组) bench 统计探测长度用
+int Hash_probe_length(hash_t* hash, void* key, int keySize);
+
+#ifdef HASH_STATS
+// 定义 HASH_STATS 时可以取表的统计 不定义时这个结构和表里的计数都不编译
+// 直方图等都是 Hash_get_stats 时遍历整个表现算的 查找和插入的路径上不加计数
+#define HASH_STATS_HIST 16
+
+typedef struct HashStats
+{
+    long long probeHist[HASH_STATS_HIST];  // probeHist[i] 是查找要看 i+1 个位置(swiss table 是组)的 key 数 最后一格包括更长的
+    int size;
+    int bucketsSize;
+    double loadFactor;
+    long long resizes;                     // 重建次数 swiss table 原大小清墓碑的重建也算
+    double resizeSeconds;
+    int tombstones;
+    long bytes;                            // slot 数组加单独 malloc 的 key/value
+}HashStats;
+
+void Hash_get_stats(hash_t* hash, HashStats* stats);
+#endif
+
 #endif // _HASHENTRY_H_
 
 #include <malloc.h>
@@ -35,6 +48,23 @@ void Hash_foreach(hash_t* hash, ForeachFunc KeyForeachFunc, ForeachFunc ValueFor
 #include <string.h>
 #include "hashentry.h"
 
+// 定义 HASH_LINEAR_PROBE 使用原来逐个 slot 线性探测的版本(固定大小 不扩容)
+// 定义 HASH_ROBIN_HOOD 使用 robin hood 线性探测 否则使用 swiss table
+#ifdef HASH_LINEAR_PROBE
+
+typedef struct node
+{
+    void* key;
+    void* value;
+}node_t;
+
+struct hash
+{
+    node_t* nodes;
+    int bucketsSize;
+    HashFunc hashFunc;
+};
+
 hash_t* Hash_alloc(int bucketsSize, HashFunc hashFunc)
 {
     hash_t* hash = (hash_t*)malloc(sizeof(hash_t) + bucketsSize*sizeof(node_t)); // 头 + node_t数组
@@ -127,6 +157,21 @@ void Hash_free_entry(hash_t* hash, void* key, int keySize)
     }
 }
 
+int Hash_probe_length(hash_t* hash, void* key, int keySize)
+{
+    int bucket = (*hash->hashFunc)(hash->bucketsSize, key);
+    int curr = bucket;
+    int probes = 1;
+    while(hash->nodes[curr].key && 0 != memcmp(hash->nodes[curr].key, key, keySize))
+    {
+        curr = (curr+1) % hash->bucketsSize;
+        if(curr == bucket)
+            break;
+        ++probes;
+    }
+    return probes;
+}
+
 void Hash_destroy(hash_t* hash)
 {
     int i = 0;
@@ -157,6 +202,693 @@ void Hash_foreach(hash_t* hash, ForeachFunc KeyForeachFunc, ForeachFunc ValueFor
     }
 }
 
+#ifdef HASH_STATS
+// 固定大小 不扩容 删除直接清空没有墓碑 节点里没记 key/value 的大小 bytes 只算数组
+void Hash_get_stats(hash_t* hash, HashStats* stats)
+{
+    int i = 0;
+    memset(stats, 0, sizeof(*stats));
+    for(i = 0; i < hash->bucketsSize; ++i)
+    {
+        if(hash->nodes[i].key)
+        {
+            int bucket = (*hash->hashFunc)(hash->bucketsSize, hash->nodes[i].key);
+            int probes = (i - bucket + hash->bucketsSize) % hash->bucketsSize + 1;
+            ++stats->probeHist[probes < HASH_STATS_HIST ? probes - 1 : HASH_STATS_HIST - 1];
+            ++stats->size;
+        }
+    }
+    stats->bucketsSize = hash->bucketsSize;
+    stats->loadFactor = (double)stats->size / hash->bucketsSize;
+    stats->bytes = sizeof(hash_t) + hash->bucketsSize * sizeof(node_t);
+}
+#endif
+
+#else
+
+// swiss table 和 robin hood 共用的 slot 布局
+#include <stdint.h>
+
+#define HASH_INLINE_KEY 16
+#define HASH_INLINE_VALUE 40
+
+// 一个 slot 正好 64 字节 slots 数组按 64 对齐 查找命中时只碰一条 cache line
+typedef struct slot
+{
+    int keySize;
+    int valueSize;
+    char key[HASH_INLINE_KEY];      // 放不下的时候保存 malloc 出来的指针
+    char value[HASH_INLINE_VALUE];
+}slot_t;
+
+static inline void* slot_key(slot_t* slot)
+{
+    void* p = slot->key;
+    if(slot->keySize > HASH_INLINE_KEY)
+        memcpy(&p, slot->key, sizeof(p));
+    return p;
+}
+
+static inline void* slot_value(slot_t* slot)
+{
+    void* p = slot->value;
+    if(slot->valueSize > HASH_INLINE_VALUE)
+        memcpy(&p, slot->value, sizeof(p));
+    return p;
+}
+
+static void slot_free(slot_t* slot)
+{
+    if(slot->keySize > HASH_INLINE_KEY)
+        free(slot_key(slot));
+    if(slot->valueSize > HASH_INLINE_VALUE)
+        free(slot_value(slot));
+}
+
+static void slot_set(slot_t* slot, void* key, int keySize, void* value, int valueSize)
+{
+    slot->keySize = keySize;
+    slot->valueSize = valueSize;
+    if(keySize > HASH_INLINE_KEY)
+    {
+        void* p = malloc(keySize);
+        assert(p);
+        memcpy(slot->key, &p, sizeof(p));
+    }
+    if(valueSize > HASH_INLINE_VALUE)
+    {
+        void* p = malloc(valueSize);
+        assert(p);
+        memcpy(slot->value, &p, sizeof(p));
+    }
+    memcpy(slot_key(slot), key, keySize);   // 这里加size是因为可能是char[] 字符数组等
+    memcpy(slot_value(slot), value, valueSize);
+}
+
+#ifdef HASH_STATS
+#include <time.h>
+
+static double stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// slot 外面单独 malloc 的字节数
+static long slot_bytes(slot_t* slot)
+{
+    return (slot->keySize > HASH_INLINE_KEY ? slot->keySize : 0)
+        + (slot->valueSize > HASH_INLINE_VALUE ? slot->valueSize : 0);
+}
+
+static void stats_add_probes(HashStats* stats, int probes)
+{
+    ++stats->probeHist[probes < HASH_STATS_HIST ? probes - 1 : HASH_STATS_HIST - 1];
+}
+#endif
+
+// hashFunc 只负责映射到 [0, buckets) 这里给它一个很大的 buckets 当作完整的 hash 再打散一次
+static inline uint32_t Hash_hash(HashFunc hashFunc, void* key)
+{
+    uint32_t h = (uint32_t)(*hashFunc)(0x7fffffff, key);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+#ifdef HASH_ROBIN_HOOD
+
+/*
+ * robin hood: 线性探测 每个 slot 记下自己离 hash 起始位置的距离 dist
+ * 插入时碰到 dist 比自己小的元素(比自己"富")就抢下这个位置 被挤出来的元素接着往后找 所以各元素的 dist 很平均
+ * 查找走了 d 步时 当前 slot 的 dist 比 d 小(或者是空的) key 就不可能在后面 不命中也能提前停下
+ * 删除不留墓碑: 把后面 dist > 0 的元素依次往前挪一格(backward shift) 表里永远没有墓碑 增删再多探测长度也不会变长
+ * 元素个数超过 RH_MAX_LOAD_NUM / RH_MAX_LOAD_DEN 时扩大一倍
+ */
+#define RH_MIN_SIZE 16
+#define RH_MAX_LOAD_NUM 15
+#define RH_MAX_LOAD_DEN 16
+#define RH_EMPTY (-1)
+
+typedef struct meta
+{
+    uint32_t hash;
+    int dist;               // RH_EMPTY 表示空
+}meta_t;
+
+struct hash
+{
+    void* mem;              // slots 和 meta 是一次 malloc 出来的
+    meta_t* meta;           // 和 slots 分开放 探测时只扫 8 字节一个的 meta hash 相同才去碰 slot
+    slot_t* slots;
+    int bucketsSize;        // 2 的幂
+    int size;
+    HashFunc hashFunc;
+#ifdef HASH_STATS
+    long long resizes;
+    double resizeSeconds;
+#endif
+};
+
+static void Hash_init_slots(hash_t* hash, int bucketsSize)
+{
+    int size = RH_MIN_SIZE;
+    int i = 0;
+    while(size < bucketsSize)
+        size *= 2;
+
+    hash->bucketsSize = size;
+    hash->size = 0;
+    hash->mem = malloc(size * (sizeof(slot_t) + sizeof(meta_t)) + 63);
+    assert(hash->mem);
+    hash->slots = (slot_t*)(((uintptr_t)hash->mem + 63) & ~(uintptr_t)63);
+    hash->meta = (meta_t*)(hash->slots + size);
+    for(i = 0; i < size; ++i)
+        hash->meta[i].dist = RH_EMPTY;
+}
+
+hash_t* Hash_alloc(int bucketsSize, HashFunc hashFunc)
+{
+    hash_t* hash = (hash_t*)malloc(sizeof(hash_t));
+    assert(hash);
+
+    hash->hashFunc = hashFunc;
+    Hash_init_slots(hash, bucketsSize);
+#ifdef HASH_STATS
+    hash->resizes = 0;
+    hash->resizeSeconds = 0;
+#endif
+    return hash;
+}
+
+// 返回 key 所在的 slot 下标 没有返回 -1 probes 不为 NULL 时带回看过的 slot 数
+static int Hash_find_slot(hash_t* hash, void* key, int keySize, uint32_t h, int* probes)
+{
+    int mask = hash->bucketsSize - 1;
+    int i = h & mask;
+    int dist = 0;
+
+    for(;; ++dist, i = (i + 1) & mask)
+    {
+        meta_t* m = &hash->meta[i];
+        if(m->dist < dist)                                    // 空 slot 的 dist 是 -1 也在这里停下
+            break;
+        if(m->hash == h && hash->slots[i].keySize == keySize
+            && 0 == memcmp(slot_key(&hash->slots[i]), key, keySize))
+        {
+            if(probes)
+                *probes = dist + 1;
+            return i;
+        }
+    }
+    if(probes)
+        *probes = dist + 1;
+    return -1;
+}
+
+// 调用者保证 key 不在表里而且表没满 slot 会被换出来的元素覆盖
+static void Hash_insert_slot(hash_t* hash, uint32_t h, slot_t* slot)
+{
+    int mask = hash->bucketsSize - 1;
+    int i = h & mask;
+    int dist = 0;
+
+    for(;; ++dist, i = (i + 1) & mask)
+    {
+        meta_t* m = &hash->meta[i];
+        if(m->dist == RH_EMPTY)
+        {
+            m->hash = h;
+            m->dist = dist;
+            hash->slots[i] = *slot;
+            return;
+        }
+        if(m->dist < dist)
+        {
+            // 劫富济贫 占下这个位置 原来的元素接着往后放
+            uint32_t th = m->hash;
+            int td = m->dist;
+            slot_t tmp = hash->slots[i];
+            m->hash = h;
+            m->dist = dist;
+            hash->slots[i] = *slot;
+            h = th;
+            dist = td;
+            *slot = tmp;
+        }
+    }
+}
+
+// 元素保存了 hash 重建时不用再算 外面 malloc 的 key/value 也不用重新分配
+static void Hash_rehash(hash_t* hash, int bucketsSize)
+{
+    void* mem = hash->mem;
+    meta_t* meta = hash->meta;
+    slot_t* slots = hash->slots;
+    int oldSize = hash->bucketsSize;
+    int size = hash->size;
+    int i = 0;
+#ifdef HASH_STATS
+    double start = stats_now();
+#endif
+
+    Hash_init_slots(hash, bucketsSize);
+    for(i = 0; i < oldSize; ++i)
+    {
+        if(meta[i].dist != RH_EMPTY)
+            Hash_insert_slot(hash, meta[i].hash, &slots[i]);
+    }
+    hash->size = size;
+    free(mem);
+#ifdef HASH_STATS
+    ++hash->resizes;
+    hash->resizeSeconds += stats_now() - start;
+#endif
+}
+
+void* Hash_find_entry(hash_t* hash, void* key, int keySize)
+{
+    assert(hash && key);
+
+    int i = Hash_find_slot(hash, key, keySize, Hash_hash(hash->hashFunc, key), NULL);
+    if(i < 0)
+        return NULL;
+    return slot_value(&hash->slots[i]);
+}
+
+void Hash_add_entry(hash_t* hash, void* key, int keySize, void* value, int valueSize)
+{
+    assert(hash && key && value);
+
+    uint32_t h = Hash_hash(hash->hashFunc, key);
+    if(Hash_find_slot(hash, key, keySize, h, NULL) >= 0) // value已经存在了
+        return;
+
+    if((hash->size + 1) * RH_MAX_LOAD_DEN > hash->bucketsSize * RH_MAX_LOAD_NUM)
+        Hash_rehash(hash, hash->bucketsSize * 2);
+
+    slot_t slot;
+    slot_set(&slot, key, keySize, value, valueSize);
+    Hash_insert_slot(hash, h, &slot);
+    ++hash->size;
+}
+
+void Hash_free_entry(hash_t* hash, void* key, int keySize)
+{
+    assert(hash && key);
+
+    int i = Hash_find_slot(hash, key, keySize, Hash_hash(hash->hashFunc, key), NULL);
+    if(i < 0)
+        return;
+
+    slot_free(&hash->slots[i]);
+    --hash->size;
+
+    // 后面不在自己起始位置上的元素都往前挪一格 碰到空的或者 dist 为 0 的就停
+    int mask = hash->bucketsSize - 1;
+    int next = (i + 1) & mask;
+    while(hash->meta[next].dist > 0)
+    {
+        hash->meta[i].hash = hash->meta[next].hash;
+        hash->meta[i].dist = hash->meta[next].dist - 1;
+        hash->slots[i] = hash->slots[next];
+        i = next;
+        next = (next + 1) & mask;
+    }
+    hash->meta[i].dist = RH_EMPTY;
+}
+
+int Hash_probe_length(hash_t* hash, void* key, int keySize)
+{
+    int probes = 0;
+    Hash_find_slot(hash, key, keySize, Hash_hash(hash->hashFunc, key), &probes);
+    return probes;
+}
+
+void Hash_destroy(hash_t* hash)
+{
+    int i = 0;
+    for(i = 0; i < hash->bucketsSize; ++i)
+    {
+        if(hash->meta[i].dist != RH_EMPTY)
+            slot_free(&hash->slots[i]);
+    }
+    free(hash->mem);
+    free(hash);
+}
+
+void Hash_foreach(hash_t* hash, ForeachFunc KeyForeachFunc, ForeachFunc ValueForeachFunc)
+{
+    int i = 0;
+    for(i = 0; i < hash->bucketsSize; ++i)
+    {
+        if(hash->meta[i].dist != RH_EMPTY)
+        {
+            KeyForeachFunc(slot_key(&hash->slots[i]));
+            ValueForeachFunc(slot_value(&hash->slots[i]));
+        }
+    }
+}
+
+#ifdef HASH_STATS
+// 探测长度就是 dist + 1 不用重新查 删除是 backward shift 没有墓碑
+void Hash_get_stats(hash_t* hash, HashStats* stats)
+{
+    int i = 0;
+    memset(stats, 0, sizeof(*stats));
+    stats->bytes = sizeof(hash_t) + hash->bucketsSize * (sizeof(slot_t) + sizeof(meta_t)) + 63;
+    for(i = 0; i < hash->bucketsSize; ++i)
+    {
+        if(hash->meta[i].dist != RH_EMPTY)
+        {
+            stats_add_probes(stats, hash->meta[i].dist + 1);
+            stats->bytes += slot_bytes(&hash->slots[i]);
+        }
+    }
+    stats->size = hash->size;
+    stats->bucketsSize = hash->bucketsSize;
+    stats->loadFactor = (double)hash->size / hash->bucketsSize;
+    stats->resizes = hash->resizes;
+    stats->resizeSeconds = hash->resizeSeconds;
+}
+#endif
+
+#else
+
+/*
+ * swiss table: 每个 slot 对应一个控制字节 EMPTY / DELETED / 或者 hash 的低 7 位(H2)
+ * 控制字节 16 个一组 查找时用 SSE2 一条指令把一组 16 个控制字节和 H2 比较 只有匹配的 slot 才去比较 key
+ * 组内有 EMPTY 说明 key 不存在 探测停止 否则按 1,2,3... 组的步长跳到下一组(组数是 2 的幂 能遍历所有组)
+ * key 和 value 直接放在 slot 里 超过 HASH_INLINE_KEY / HASH_INLINE_VALUE 的才另外 malloc
+ * 删除留下 DELETED(墓碑) 活的元素加墓碑超过 7/8 时重建: 元素多就扩大一倍 否则同样大小重建只清掉墓碑
+ * hash 的低 7 位做 H2 其余的位选组
+ */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define GROUP_WIDTH 16
+
+#define CTRL_EMPTY ((signed char)-128)
+#define CTRL_DELETED ((signed char)-2)
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static int ctz(unsigned int x) { unsigned long i; _BitScanForward(&i, x); return (int)i; }
+#else
+#define ctz(x) __builtin_ctz(x)
+#endif
+
+struct hash
+{
+    void* mem;          // slots 和 ctrl 是一次 malloc 出来的
+    signed char* ctrl;
+    slot_t* slots;
+    int bucketsSize;    // slot 个数 是 GROUP_WIDTH 的倍数且是 2 的幂
+    int size;
+    int tombstones;
+    HashFunc hashFunc;
+#ifdef HASH_STATS
+    long long resizes;
+    double resizeSeconds;
+#endif
+};
+
+// 下面三个函数返回一组 16 个控制字节的位掩码 第 i 位对应组内第 i 个 slot
+static inline unsigned int group_match(const signed char* ctrl, signed char h2)
+{
+#ifdef __SSE2__
+    __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(h2)));
+#else
+    unsigned int mask = 0;
+    int i = 0;
+    for(i = 0; i < GROUP_WIDTH; ++i)
+    {
+        if(ctrl[i] == h2)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+static inline unsigned int group_match_empty(const signed char* ctrl)
+{
+    return group_match(ctrl, CTRL_EMPTY);
+}
+
+// EMPTY 和 DELETED 都小于 -1 存了元素的控制字节是 0~127
+static inline unsigned int group_match_free(const signed char* ctrl)
+{
+#ifdef __SSE2__
+    __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), g));
+#else
+    unsigned int mask = 0;
+    int i = 0;
+    for(i = 0; i < GROUP_WIDTH; ++i)
+    {
+        if(ctrl[i] < -1)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+static void Hash_init_slots(hash_t* hash, int bucketsSize)
+{
+    int size = GROUP_WIDTH;
+    while(size < bucketsSize)
+        size *= 2;
+
+    hash->bucketsSize = size;
+    hash->size = 0;
+    hash->tombstones = 0;
+    hash->mem = malloc(size * sizeof(slot_t) + size + 63);
+    assert(hash->mem);
+    hash->slots = (slot_t*)(((uintptr_t)hash->mem + 63) & ~(uintptr_t)63);
+    hash->ctrl = (signed char*)(hash->slots + size);
+    memset(hash->ctrl, CTRL_EMPTY, size);
+}
+
+hash_t* Hash_alloc(int bucketsSize, HashFunc hashFunc)
+{
+    hash_t* hash = (hash_t*)malloc(sizeof(hash_t));
+    assert(hash);
+
+    hash->hashFunc = hashFunc;
+    Hash_init_slots(hash, bucketsSize);
+#ifdef HASH_STATS
+    hash->resizes = 0;
+    hash->resizeSeconds = 0;
+#endif
+    return hash;
+}
+
+// 返回 key 所在的 slot 下标 没有返回 -1 probes 不为 NULL 时带回看过的组数
+static int Hash_find_slot(hash_t* hash, void* key, int keySize, uint32_t h, int* probes)
+{
+    int mask = hash->bucketsSize / GROUP_WIDTH - 1;
+    int group = (h >> 7) & mask;
+    int step = 0;
+
+    for(;;)
+    {
+        const signed char* ctrl = hash->ctrl + group * GROUP_WIDTH;
+        unsigned int match = group_match(ctrl, (signed char)(h & 0x7f));
+        if(probes)
+            *probes = step + 1;
+        while(match)
+        {
+            int i = group * GROUP_WIDTH + ctz(match);
+            slot_t* slot = &hash->slots[i];
+            if(slot->keySize == keySize && 0 == memcmp(slot_key(slot), key, keySize))
+                return i;
+            match &= match - 1;
+        }
+        if(group_match_empty(ctrl))                           // 组里有空位 key 不可能在后面
+            return -1;
+        if(++step > mask)                                     // 所有的组都看过了
+            return -1;
+        group = (group + step) & mask;
+    }
+}
+
+// 第一个 EMPTY 或 DELETED 的 slot 调用者保证表没满
+static int Hash_find_free(hash_t* hash, uint32_t h)
+{
+    int mask = hash->bucketsSize / GROUP_WIDTH - 1;
+    int group = (h >> 7) & mask;
+    int step = 0;
+    unsigned int match;
+
+    while(!(match = group_match_free(hash->ctrl + group * GROUP_WIDTH)))
+    {
+        ++step;
+        group = (group + step) & mask;
+    }
+    return group * GROUP_WIDTH + ctz(match);
+}
+
+// 只搬 slot 结构体 外面 malloc 的 key/value 不用重新分配
+static void Hash_rehash(hash_t* hash, int bucketsSize)
+{
+    void* mem = hash->mem;
+    signed char* ctrl = hash->ctrl;
+    slot_t* slots = hash->slots;
+    int oldSize = hash->bucketsSize;
+    int size = hash->size;
+    int i = 0;
+#ifdef HASH_STATS
+    double start = stats_now();
+#endif
+
+    Hash_init_slots(hash, bucketsSize);
+    for(i = 0; i < oldSize; ++i)
+    {
+        if(ctrl[i] >= 0)
+        {
+            uint32_t h = Hash_hash(hash->hashFunc, slot_key(&slots[i]));
+            int pos = Hash_find_free(hash, h);
+            hash->ctrl[pos] = (signed char)(h & 0x7f);
+            hash->slots[pos] = slots[i];
+        }
+    }
+    hash->size = size;
+    free(mem);
+#ifdef HASH_STATS
+    ++hash->resizes;
+    hash->resizeSeconds += stats_now() - start;
+#endif
+}
+
+void* Hash_find_entry(hash_t* hash, void* key, int keySize)
+{
+    assert(hash && key);
+
+    int i = Hash_find_slot(hash, key, keySize, Hash_hash(hash->hashFunc, key), NULL);
+    if(i < 0)
+        return NULL;
+    return slot_value(&hash->slots[i]);
+}
+
+void Hash_add_entry(hash_t* hash, void* key, int keySize, void* value, int valueSize)
+{
+    assert(hash && key && value);
+
+    uint32_t h = Hash_hash(hash->hashFunc, key);
+    if(Hash_find_slot(hash, key, keySize, h, NULL) >= 0) // value已经存在了
+        return;
+
+    if((hash->size + hash->tombstones + 1) * 8 > hash->bucketsSize * 7)
+    {
+        // 墓碑多的话原大小重建就够了
+        if((hash->size + 1) * 16 > hash->bucketsSize * 7)
+            Hash_rehash(hash, hash->bucketsSize * 2);
+        else
+            Hash_rehash(hash, hash->bucketsSize);
+    }
+
+    int i = Hash_find_free(hash, h);
+    slot_t* slot = &hash->slots[i];
+    if(hash->ctrl[i] == CTRL_DELETED)
+        --hash->tombstones;
+    hash->ctrl[i] = (signed char)(h & 0x7f);
+    ++hash->size;
+
+    slot_set(slot, key, keySize, value, valueSize);
+}
+
+void Hash_free_entry(hash_t* hash, void* key, int keySize)
+{
+    assert(hash && key);
+
+    int i = Hash_find_slot(hash, key, keySize, Hash_hash(hash->hashFunc, key), NULL);
+    if(i < 0)
+        return;
+
+    slot_free(&hash->slots[i]);
+    --hash->size;
+    // 组里已经有空位的话 探测本来就会在这一组停下 可以直接置为 EMPTY 不用留墓碑
+    if(group_match_empty(hash->ctrl + (i & ~(GROUP_WIDTH - 1))))
+    {
+        hash->ctrl[i] = CTRL_EMPTY;
+    }
+    else
+    {
+        hash->ctrl[i] = CTRL_DELETED;
+        ++hash->tombstones;
+    }
+}
+
+int Hash_probe_length(hash_t* hash, void* key, int keySize)
+{
+    int probes = 0;
+    Hash_find_slot(hash, key, keySize, Hash_hash(hash->hashFunc, key), &probes);
+    return probes;
+}
+
+void Hash_destroy(hash_t* hash)
+{
+    int i = 0;
+    for(i = 0; i < hash->bucketsSize; ++i)
+    {
+        if(hash->ctrl[i] >= 0)
+            slot_free(&hash->slots[i]);
+    }
+    free(hash->mem);
+    free(hash);
+}
+
+void Hash_foreach(hash_t* hash, ForeachFunc KeyForeachFunc, ForeachFunc ValueForeachFunc)
+{
+    int i = 0;
+    for(i = 0; i < hash->bucketsSize; ++i)
+    {
+        if(hash->ctrl[i] >= 0)
+        {
+            KeyForeachFunc(slot_key(&hash->slots[i]));
+            ValueForeachFunc(slot_value(&hash->slots[i]));
+        }
+    }
+}
+
+#ifdef HASH_STATS
+// 每个元素重新查一次 得到要看几组
+void Hash_get_stats(hash_t* hash, HashStats* stats)
+{
+    int i = 0;
+    memset(stats, 0, sizeof(*stats));
+    stats->bytes = sizeof(hash_t) + hash->bucketsSize * (sizeof(slot_t) + 1) + 63;
+    for(i = 0; i < hash->bucketsSize; ++i)
+    {
+        if(hash->ctrl[i] >= 0)
+        {
+            slot_t* slot = &hash->slots[i];
+            void* key = slot_key(slot);
+            int probes = 0;
+            Hash_find_slot(hash, key, slot->keySize, Hash_hash(hash->hashFunc, key), &probes);
+            stats_add_probes(stats, probes);
+            stats->bytes += slot_bytes(slot);
+        }
+    }
+    stats->size = hash->size;
+    stats->bucketsSize = hash->bucketsSize;
+    stats->loadFactor = (double)hash->size / hash->bucketsSize;
+    stats->resizes = hash->resizes;
+    stats->resizeSeconds = hash->resizeSeconds;
+    stats->tombstones = hash->tombstones;
+}
+#endif
+
+#endif // HASH_ROBIN_HOOD
+
+#endif
+
 #include <stdio.h>
 #include <malloc.h>
 #include <assert.h>
@@ -242,4 +974,171 @@ int main(void)
     Hash_destroy(hash);
 
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * bench.c 插入 / 命中查找 / 不命中查找 / 等量增删(churn) 之后再查找 每种操作的 ns/op
+ * 最后打印 churn 之后命中和不命中的探测长度分布(swiss table 按组算 其余按 slot 算)
+ *   gcc -O2 hashentry.c bench.c -o bench_swiss
+ *   gcc -O2 -DHASH_ROBIN_HOOD hashentry.c bench.c -o bench_robin
+ *   gcc -O2 -DHASH_LINEAR_PROBE hashentry.c bench.c -o bench_linear
+ *   gcc -O2 -DHASH_SIMPLE hash.c bench.c -o bench_simple     (hash simply implement.c 中的 hash_t 没有探测长度)
+ * ./bench_robin [n] 元素个数默认 1000000 robin hood 在 n = 950000 时装填率是 950000 / 2^20 = 90.6%
+ * 后两种不会扩容 所以初始大小给 2*n
+ * 加 -DHASH_STATS 时最后再打印 Hash_get_stats 的装填率 扩容 墓碑和内存
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HASH_SIMPLE
+#include "hash.h"
+#include "common.h"
+#define Hash_alloc hash_alloc
+#define Hash_add_entry hash_add_entry
+#define Hash_find_entry hash_lookup_entry
+#define Hash_free_entry hash_free_entry
+typedef unsigned int bucket_t;
+#else
+#include "hashentry.h"
+typedef int bucket_t;
+#endif
+
+#if defined(HASH_SIMPLE) || defined(HASH_LINEAR_PROBE)
+#define BENCH_BUCKETS(n) (2 * (n))
+#else
+#define BENCH_BUCKETS(n) (n)
+#endif
+
+#define HIST_SIZE 16
+
+typedef struct bench_value
+{
+    int no;
+    char name[12];
+}bench_value_t;
+
+static bucket_t hash_bench(bucket_t buckets, void* key)
+{
+    unsigned int k = *(unsigned int*)key * 2654435761u;
+    return (bucket_t)(k % (unsigned int)buckets);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void shuffle(unsigned int* keys, int n)
+{
+    int i = 0;
+    for(i = n - 1; i > 0; --i)
+    {
+        int j = rand() % (i + 1);
+        unsigned int k = keys[i];
+        keys[i] = keys[j];
+        keys[j] = k;
+    }
+}
+
+// 命中查找换一个顺序 不然按插入顺序 malloc 出来的 key 是顺序访问的 对原来的版本不公平的有利
+static double bench_find(hash_t* hash, unsigned int* lookup, int n, int delta, int* found)
+{
+    double t = now();
+    int i = 0;
+    for(i = 0; i < n; ++i)
+    {
+        unsigned int key = lookup[i] + delta;
+        *found += Hash_find_entry(hash, &key, sizeof(key)) != NULL;
+    }
+    return (now() - t) * 1e9 / n;
+}
+
+#ifndef HASH_SIMPLE
+static void print_hist(const char* name, hash_t* hash, unsigned int* keys, int n, int delta)
+{
+    int hist[HIST_SIZE] = {0};
+    long long total = 0;
+    int max = 0;
+    int i = 0;
+    for(i = 0; i < n; ++i)
+    {
+        unsigned int key = keys[i] + delta;
+        int probes = Hash_probe_length(hash, &key, sizeof(key));
+        total += probes;
+        if(probes > max)
+            max = probes;
+        ++hist[probes < HIST_SIZE ? probes - 1 : HIST_SIZE - 1];
+    }
+    printf("%s probes: mean %.2f max %d\n", name, (double)total / n, max);
+    for(i = 0; i < HIST_SIZE; ++i)
+    {
+        if(hist[i])
+            printf("  %s%-3d %6.2f%%\n", i == HIST_SIZE - 1 ? ">=" : "  ", i + 1, 100.0 * hist[i] / n);
+    }
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    unsigned int* keys = (unsigned int*)malloc(n * sizeof(unsigned int));
+    unsigned int* lookup = (unsigned int*)malloc(n * sizeof(unsigned int));
+    bench_value_t value = {0, "bench"};
+    hash_t* hash = Hash_alloc(BENCH_BUCKETS(n), hash_bench);
+    int i = 0, found = 0;
+    double t;
+
+    srand(1);
+    for(i = 0; i < n; ++i)
+        keys[i] = (unsigned int)i * 2;                    // 偶数 奇数用来测不命中
+    shuffle(keys, n);                                     // 打乱插入顺序
+
+    t = now();
+    for(i = 0; i < n; ++i)
+    {
+        value.no = i;
+        Hash_add_entry(hash, &keys[i], sizeof(keys[i]), &value, sizeof(value));
+    }
+    printf("add        %6.1f ns/op\n", (now() - t) * 1e9 / n);
+
+    memcpy(lookup, keys, n * sizeof(unsigned int));
+    shuffle(lookup, n);
+    printf("find hit   %6.1f ns/op\n", bench_find(hash, lookup, n, 0, &found));
+    printf("find miss  %6.1f ns/op\n", bench_find(hash, lookup, n, 1, &found));
+
+    // 删一个旧的加一个新的 元素个数不变 新 key 接着往上编号
+    t = now();
+    for(i = 0; i < n; ++i)
+    {
+        int j = rand() % n;
+        Hash_free_entry(hash, &keys[j], sizeof(keys[j]));
+        keys[j] = (unsigned int)(n + i) * 2;
+        Hash_add_entry(hash, &keys[j], sizeof(keys[j]), &value, sizeof(value));
+    }
+    printf("churn      %6.1f ns/op\n", (now() - t) * 1e9 / (2 * n));
+
+    memcpy(lookup, keys, n * sizeof(unsigned int));
+    shuffle(lookup, n);
+    printf("churn hit  %6.1f ns/op\n", bench_find(hash, lookup, n, 0, &found));
+    printf("churn miss %6.1f ns/op\n", bench_find(hash, lookup, n, 1, &found));
+    printf("found %d of %d\n", found, 2 * n);
+
+#ifndef HASH_SIMPLE
+    print_hist("hit ", hash, lookup, n, 0);
+    print_hist("miss", hash, lookup, n, 1);
+#ifdef HASH_STATS
+    HashStats stats;
+    Hash_get_stats(hash, &stats);
+    printf("stats: load %.3f, %lld resizes %.2f ms, %d tombstones, %ld bytes\n",
+        stats.loadFactor, stats.resizes, stats.resizeSeconds * 1e3, stats.tombstones, stats.bytes);
+#endif
+    Hash_destroy(hash);
+#endif
+    free(keys);
+    free(lookup);
+    return 0;
+}
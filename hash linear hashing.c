@@ -1,221 +1,509 @@
+
 #include "hash.h"
+#include "arena.h"
 #include "common.h"
 #include <assert.h>
 
+// 线性散列(Litwin linear hashing)
+// 桶数从 2^k 开始 用 split 指针按顺序每次只分裂一个桶 level 表示已经完整翻倍了几轮
+// 定位: b = h mod 2^(k+level) 如果 b < split 说明这个桶这一轮已经分裂过了 改用 h mod 2^(k+level+1)
+// 平均每个桶超过 MAX_LOAD 个节点时 本次插入顺带分裂 split 指向的桶
+// 分裂只是把节点从链表上摘下来挂到新桶 key 和 value 不会重新分配 也不会被复制第二次
+// 节点都从表自己的 arena 里分配 节点加 key/value 不超过 ARENA_MAX_SMALL 时三者放在同一块里
+// 否则 key/value 单独从 arena 分配 hash_destroy 时整个 arena 一起释放
+
+#define SEGMENT_SHIFT 8
+#define SEGMENT_SIZE (1u << SEGMENT_SHIFT)     // 每段的桶数
+#define MAX_LOAD 2
+
+#ifdef HASH_BLOOM
+// 分块 Bloom filter: 每块 8 个 32 位字 = 32 字节 一个 key 只落在一个块里 每个字置一位
+// 查询用 cur 按这一轮结束时最多能放的节点数分配
+// level 加一 或者删除的次数超过 桶数*MAX_LOAD 时 开始往一个新的 next 里重建 和分裂一样是增量的:
+// 之后每次插入/删除顺带把 BLOOM_SCAN_STEP 个桶的节点加进 next 新插入的 key 同时加进 cur 和 next
+// 分裂只会把节点挪到更大的桶号 扫描从小往大走 不会漏掉节点 扫完所有桶以后 next 换下 cur
+// 删掉的 key 在 next 里没有(除非它的桶已经扫过了) 不需要一次停下来走遍所有节点
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define BLOOM_BITS_PER_KEY 10
+// 每次插入最多分裂一个桶 扫描每次走的桶数要大于 1 才一定能追上
+#define BLOOM_SCAN_STEP 4
+
+typedef struct bloom_bits
+{
+    unsigned int *blocks;       // 32 字节对齐 没有时为 NULL
+    unsigned int nblocks;
+    void *raw;                  // calloc 返回的指针 大块直接来自 mmap 不用再清零
+} bloom_bits_t;
 
-typedef enum entry_status
+typedef struct bloom
 {
-    EMPTY,
-    ACTIVE,
-    DELETED
-} entry_status_t;
+    bloom_bits_t cur;
+    bloom_bits_t next;          // 正在重建的
+    unsigned int scan;          // 下一个要加进 next 的桶
+    unsigned int removed;       // 上次开始重建之后删除的次数
+    unsigned long long queries;
+    unsigned long long rejected;
+    unsigned long long false_positives;
+} bloom_t;
+
+static const unsigned int bloom_salt[8] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+#endif
 
 typedef struct hash_node
 {
-    enum entry_status status;
-    void *key;
+    struct hash_node *next;
+    unsigned int hash;          // 保存完整的 hash 分裂时不用再算
     unsigned int key_size;
-    void *value;
     unsigned int value_size;
+    void *key;                  // 指向节点后面的 data 或者 arena 里单独的一块
+    void *value;
 } hash_node_t;
 
+// key 按 8 字节对齐 value 接在后面
+#define NODE_INLINE_SIZE(key_size, value_size) \
+    (sizeof(hash_node_t) + (((key_size) + 7) & ~7u) + (value_size))
+
 struct hash
 {
-    unsigned int buckets;
+    unsigned int base;          // 初始桶数 2 的幂
+    unsigned int level;         // 本轮开始时桶数为 base << level
+    unsigned int split;         // 下一个要分裂的桶
+    unsigned int buckets;       // 当前桶数 (base << level) + split
     unsigned int size;
     hashfunc_t hash_func;
-    hash_node_t *nodes;
+    // 桶目录 每段 SEGMENT_SIZE 个桶 扩容只追加新段 已有的桶不会搬动
+    hash_node_t ***segments;
+    unsigned int nsegments;
+    arena_t arena;
+#ifdef HASH_BLOOM
+    bloom_t bloom;
+#endif
+#ifdef HASH_STATS
+    unsigned long long splits;
+    double split_seconds;
+#endif
 };
 
-unsigned int next_prime(unsigned int n);
-int is_prime(unsigned int n);
+unsigned int hash_get_bucket(hash_t *hash, unsigned int h);
+hash_node_t** hash_get_node_by_key(hash_t *hash, void *key, unsigned int key_size);
+static hash_node_t** hash_find_node(hash_t *hash, unsigned int h, void *key, unsigned int key_size);
+static void hash_split_bucket(hash_t *hash);
+
+#define BUCKET(hash, i) ((hash)->segments[(i) >> SEGMENT_SHIFT][(i) & (SEGMENT_SIZE - 1)])
+
+#ifdef HASH_STATS
+#include <time.h>
 
-unsigned int hash_get_bucket(hash_t *hash, void *key);
-hash_node_t* hash_get_node_by_key(hash_t *hash, void *key, unsigned int key_size);
+static double stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif
+
+#ifdef HASH_BLOOM
+// hash_func(~0u, key) 对整数 key 常常就是 key 本身 高位全是 0 先乘黄金分割数打散
+// 块号和块里的位都用打散后的值 块号取高位做 multiply-shift
+static inline unsigned int bloom_mix(unsigned int h)
+{
+    return h * 0x9e3779b9u;
+}
+
+static unsigned int* bloom_block(bloom_bits_t *bits, unsigned int h)
+{
+    return bits->blocks + (((unsigned long long)h * bits->nblocks) >> 32) * 8;
+}
+
+static void bloom_add(bloom_bits_t *bits, unsigned int h)
+{
+    h = bloom_mix(h);
+    unsigned int *b = bloom_block(bits, h);
+    int i;
+    for (i=0; i<8; i++)
+    {
+        b[i] |= 1u << ((h * bloom_salt[i]) >> 27);
+    }
+}
+
+static int bloom_may_contain(bloom_bits_t *bits, unsigned int h)
+{
+    h = bloom_mix(h);
+    unsigned int *b = bloom_block(bits, h);
+#ifdef __AVX2__
+    __m256i salt = _mm256_loadu_si256((const __m256i *)bloom_salt);
+    __m256i shift = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(h), salt), 27);
+    __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), shift);
+    return _mm256_testc_si256(_mm256_load_si256((const __m256i *)b), mask);
+#else
+    int i;
+    for (i=0; i<8; i++)
+    {
+        if ((b[i] & (1u << ((h * bloom_salt[i]) >> 27))) == 0)
+            return 0;
+    }
+    return 1;
+#endif
+}
+
+// 按这一轮结束时的容量分配 全是 0
+static void bloom_bits_alloc(hash_t *hash, bloom_bits_t *bits)
+{
+    unsigned long long keys = (unsigned long long)(hash->base << (hash->level + 1)) * MAX_LOAD;
+    bits->nblocks = (unsigned int)((keys * BLOOM_BITS_PER_KEY + 255) / 256);
+    bits->raw = calloc((size_t)bits->nblocks * 32 + 32, 1);
+    assert(bits->raw);
+    bits->blocks = (unsigned int *)(((size_t)bits->raw + 31) & ~(size_t)31);
+}
+
+static void bloom_bits_free(bloom_bits_t *bits)
+{
+    free(bits->raw);
+    memset(bits, 0, sizeof(*bits));
+}
+
+// 开始一次增量重建 已经在重建的话从头开始 大小按新的 level 算
+static void bloom_start(hash_t *hash)
+{
+    bloom_t *bloom = &hash->bloom;
+    bloom_bits_free(&bloom->next);
+    bloom_bits_alloc(hash, &bloom->next);
+    bloom->scan = 0;
+    bloom->removed = 0;
+}
+
+// 把 BLOOM_SCAN_STEP 个桶加进 next 所有的桶都扫完了就用 next 替换 cur
+static void bloom_step(hash_t *hash)
+{
+    bloom_t *bloom = &hash->bloom;
+    unsigned int n;
+    if (bloom->next.blocks == NULL)
+        return;
+    for (n=0; n<BLOOM_SCAN_STEP && bloom->scan < hash->buckets; n++, bloom->scan++)
+    {
+        hash_node_t *node;
+        for (node = BUCKET(hash, bloom->scan); node; node = node->next)
+        {
+            bloom_add(&bloom->next, node->hash);
+        }
+    }
+    if (bloom->scan == hash->buckets)
+    {
+        bloom_bits_free(&bloom->cur);
+        bloom->cur = bloom->next;
+        memset(&bloom->next, 0, sizeof(bloom->next));
+    }
+}
+
+// 0 表示 key 一定不在表里 同时记下统计
+static int bloom_check(bloom_t *bloom, unsigned int h)
+{
+    bloom->queries++;
+    if (!bloom_may_contain(&bloom->cur, h))
+    {
+        bloom->rejected++;
+        return 0;
+    }
+    return 1;
+}
+
+void hash_bloom_stats(hash_t *hash, hash_bloom_stats_t *stats)
+{
+    bloom_t *bloom = &hash->bloom;
+    unsigned long long negatives = bloom->rejected + bloom->false_positives;
+    stats->bytes = (unsigned long)(bloom->cur.nblocks + bloom->next.nblocks) * 32;
+    stats->queries = bloom->queries;
+    stats->rejected = bloom->rejected;
+    stats->false_positives = bloom->false_positives;
+    stats->fpr = negatives ? (double)bloom->false_positives / negatives : 0;
+}
+#endif
 
 
 hash_t* hash_alloc(unsigned int buckets, hashfunc_t hash_func)
 {
     hash_t *hash = (hash_t *)malloc(sizeof(hash_t));
-    
-    hash->buckets = buckets;
+    assert(hash);
+
+    hash->base = 1;
+    while (hash->base < buckets)
+    {
+        hash->base <<= 1;
+    }
+    hash->level = 0;
+    hash->split = 0;
+    hash->buckets = hash->base;
+    hash->size = 0;
     hash->hash_func = hash_func;
-    
-    int size = buckets * sizeof(hash_node_t);
-    
-    hash->nodes = (hash_node_t *)malloc(size);
-    memset(hash->nodes, 0, size);
+
+    hash->nsegments = (hash->base + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+    hash->segments = (hash_node_t ***)malloc(hash->nsegments * sizeof(hash_node_t **));
+    assert(hash->segments);
+
+    unsigned int i;
+    for (i=0; i<hash->nsegments; i++)
+    {
+        hash->segments[i] = (hash_node_t **)calloc(SEGMENT_SIZE, sizeof(hash_node_t *));
+        assert(hash->segments[i]);
+    }
+    arena_init(&hash->arena);
+#ifdef HASH_BLOOM
+    memset(&hash->bloom, 0, sizeof(hash->bloom));
+    bloom_bits_alloc(hash, &hash->bloom.cur);
+#endif
+#ifdef HASH_STATS
+    hash->splits = 0;
+    hash->split_seconds = 0;
+#endif
     return hash;
 }
 
+void hash_destroy(hash_t *hash)
+{
+    unsigned int i;
+    for (i=0; i<hash->nsegments; i++)
+    {
+        free(hash->segments[i]);
+    }
+    free(hash->segments);
+    arena_destroy(&hash->arena);
+#ifdef HASH_BLOOM
+    bloom_bits_free(&hash->bloom.cur);
+    bloom_bits_free(&hash->bloom.next);
+#endif
+    free(hash);
+}
+
 void* hash_lookup_entry(hash_t *hash, void* key, unsigned int key_size)
 {
-    hash_node_t *node = hash_get_node_by_key(hash, key, key_size);
-    if (node == NULL)
+    unsigned int h = hash->hash_func(~0u, key);
+#ifdef HASH_BLOOM
+    if (!bloom_check(&hash->bloom, h))
+        return NULL;
+#endif
+    hash_node_t **link = hash_find_node(hash, h, key, key_size);
+    if (*link == NULL)
     {
+#ifdef HASH_BLOOM
+        hash->bloom.false_positives++;
+#endif
         return NULL;
     }
 
-    return node->value;
+    return (*link)->value;
 }
 
 void hash_add_entry(hash_t *hash, void *key, unsigned int key_size,
     void *value, unsigned int value_size)
 {
-    if (hash_lookup_entry(hash, key, key_size))
+    hash_node_t **link = hash_get_node_by_key(hash, key, key_size);
+    if (*link)
     {
         fprintf(stderr, "duplicate hash key\n");
         return;
     }
-    
-    unsigned int bucket = hash_get_bucket(hash, key);
-    unsigned int i = bucket;
 
-    hash->nodes[i].status = ACTIVE;
-    if (hash->nodes[i].key)
+    hash_node_t *node;
+    unsigned int inline_size = NODE_INLINE_SIZE(key_size, value_size);
+    if (inline_size <= ARENA_MAX_SMALL)
     {
-        free(hash->nodes[i].key);
+        node = (hash_node_t *)arena_alloc(&hash->arena, inline_size);
+        node->key = node + 1;
+        node->value = (char *)(node + 1) + ((key_size + 7) & ~7u);
     }
-    hash->nodes[i].key = malloc(key_size);
-    memcpy(hash->nodes[i].key, key, key_size);
-    if (hash->nodes[i].value)
+    else
     {
-        free(hash->nodes[i].value);
+        node = (hash_node_t *)arena_alloc(&hash->arena, sizeof(hash_node_t));
+        node->key = arena_alloc(&hash->arena, key_size);
+        node->value = arena_alloc(&hash->arena, value_size);
     }
-    hash->nodes[i].value = malloc(value_size);
-    memcpy(hash->nodes[i].value, value, value_size);
-
-    if (++(hash->size) < hash->buckets /2)
-        return;
-
-
-    //在搜索时可以不考虑表装满的情况；
-    //但在插入时必须确保表的装填因子不超过0.5。
-    //如果超出，必须将表长度扩充一倍，进行表的分裂。
-    unsigned int old_buckets = hash->buckets;
-
-    hash->buckets = next_prime(2*old_buckets);
-
-    hash_node_t *p = hash->nodes;
-    unsigned int size;
-    hash->size = 0;
-    size = sizeof(hash_node_t) * hash->buckets;
-    hash->nodes = (hash_node_t *)malloc(size);
-    memset(hash->nodes, 0, size);
-    
-    for (i=0; i<old_buckets; i++)
+    node->hash = hash->hash_func(~0u, key);
+    node->key_size = key_size;
+    node->value_size = value_size;
+    memcpy(node->key, key, key_size);
+    memcpy(node->value, value, value_size);
+
+    // link 指向链表尾部的 next 挂在最后
+    node->next = NULL;
+    *link = node;
+#ifdef HASH_BLOOM
+    bloom_add(&hash->bloom.cur, node->hash);
+    if (hash->bloom.next.blocks)
     {
-        if (p[i].status == ACTIVE)
-        {
-            hash_add_entry(hash, p[i].key, p[i].key_size, p[i].value, p[i].value_size);
-        }
+        bloom_add(&hash->bloom.next, node->hash);
     }
-    for (i=0; i<old_buckets; i++)
+#endif
+
+    // 超过装填因子 就分裂一个桶 增长的代价平摊到每次插入上
+    if (++(hash->size) > hash->buckets * MAX_LOAD)
     {
-        if (p[i].key)
-        {
-            free(p[i].key);
-        }
-        if (p[i].value)
-        {
-            free(p[i].value);
-        }
+        hash_split_bucket(hash);
     }
-    free(p);
-
+#ifdef HASH_BLOOM
+    bloom_step(hash);
+#endif
 }
 
 void hash_free_entry(hash_t *hash, void *key, unsigned int key_size)
 {
-    hash_node_t *node = hash_get_node_by_key(hash, key, key_size);
+    unsigned int h = hash->hash_func(~0u, key);
+#ifdef HASH_BLOOM
+    if (!bloom_check(&hash->bloom, h))
+        return;
+#endif
+    hash_node_t **link = hash_find_node(hash, h, key, key_size);
+    hash_node_t *node = *link;
     if (node == NULL)
+    {
+#ifdef HASH_BLOOM
+        hash->bloom.false_positives++;
+#endif
         return;
+    }
 
-    // 逻辑删除
-    node->status = DELETED;
+    *link = node->next;
+    unsigned int inline_size = NODE_INLINE_SIZE(node->key_size, node->value_size);
+    if (inline_size <= ARENA_MAX_SMALL)
+    {
+        arena_free(&hash->arena, node, inline_size);
+    }
+    else
+    {
+        arena_free(&hash->arena, node->key, node->key_size);
+        arena_free(&hash->arena, node->value, node->value_size);
+        arena_free(&hash->arena, node, sizeof(hash_node_t));
+    }
+    hash->size--;
+#ifdef HASH_BLOOM
+    if (++(hash->bloom.removed) > hash->buckets * MAX_LOAD && hash->bloom.next.blocks == NULL)
+    {
+        bloom_start(hash);
+    }
+    bloom_step(hash);
+#endif
 }
 
-unsigned int hash_get_bucket(hash_t *hash, void *key)
+// h 是 hash_func 在桶数取最大值时的结果 当作完整的 hash 值
+unsigned int hash_get_bucket(hash_t *hash, unsigned int h)
 {
-    unsigned int bucket = hash->hash_func(hash->buckets, key);
-    if (bucket >= hash->buckets)
+    unsigned int mask = (hash->base << hash->level) - 1;
+    unsigned int bucket = h & mask;
+    if (bucket < hash->split)
     {
-        fprintf(stderr, "bad bucket lookup\n");
-        exit(EXIT_FAILURE);
+        // 这个桶本轮已经分裂过 多用一位
+        bucket = h & (mask << 1 | 1);
     }
 
     return bucket;
 }
 
-hash_node_t* hash_get_node_by_key(hash_t *hash, void *key, unsigned int key_size)
+// 返回指向目标节点的指针的地址 没找到时指向链表末尾的 NULL 插入可以直接挂上去
+hash_node_t** hash_get_node_by_key(hash_t *hash, void *key, unsigned int key_size)
 {
-    unsigned int bucket = hash_get_bucket(hash, key);
-    unsigned int i = 0;
-    unsigned int pos = bucket;
-    int odd = 1;
-    while (hash->nodes[pos].status != EMPTY && memcmp(key, hash->nodes[pos].key, key_size) != 0)
-    {
-        // 如果不明白以下pos计算方法，请参照<<散列表>>课件之<<二次探测再散列>>
-        if (odd)
-        {
-            pos += 2*++i-1;     // pos = pos + 2*++i - 1
-            odd = 1;
-
-            // pos % hash->buckets;
-            while (pos >= hash->buckets)
-            {
-                pos -= hash->buckets;
-            }
-        }
-        else
-        {
-            pos -= 2*i-1;       // pos = pos - (2*i - 1) = pos - 2*i + 1
-            odd = 0;
+    return hash_find_node(hash, hash->hash_func(~0u, key), key, key_size);
+}
 
-            while (pos < 0)
-            {
-                pos += hash->buckets;
-            }
-        }
-    }
+static hash_node_t** hash_find_node(hash_t *hash, unsigned int h, void *key, unsigned int key_size)
+{
+    unsigned int bucket = hash_get_bucket(hash, h);
+    hash_node_t **link = &BUCKET(hash, bucket);
 
-    if (hash->nodes[pos].status == ACTIVE)
+    while (*link && ((*link)->hash != h || (*link)->key_size != key_size
+        || memcmp(key, (*link)->key, key_size) != 0))
     {
-        return &(hash->nodes[pos]);
+        link = &(*link)->next;
     }
-    // 如果运行到这里，说明pos为空位
 
-    // 可以证明，当表的长度hash->buckets为质数且表的装填因子不超过0.5时，
-    // 新的表项 x 一定能够插入，而且任何一个位置不会被探查两次。
-    // 因此，只要表中至少有一半空的，就不会有表满问题。
-
-    return NULL;
+    return link;
 }
 
-unsigned int next_prime(unsigned int n)
+// 把 split 指向的桶一分为二: hash 多看一位 为 1 的节点挪到新桶 (base << level) + split
+static void hash_split_bucket(hash_t *hash)
 {
-    // 偶数不是质数
-    if (n % 2 == 0)
+#ifdef HASH_STATS
+    double start = stats_now();
+#endif
+    unsigned int half = hash->base << hash->level;
+    unsigned int old_bucket = hash->split;
+    unsigned int new_bucket = half + old_bucket;
+
+    if ((new_bucket >> SEGMENT_SHIFT) >= hash->nsegments)
     {
-        n++;
+        // 目录里只有段指针 realloc 的代价很小
+        hash_node_t ***segments = (hash_node_t ***)realloc(hash->segments,
+            (hash->nsegments + 1) * sizeof(hash_node_t **));
+        assert(segments);
+        hash->segments = segments;
+        hash->segments[hash->nsegments] = (hash_node_t **)calloc(SEGMENT_SIZE, sizeof(hash_node_t *));
+        assert(hash->segments[hash->nsegments]);
+        hash->nsegments++;
     }
 
-    for (; !is_prime(n); n+=2); // 不是质数，继续求
-    return n;
+    hash_node_t **link = &BUCKET(hash, old_bucket);
+    hash_node_t **tail = &BUCKET(hash, new_bucket);
+    while (*link)
+    {
+        hash_node_t *node = *link;
+        if (node->hash & half)
+        {
+            *link = node->next;
+            node->next = NULL;
+            *tail = node;
+            tail = &node->next;
+        }
+        else
+        {
+            link = &node->next;
+        }
+    }
+
+    hash->buckets++;
+    if (++(hash->split) == half)
+    {
+        // 本轮所有的桶都分裂完了 桶数翻倍 进入下一轮
+        hash->split = 0;
+        hash->level++;
+#ifdef HASH_BLOOM
+        bloom_start(hash);
+#endif
+    }
+#ifdef HASH_STATS
+    hash->splits++;
+    hash->split_seconds += stats_now() - start;
+#endif
 }
 
-int is_prime(unsigned int n)
+#ifdef HASH_STATS
+// 每次分裂只加一个桶 resizes 是分裂的次数 时间包括新段的分配和 level 加一时新 Bloom filter 的分配
+void hash_get_stats(hash_t *hash, hash_stats_t *stats)
 {
     unsigned int i;
-    for (i=3; i*i<=n; i+=2)
+    memset(stats, 0, sizeof(*stats));
+    for (i=0; i<hash->buckets; i++)
     {
-        if (n % i == 0)
+        unsigned int len = 0;
+        hash_node_t *node;
+        for (node = BUCKET(hash, i); node; node = node->next)
         {
-            // 不是，返回0
-            return 0;
+            len++;
         }
+        stats->hist[len < HASH_STATS_HIST ? len : HASH_STATS_HIST - 1]++;
     }
-
-    // 是，返回1
-    return 1;
-}
\ No newline at end of file
+    stats->size = hash->size;
+    stats->buckets = hash->buckets;
+    stats->load_factor = (double)hash->size / hash->buckets;
+    stats->resizes = hash->splits;
+    stats->resize_seconds = hash->split_seconds;
+    stats->bytes = sizeof(hash_t) + hash->nsegments * (sizeof(hash_node_t **) + SEGMENT_SIZE * sizeof(hash_node_t *))
+        + hash->arena.bytes;
+#ifdef HASH_BLOOM
+    stats->bytes += (unsigned long)(hash->bloom.cur.nblocks + hash->bloom.next.nblocks) * 32;
+#endif
+}
+#endif
@@ -6,6 +6,8 @@ typedef unsigned int (*hashfunc_t)(unsigned int, void*);
 
 hash_t* hash_alloc(unsigned int buckets, hashfunc_t hash_func);
 
+// 定义 HASH_CONCURRENT 时下面几个函数都可以多线程同时调用
+// 返回的 value 指针在这个 key 被 hash_free_entry 之前有效
 void* hash_lookup_entry(hash_t *hash, void* key, unsigned int key_size);
 
 void hash_add_entry(hash_t *hash, void *key, unsigned int key_size,
@@ -13,13 +15,535 @@ void hash_add_entry(hash_t *hash, void *key, unsigned int key_size,
 
 void hash_free_entry(hash_t *hash, void *key, unsigned int key_size);
 
+// 一次性释放整个表 key/value 都在表自己的 arena 里 不用逐个 free
+void hash_destroy(hash_t *hash);
+
+#ifdef HASH_BLOOM
+// 定义 HASH_BLOOM 时线性散列(hash linear hashing.c)的表前面有一个分块 Bloom filter
+// 不在表里的 key 查询和删除时不碰桶 这里是 filter 的内存和误判率
+typedef struct hash_bloom_stats
+{
+    unsigned long bytes;
+    unsigned long long queries;
+    unsigned long long rejected;            // filter 直接拒绝的
+    unsigned long long false_positives;     // filter 放行了但表里没有的
+    double fpr;                             // false_positives / (rejected + false_positives)
+} hash_bloom_stats_t;
+
+void hash_bloom_stats(hash_t *hash, hash_bloom_stats_t *stats);
+#endif
+
+#ifdef HASH_STATS
+// 定义 HASH_STATS 时可以取表的统计 不定义时下面的结构和表里的计数都不编译 没有任何开销
+// 插入/查找的路径上不加计数 直方图等都是 hash_get_stats 时遍历整个表现算的 O(n)
+// 常驻的计数只有扩容次数和耗时 只在扩容的时候更新
+#define HASH_STATS_HIST 16
+
+typedef struct hash_stats
+{
+    // 链地址法(线性散列 HASH_CONCURRENT): hist[i] 是链表长度为 i 的桶数
+    // 开放寻址: hist[i] 是要看 i+1 个位置才找到的 key 数
+    // 最后一格包括所有更长的
+    unsigned long long hist[HASH_STATS_HIST];
+    unsigned int size;
+    unsigned int buckets;
+    double load_factor;                     // size / buckets
+    unsigned long long resizes;             // 扩容次数 线性散列是分裂桶的次数
+    double resize_seconds;                  // 花在扩容上的时间
+    unsigned int tombstones;                // 逻辑删除还占着位置的
+    unsigned long bytes;                    // 桶数组加 arena 向系统要的内存
+} hash_stats_t;
+
+void hash_get_stats(hash_t *hash, hash_stats_t *stats);
+#endif
+
+// 快照 只有开放寻址的版本(没有定义 HASH_CONCURRENT)有
+// hash_save 把表写成一个文件: 文件头 + 节点数组 + key/value 连续存放的 blob 节点里只存 blob 内的偏移 文件可以拷到别的机器上用
+// 先写 path.tmp 再 rename 写一半崩溃不会留下坏文件 成功返回 0 失败返回 -1
+int hash_save(hash_t *hash, const char *path);
+
+// 只读 mmap 打开快照 不读整个文件 打开后马上就能查 hash_func 必须和保存时的一样 失败返回 NULL
+// 第一次 hash_add_entry / hash_free_entry 时提升为可修改的表: 只复制节点数组
+// key/value 还留在映射里(MAP_PRIVATE 写的时候才由内核按页复制) 直到这个位置被新的元素覆盖
+// 提升之前 hash_lookup_entry 返回的 value 指向只读内存 不能写
+hash_t* hash_open(const char *path, hashfunc_t hash_func);
+
 
 #endif /* _HASH_H_ */
 
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stdlib.h>
+#include <assert.h>
+
+// hash_t 自己的内存池
+// 不超过 ARENA_MAX_SMALL 的按 ARENA_ALIGN 分级 从 ARENA_CHUNK 大小的块里顺序切出来
+// 释放的小块挂到对应级别的空闲链表上 下次同样大小的直接复用
+// 更大的单独 malloc 挂在双向链表上 可以单独释放
+// arena_destroy 把所有块一次性释放
+
+#define ARENA_CHUNK (64 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_MAX_SMALL 512
+#define ARENA_CLASSES (ARENA_MAX_SMALL / ARENA_ALIGN)
+
+// 头部占 ARENA_ALIGN 字节 后面的内存仍然是对齐的
+typedef union arena_block
+{
+    struct
+    {
+        union arena_block *prev;
+        union arena_block *next;
+    } link;
+    char align[ARENA_ALIGN];
+} arena_block_t;
+
+typedef struct arena
+{
+    char *ptr;                          // 当前块里还没切的部分
+    char *end;
+    arena_block_t *chunks;              // 所有的块 只用 next
+    arena_block_t large;                // 大块链表的哨兵
+    void *free_list[ARENA_CLASSES];
+#ifdef HASH_STATS
+    unsigned long bytes;                // 向 malloc 要的总字节数 只在拿新块和大块时更新
+#endif
+} arena_t;
+
+static inline void arena_init(arena_t *arena)
+{
+    int i;
+    arena->ptr = arena->end = NULL;
+    arena->chunks = NULL;
+    arena->large.link.prev = arena->large.link.next = &arena->large;
+    for (i=0; i<ARENA_CLASSES; i++)
+    {
+        arena->free_list[i] = NULL;
+    }
+#ifdef HASH_STATS
+    arena->bytes = 0;
+#endif
+}
+
+static inline void* arena_alloc(arena_t *arena, unsigned int size)
+{
+    if (size > ARENA_MAX_SMALL)
+    {
+        arena_block_t *block = (arena_block_t *)malloc(sizeof(arena_block_t) + size);
+        assert(block);
+        block->link.prev = &arena->large;
+        block->link.next = arena->large.link.next;
+        arena->large.link.next->link.prev = block;
+        arena->large.link.next = block;
+#ifdef HASH_STATS
+        arena->bytes += sizeof(arena_block_t) + size;
+#endif
+        return block + 1;
+    }
+
+    unsigned int index = size ? (size - 1) / ARENA_ALIGN : 0;
+    void *p = arena->free_list[index];
+    if (p)
+    {
+        arena->free_list[index] = *(void **)p;
+        return p;
+    }
+
+    size = (index + 1) * ARENA_ALIGN;
+    if (arena->ptr == NULL || (unsigned int)(arena->end - arena->ptr) < size)
+    {
+        // 旧块剩下的零头不要了 最多浪费 ARENA_MAX_SMALL 字节
+        arena_block_t *chunk = (arena_block_t *)malloc(ARENA_CHUNK);
+        assert(chunk);
+        chunk->link.next = arena->chunks;
+        arena->chunks = chunk;
+        arena->ptr = (char *)(chunk + 1);
+        arena->end = (char *)chunk + ARENA_CHUNK;
+#ifdef HASH_STATS
+        arena->bytes += ARENA_CHUNK;
+#endif
+    }
+    p = arena->ptr;
+    arena->ptr += size;
+    return p;
+}
+
+// size 必须和 arena_alloc 时一样
+static inline void arena_free(arena_t *arena, void *p, unsigned int size)
+{
+    if (size > ARENA_MAX_SMALL)
+    {
+        arena_block_t *block = (arena_block_t *)p - 1;
+        block->link.prev->link.next = block->link.next;
+        block->link.next->link.prev = block->link.prev;
+        free(block);
+#ifdef HASH_STATS
+        arena->bytes -= sizeof(arena_block_t) + size;
+#endif
+        return;
+    }
+
+    unsigned int index = size ? (size - 1) / ARENA_ALIGN : 0;
+    *(void **)p = arena->free_list[index];
+    arena->free_list[index] = p;
+}
+
+static inline void arena_destroy(arena_t *arena)
+{
+    while (arena->chunks)
+    {
+        arena_block_t *chunk = arena->chunks;
+        arena->chunks = chunk->link.next;
+        free(chunk);
+    }
+    while (arena->large.link.next != &arena->large)
+    {
+        arena_block_t *block = arena->large.link.next;
+        arena->large.link.next = block->link.next;
+        free(block);
+    }
+    arena_init(arena);
+}
+
+#endif /* _ARENA_H_ */
+
 #include "hash.h"
+#include "arena.h"
 #include "common.h"
 #include <assert.h>
 
+#ifdef HASH_CONCURRENT
+
+#include <pthread.h>
+
+/*
+ * 线程安全的版本: 链地址法 桶按 hash 的低位分到 HASH_STRIPES 个 stripe 上 每个 stripe 一把锁
+ * 桶数总是 HASH_STRIPES 的倍数且是 2 的幂 bucket & (HASH_STRIPES-1) 就是 stripe 下标 扩容前后不变
+ * 所以同一个 key 不管在旧表还是新表 都由同一把锁保护
+ *
+ * 每个 stripe 记着自己当前用的表 扩容时先分配两倍大的桶数组
+ * 然后一次只锁一个 stripe 把它的桶拆分到新数组里 再把这个 stripe 的表换成新的
+ * 别的 stripe 照常读写 所有 stripe 都换完以后旧的桶数组就没人用了
+ *
+ * 节点从所属 stripe 的 arena 里分配 扩容拆桶时节点还在同一个 stripe 里 只改链表指针
+ */
+#define HASH_STRIPES 64
+#define MAX_LOAD 2
+
+typedef struct hash_node
+{
+    struct hash_node *next;
+    unsigned int hash;
+    unsigned int key_size;
+    unsigned int value_size;
+    void *key;
+    void *value;
+} hash_node_t;
+
+// key 按 8 字节对齐 value 接在后面
+#define NODE_INLINE_SIZE(key_size, value_size) \
+    (sizeof(hash_node_t) + (((key_size) + 7) & ~7u) + (value_size))
+
+typedef struct table
+{
+    unsigned int buckets;
+    hash_node_t **heads;
+} table_t;
+
+// 每个 stripe 单独占 cache line 避免不同 stripe 的锁互相伪共享
+typedef struct stripe
+{
+    pthread_mutex_t lock;
+    table_t *table;
+    unsigned int size;
+    arena_t arena;
+} __attribute__((aligned(64))) stripe_t;
+
+struct hash
+{
+    stripe_t stripes[HASH_STRIPES];
+    hashfunc_t hash_func;
+    table_t *table;                 // 最新的表 只有扩容的线程会改
+    int resizing;                   // 同一时间只有一个线程扩容
+#ifdef HASH_STATS
+    unsigned long long resizes;     // 只有扩容的线程写 读的时候用原子操作
+    unsigned long long resize_ns;
+#endif
+};
+
+#ifdef HASH_STATS
+#include <time.h>
+
+static unsigned long long stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+static table_t* table_alloc(unsigned int buckets)
+{
+    table_t *table = (table_t *)malloc(sizeof(table_t));
+    assert(table);
+    table->buckets = buckets;
+    table->heads = (hash_node_t **)calloc(buckets, sizeof(hash_node_t *));
+    assert(table->heads);
+    return table;
+}
+
+hash_t* hash_alloc(unsigned int buckets, hashfunc_t hash_func)
+{
+    // stripe 要求 64 字节对齐 malloc 只保证 16 字节
+    hash_t *hash = NULL;
+    if (posix_memalign((void **)&hash, 64, sizeof(hash_t)) != 0)
+    {
+        hash = NULL;
+    }
+    assert(hash);
+
+    unsigned int n = HASH_STRIPES;
+    while (n < buckets)
+    {
+        n <<= 1;
+    }
+    hash->hash_func = hash_func;
+    hash->table = table_alloc(n);
+    hash->resizing = 0;
+#ifdef HASH_STATS
+    hash->resizes = 0;
+    hash->resize_ns = 0;
+#endif
+
+    int i;
+    for (i=0; i<HASH_STRIPES; i++)
+    {
+        pthread_mutex_init(&hash->stripes[i].lock, NULL);
+        hash->stripes[i].table = hash->table;
+        hash->stripes[i].size = 0;
+        arena_init(&hash->stripes[i].arena);
+    }
+    return hash;
+}
+
+void hash_destroy(hash_t *hash)
+{
+    int i;
+    for (i=0; i<HASH_STRIPES; i++)
+    {
+        pthread_mutex_destroy(&hash->stripes[i].lock);
+        arena_destroy(&hash->stripes[i].arena);
+    }
+    free(hash->table->heads);
+    free(hash->table);
+    free(hash);
+}
+
+// 调用者持有 stripe 的锁 返回指向目标节点的指针的地址 没找到时指向链表末尾的 NULL
+static hash_node_t** stripe_find(stripe_t *stripe, unsigned int h, void *key, unsigned int key_size)
+{
+    table_t *table = stripe->table;
+    hash_node_t **link = &table->heads[h & (table->buckets - 1)];
+
+    while (*link && ((*link)->hash != h || (*link)->key_size != key_size
+        || memcmp(key, (*link)->key, key_size) != 0))
+    {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+void* hash_lookup_entry(hash_t *hash, void* key, unsigned int key_size)
+{
+    unsigned int h = hash->hash_func(~0u, key);
+    stripe_t *stripe = &hash->stripes[h & (HASH_STRIPES - 1)];
+
+    pthread_mutex_lock(&stripe->lock);
+    hash_node_t *node = *stripe_find(stripe, h, key, key_size);
+    pthread_mutex_unlock(&stripe->lock);
+
+    return node ? node->value : NULL;
+}
+
+// 一次锁一个 stripe 把它的桶从旧表拆到新表 每个旧桶 i 拆成新表的 i 和 i + old->buckets
+static void hash_resize(hash_t *hash)
+{
+    if (__atomic_exchange_n(&hash->resizing, 1, __ATOMIC_ACQUIRE))
+    {
+        return;                     // 别的线程在扩容
+    }
+
+#ifdef HASH_STATS
+    unsigned long long start = stats_now_ns();
+#endif
+    table_t *old = hash->table;
+    table_t *table = table_alloc(old->buckets * 2);
+    unsigned int s, i;
+
+    for (s=0; s<HASH_STRIPES; s++)
+    {
+        stripe_t *stripe = &hash->stripes[s];
+        pthread_mutex_lock(&stripe->lock);
+        for (i=s; i<old->buckets; i+=HASH_STRIPES)
+        {
+            hash_node_t *node = old->heads[i];
+            hash_node_t **lo = &table->heads[i];
+            hash_node_t **hi = &table->heads[i + old->buckets];
+            while (node)
+            {
+                hash_node_t *next = node->next;
+                if (node->hash & old->buckets)
+                {
+                    *hi = node;
+                    hi = &node->next;
+                }
+                else
+                {
+                    *lo = node;
+                    lo = &node->next;
+                }
+                node = next;
+            }
+            *lo = NULL;
+            *hi = NULL;
+        }
+        stripe->table = table;
+        pthread_mutex_unlock(&stripe->lock);
+    }
+
+    // 所有 stripe 都换到了新表 旧的桶数组不会再被访问
+    hash->table = table;
+    free(old->heads);
+    free(old);
+#ifdef HASH_STATS
+    __atomic_store_n(&hash->resize_ns, hash->resize_ns + stats_now_ns() - start, __ATOMIC_RELAXED);
+    __atomic_store_n(&hash->resizes, hash->resizes + 1, __ATOMIC_RELAXED);
+#endif
+    __atomic_store_n(&hash->resizing, 0, __ATOMIC_RELEASE);
+}
+
+void hash_add_entry(hash_t *hash, void *key, unsigned int key_size,
+    void *value, unsigned int value_size)
+{
+    unsigned int h = hash->hash_func(~0u, key);
+    stripe_t *stripe = &hash->stripes[h & (HASH_STRIPES - 1)];
+
+    pthread_mutex_lock(&stripe->lock);
+    hash_node_t **link = stripe_find(stripe, h, key, key_size);
+    if (*link)
+    {
+        pthread_mutex_unlock(&stripe->lock);
+        fprintf(stderr, "duplicate hash key\n");
+        return;
+    }
+
+    hash_node_t *node;
+    unsigned int inline_size = NODE_INLINE_SIZE(key_size, value_size);
+    if (inline_size <= ARENA_MAX_SMALL)
+    {
+        node = (hash_node_t *)arena_alloc(&stripe->arena, inline_size);
+        node->key = node + 1;
+        node->value = (char *)(node + 1) + ((key_size + 7) & ~7u);
+    }
+    else
+    {
+        node = (hash_node_t *)arena_alloc(&stripe->arena, sizeof(hash_node_t));
+        node->key = arena_alloc(&stripe->arena, key_size);
+        node->value = arena_alloc(&stripe->arena, value_size);
+    }
+    node->hash = h;
+    node->key_size = key_size;
+    node->value_size = value_size;
+    memcpy(node->key, key, key_size);
+    memcpy(node->value, value, value_size);
+    node->next = NULL;
+    *link = node;
+
+    // 每个 stripe 分到 buckets / HASH_STRIPES 个桶 只看自己的装填因子 不用全局计数
+    int grow = ++(stripe->size) > stripe->table->buckets / HASH_STRIPES * MAX_LOAD;
+    pthread_mutex_unlock(&stripe->lock);
+
+    if (grow)
+    {
+        hash_resize(hash);
+    }
+}
+
+void hash_free_entry(hash_t *hash, void *key, unsigned int key_size)
+{
+    unsigned int h = hash->hash_func(~0u, key);
+    stripe_t *stripe = &hash->stripes[h & (HASH_STRIPES - 1)];
+
+    pthread_mutex_lock(&stripe->lock);
+    hash_node_t **link = stripe_find(stripe, h, key, key_size);
+    hash_node_t *node = *link;
+    if (node)
+    {
+        *link = node->next;
+        unsigned int inline_size = NODE_INLINE_SIZE(node->key_size, node->value_size);
+        if (inline_size <= ARENA_MAX_SMALL)
+        {
+            arena_free(&stripe->arena, node, inline_size);
+        }
+        else
+        {
+            arena_free(&stripe->arena, node->key, node->key_size);
+            arena_free(&stripe->arena, node->value, node->value_size);
+            arena_free(&stripe->arena, node, sizeof(hash_node_t));
+        }
+        stripe->size--;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+#ifdef HASH_STATS
+// 一次锁一个 stripe 统计它的桶 得到的不是某一时刻的快照 但每个 stripe 内部是一致的
+void hash_get_stats(hash_t *hash, hash_stats_t *stats)
+{
+    unsigned int s, i;
+    memset(stats, 0, sizeof(*stats));
+    for (s=0; s<HASH_STRIPES; s++)
+    {
+        stripe_t *stripe = &hash->stripes[s];
+        pthread_mutex_lock(&stripe->lock);
+        table_t *table = stripe->table;
+        for (i=s; i<table->buckets; i+=HASH_STRIPES)
+        {
+            unsigned int len = 0;
+            hash_node_t *node;
+            for (node = table->heads[i]; node; node = node->next)
+            {
+                len++;
+            }
+            stats->hist[len < HASH_STATS_HIST ? len : HASH_STATS_HIST - 1]++;
+        }
+        if (s == 0)
+        {
+            stats->buckets = table->buckets;
+            stats->bytes += sizeof(hash_t) + sizeof(table_t) + table->buckets * sizeof(hash_node_t *);
+        }
+        stats->size += stripe->size;
+        stats->bytes += stripe->arena.bytes;
+        pthread_mutex_unlock(&stripe->lock);
+    }
+    stats->load_factor = (double)stats->size / stats->buckets;
+    stats->resizes = __atomic_load_n(&hash->resizes, __ATOMIC_RELAXED);
+    stats->resize_seconds = __atomic_load_n(&hash->resize_ns, __ATOMIC_RELAXED) / 1e9;
+}
+#endif
+
+#else
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// 小的 key/value 直接放在节点的 data 里 放不下的从表的 arena 里分配
+// 节点数组不会移动 所以 key/value 指针一直有效
+#define HASH_INLINE_SIZE 48
 
 typedef enum entry_status
 {
@@ -31,19 +555,57 @@ typedef enum entry_status
 typedef struct hash_node
 {
     enum entry_status status;
+    unsigned int key_size;
+    unsigned int value_size;
     void *key;
     void *value;
+    char data[HASH_INLINE_SIZE];
 } hash_node_t;
 
+// 快照文件的格式 所有整数都是本机字节序 偏移都相对于 blob 的开头
+#define SNAP_MAGIC 0x50414e5348534148ull        // "HASHSNAP"
+#define SNAP_VERSION 1
+
+typedef struct snap_header
+{
+    unsigned long long magic;
+    unsigned int version;
+    unsigned int node_size;                     // sizeof(snap_node_t) 防止用不同的编译选项读
+    unsigned int buckets;
+    unsigned int size;
+    unsigned long long nodes_offset;            // 相对于文件开头
+    unsigned long long blob_offset;
+    unsigned long long blob_size;
+} snap_header_t;
+
+// 32 字节 一条 cache line 两个 比内存里的节点小 只读的时候探测更快
+typedef struct snap_node
+{
+    unsigned int status;
+    unsigned int key_size;
+    unsigned int value_size;
+    unsigned int pad;
+    unsigned long long key;
+    unsigned long long value;
+} snap_node_t;
+
 struct hash
 {
     unsigned int buckets;
     hashfunc_t hash_func;
-    hash_node_t *nodes;
+    hash_node_t *nodes;         // hash_open 之后还没提升时为 NULL 查找走 snap_nodes
+    arena_t arena;
+    // hash_open 的映射 没有时 map 为 NULL
+    void *map;
+    size_t map_size;
+    const snap_node_t *snap_nodes;
+    char *blob;
+    size_t blob_size;
 };
 
 unsigned int hash_get_bucket(hash_t *hash, void *key);
 hash_node_t* hash_get_node_by_key(hash_t *hash, void *key, unsigned int key_size);
+static void hash_promote(hash_t *hash);
 
 hash_t* hash_alloc(unsigned int buckets, hashfunc_t hash_func)
 {
@@ -51,14 +613,88 @@ hash_t* hash_alloc(unsigned int buckets, hashfunc_t hash_func)
     
     hash->buckets = buckets;
     hash->hash_func = hash_func;
-    int size = buckets * sizeof(hash_node_t);
+    size_t size = (size_t)buckets * sizeof(hash_node_t);
     hash->nodes = (hash_node_t *)malloc(size);
     memset(hash->nodes, 0, size);
+    arena_init(&hash->arena);
+    hash->map = NULL;
+    hash->map_size = 0;
+    hash->snap_nodes = NULL;
+    hash->blob = NULL;
+    hash->blob_size = 0;
     return hash;
 }
 
+void hash_destroy(hash_t *hash)
+{
+    arena_destroy(&hash->arena);
+    free(hash->nodes);
+    if (hash->map)
+    {
+        munmap(hash->map, hash->map_size);
+    }
+    free(hash);
+}
+
+// 指针是不是 arena 分配的: 不在节点的 data 里 也不在快照的 blob 里
+static int hash_owned(hash_t *hash, hash_node_t *node, void *p)
+{
+    char *c = (char *)p;
+    if (c >= node->data && c < node->data + HASH_INLINE_SIZE)
+        return 0;
+    if (hash->blob && c >= hash->blob && c < hash->blob + hash->blob_size)
+        return 0;
+    return 1;
+}
+
+// 节点里的 key/value 如果是 arena 分配的 还给 arena
+// 长度为 0 的从来不去 arena 分配 快照里它的指针可能正好在 blob 末尾 不能按指针范围判断
+static void hash_release_node(hash_t *hash, hash_node_t *node)
+{
+    if (node->key_size && hash_owned(hash, node, node->key))
+    {
+        arena_free(&hash->arena, node->key, node->key_size);
+    }
+    if (node->value_size && hash_owned(hash, node, node->value))
+    {
+        arena_free(&hash->arena, node->value, node->value_size);
+    }
+}
+
+// 节点的 key/value 是不是完整地落在 blob 里 文件损坏时可能不是 这样的节点当作墓碑
+// 打开时不逐个检查 那样要读一遍整个节点数组 用到节点的地方各自检查
+static int snap_node_valid(hash_t *hash, const snap_node_t *sn)
+{
+    return sn->key <= hash->blob_size && sn->key_size <= hash->blob_size - sn->key
+        && sn->value <= hash->blob_size && sn->value_size <= hash->blob_size - sn->value;
+}
+
+// 还没提升的快照 直接在映射上线性探测
+static void* snap_lookup(hash_t *hash, void *key, unsigned int key_size)
+{
+    unsigned int bucket = hash_get_bucket(hash, key);
+    unsigned int i = bucket;
+    while (hash->snap_nodes[i].status != EMPTY)
+    {
+        const snap_node_t *sn = &hash->snap_nodes[i];
+        if (sn->status == ACTIVE && sn->key_size == key_size && snap_node_valid(hash, sn)
+            && memcmp(key, hash->blob + sn->key, key_size) == 0)
+        {
+            return hash->blob + sn->value;
+        }
+        i = (i + 1) % hash->buckets;
+        if (i == bucket)
+            break;
+    }
+    return NULL;
+}
+
 void* hash_lookup_entry(hash_t *hash, void* key, unsigned int key_size)
 {
+    if (hash->nodes == NULL)
+    {
+        return snap_lookup(hash, key, key_size);
+    }
     hash_node_t *node = hash_get_node_by_key(hash, key, key_size);
     if (node == NULL)
     {
@@ -70,6 +706,10 @@ void* hash_lookup_entry(hash_t *hash, void* key, unsigned int key_size)
 
 void hash_add_entry(hash_t *hash, void *key, unsigned int key_size, void *value, unsigned int value_size)
 {
+    if (hash->nodes == NULL)
+    {
+        hash_promote(hash);
+    }
     if (hash_lookup_entry(hash, key, key_size))
     {
         fprintf(stderr, "duplicate hash key\n");
@@ -87,24 +727,50 @@ void hash_add_entry(hash_t *hash, void *key, unsigned int key_size, void *value,
         }
     }
 
-    hash->nodes[i].status = ACTIVE;
-    if (hash->nodes[i].key)
+    hash_node_t *node = &hash->nodes[i];
+    if (node->status == DELETED)
+    {
+        hash_release_node(hash, node);
+    }
+    node->status = ACTIVE;
+
+    // key 放在 data 开头 value 按 8 字节对齐接在后面 哪个放不下哪个去 arena
+    unsigned int used = 0;
+    if (key_size <= HASH_INLINE_SIZE)
     {
-        free(hash->nodes[i].key);
+        node->key = node->data;
+        used = (key_size + 7) & ~7u;
     }
-    hash->nodes[i].key = malloc(key_size);
-    memcpy(hash->nodes[i].key, key, key_size);
-    if (hash->nodes[i].value)
+    else
     {
-        free(hash->nodes[i].value);
+        node->key = arena_alloc(&hash->arena, key_size);
     }
-    hash->nodes[i].value = malloc(value_size);
-    memcpy(hash->nodes[i].value, value, value_size);
+    if (value_size == 0)
+    {
+        // key 占满 data 时 data + used 已经在 data 外面了 会被 hash_owned 当成 arena 的内存
+        node->value = node->data;
+    }
+    else if (used + value_size <= HASH_INLINE_SIZE)
+    {
+        node->value = node->data + used;
+    }
+    else
+    {
+        node->value = arena_alloc(&hash->arena, value_size);
+    }
+    node->key_size = key_size;
+    node->value_size = value_size;
+    memcpy(node->key, key, key_size);
+    memcpy(node->value, value, value_size);
 
 }
 
 void hash_free_entry(hash_t *hash, void *key, unsigned int key_size)
 {
+    if (hash->nodes == NULL)
+    {
+        hash_promote(hash);
+    }
     hash_node_t *node = hash_get_node_by_key(hash, key, key_size);
     if (node == NULL)
         return;
@@ -129,7 +795,8 @@ hash_node_t* hash_get_node_by_key(hash_t *hash, void *key, unsigned int key_size
 {
     unsigned int bucket = hash_get_bucket(hash, key);
     unsigned int i = bucket;
-    while (hash->nodes[i].status != EMPTY && memcmp(key, hash->nodes[i].key, key_size) != 0)
+    while (hash->nodes[i].status != EMPTY && (hash->nodes[i].key_size != key_size
+        || memcmp(key, hash->nodes[i].key, key_size) != 0))
     {
         i = (i + 1) % hash->buckets;
         if (i == bucket)        // 探测了一圈
@@ -148,6 +815,218 @@ hash_node_t* hash_get_node_by_key(hash_t *hash, void *key, unsigned int key_size
     return NULL;
 }
 
+// 快照的 blob 里每个 key/value 都按 8 字节对齐
+#define SNAP_ALIGN(n) (((unsigned long long)(n) + 7) & ~7ull)
+
+static int snap_write_padded(FILE *fp, const void *p, unsigned int size)
+{
+    static const char zero[8];
+    unsigned int pad = (unsigned int)(SNAP_ALIGN(size) - size);
+    return fwrite(p, 1, size, fp) == size && fwrite(zero, 1, pad, fp) == pad ? 0 : -1;
+}
+
+// 节点数组保持原来的位置(包括 DELETED) 打开之后探测序列和保存前完全一样 不用重新插入
+int hash_save(hash_t *hash, const char *path)
+{
+    if (hash->nodes == NULL)
+    {
+        hash_promote(hash);
+    }
+
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return -1;
+    FILE *fp = fopen(tmp, "wb");
+    if (fp == NULL)
+        return -1;
+
+    snap_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SNAP_MAGIC;
+    header.version = SNAP_VERSION;
+    header.node_size = sizeof(snap_node_t);
+    header.buckets = hash->buckets;
+    header.nodes_offset = SNAP_ALIGN(sizeof(snap_header_t));
+    header.blob_offset = SNAP_ALIGN(header.nodes_offset + (unsigned long long)hash->buckets * sizeof(snap_node_t));
+
+    // 第一遍写节点 顺便算出每个 key/value 在 blob 里的偏移 第二遍按同样的顺序写 blob
+    int err = fseeko(fp, (off_t)header.nodes_offset, SEEK_SET);
+    unsigned long long off = 0;
+    unsigned int i;
+    for (i=0; i<hash->buckets && !err; i++)
+    {
+        hash_node_t *node = &hash->nodes[i];
+        snap_node_t sn;
+        memset(&sn, 0, sizeof(sn));
+        sn.status = node->status;
+        if (node->status == ACTIVE)
+        {
+            sn.key_size = node->key_size;
+            sn.value_size = node->value_size;
+            sn.key = off;
+            off += SNAP_ALIGN(node->key_size);
+            sn.value = off;
+            off += SNAP_ALIGN(node->value_size);
+            header.size++;
+        }
+        err = fwrite(&sn, sizeof(sn), 1, fp) != 1;
+    }
+    header.blob_size = off;
+
+    if (!err)
+        err = fseeko(fp, (off_t)header.blob_offset, SEEK_SET);
+    for (i=0; i<hash->buckets && !err; i++)
+    {
+        hash_node_t *node = &hash->nodes[i];
+        if (node->status == ACTIVE)
+        {
+            err = snap_write_padded(fp, node->key, node->key_size)
+                || snap_write_padded(fp, node->value, node->value_size);
+        }
+    }
+
+    // 头最后写 中途失败的文件 magic 不对 打不开
+    if (!err)
+        err = fseeko(fp, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, fp) != 1;
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+        err = 1;
+    if (fclose(fp) != 0)
+        err = 1;
+    if (err || rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+hash_t* hash_open(const char *path, hashfunc_t hash_func)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(snap_header_t))
+    {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);                          // 映射不依赖 fd
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const snap_header_t *header = (const snap_header_t *)map;
+    unsigned long long file_size = (unsigned long long)st.st_size;
+    // 偏移都要 8 字节对齐 每一项都和文件大小比 不会溢出
+    if (header->magic != SNAP_MAGIC || header->version != SNAP_VERSION
+        || header->node_size != sizeof(snap_node_t) || header->buckets == 0
+        || header->nodes_offset % 8 != 0 || header->blob_offset % 8 != 0
+        || header->blob_offset > file_size || header->nodes_offset > header->blob_offset
+        || (unsigned long long)header->buckets * sizeof(snap_node_t) > header->blob_offset - header->nodes_offset
+        || header->blob_size > file_size - header->blob_offset)
+    {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    hash_t *hash = (hash_t *)malloc(sizeof(hash_t));
+    assert(hash);
+    hash->buckets = header->buckets;
+    hash->hash_func = hash_func;
+    hash->nodes = NULL;
+    arena_init(&hash->arena);
+    hash->map = map;
+    hash->map_size = st.st_size;
+    hash->snap_nodes = (const snap_node_t *)((char *)map + header->nodes_offset);
+    hash->blob = (char *)map + header->blob_offset;
+    hash->blob_size = header->blob_size;
+    // 查找会按 hash 随机访问节点数组 预读没有用
+    madvise(map, st.st_size, MADV_RANDOM);
+    return hash;
+}
+
+// 复制节点数组 key/value 指向 blob 映射改成可写 MAP_PRIVATE 下写入只影响这个进程 内核按页复制
+static void hash_promote(hash_t *hash)
+{
+    size_t size = (size_t)hash->buckets * sizeof(hash_node_t);
+    hash_node_t *nodes = (hash_node_t *)malloc(size);
+    assert(nodes);
+    memset(nodes, 0, size);
+
+    unsigned int i;
+    for (i=0; i<hash->buckets; i++)
+    {
+        const snap_node_t *sn = &hash->snap_nodes[i];
+        nodes[i].status = (entry_status_t)sn->status;
+        if (sn->status == ACTIVE && snap_node_valid(hash, sn))
+        {
+            nodes[i].key_size = sn->key_size;
+            nodes[i].value_size = sn->value_size;
+            nodes[i].key = hash->blob + sn->key;
+            nodes[i].value = hash->blob + sn->value;
+        }
+        else if (sn->status != EMPTY)
+        {
+            // 墓碑被复用时 hash_release_node 看到的是 data 里的指针 什么都不释放
+            nodes[i].status = DELETED;
+            nodes[i].key = nodes[i].value = nodes[i].data;
+        }
+    }
+    int ret = mprotect(hash->map, hash->map_size, PROT_READ | PROT_WRITE);
+    assert(ret == 0);
+    (void)ret;
+    hash->nodes = nodes;
+}
+
+#ifdef HASH_STATS
+// 表的大小固定 不会扩容 resizes 总是 0
+// 快照还没提升时直接读映射里的节点 不为了统计复制节点数组
+void hash_get_stats(hash_t *hash, hash_stats_t *stats)
+{
+    unsigned int i;
+    memset(stats, 0, sizeof(*stats));
+    for (i=0; i<hash->buckets; i++)
+    {
+        unsigned int status;
+        void *key = NULL;
+        if (hash->nodes)
+        {
+            status = hash->nodes[i].status;
+            key = hash->nodes[i].key;
+        }
+        else
+        {
+            const snap_node_t *sn = &hash->snap_nodes[i];
+            status = sn->status;
+            if (status == ACTIVE && snap_node_valid(hash, sn))
+                key = hash->blob + sn->key;
+            else if (status != EMPTY)
+                status = DELETED;
+        }
+        if (status == DELETED)
+        {
+            stats->tombstones++;
+        }
+        else if (status == ACTIVE)
+        {
+            unsigned int bucket = hash_get_bucket(hash, key);
+            unsigned int probes = (i + hash->buckets - bucket) % hash->buckets + 1;
+            stats->hist[probes <= HASH_STATS_HIST ? probes - 1 : HASH_STATS_HIST - 1]++;
+            stats->size++;
+        }
+    }
+    stats->buckets = hash->buckets;
+    stats->load_factor = (double)stats->size / hash->buckets;
+    stats->bytes = sizeof(hash_t) + hash->arena.bytes + hash->map_size;
+    if (hash->nodes)
+        stats->bytes += (size_t)hash->buckets * sizeof(hash_node_t);
+}
+#endif
+
+#endif /* HASH_CONCURRENT */
+
 #include "hash.h"
 #include "common.h"
 
@@ -185,6 +1064,32 @@ unsigned int hash_int(unsigned int buckets, void *key)
     return (*sno) % buckets;
 }
 
+// 按第一个字节选桶 让下面的 key 落在相邻的节点上
+unsigned int hash_first(unsigned int buckets, void *key)
+{
+    return *(unsigned char *)key % buckets;
+}
+
+// key 占满节点的 data(41..48 字节)时 value 为空 删除再插回来 不能影响相邻节点
+static void demo_empty_value(void)
+{
+    char k1[44], k2[8] = "b234567", k3[48];
+    int v = 42;
+    memset(k1, 'a', sizeof(k1));
+    memset(k3, 'c', sizeof(k3));
+
+    hash_t *hash = hash_alloc(256, hash_first);
+    hash_add_entry(hash, k1, sizeof(k1), &v, 0);
+    hash_add_entry(hash, k2, sizeof(k2), &v, sizeof(v));
+    hash_free_entry(hash, k1, sizeof(k1));
+    hash_add_entry(hash, k1, sizeof(k1), &v, 0);
+    hash_add_entry(hash, k3, sizeof(k3), &v, sizeof(v));
+
+    int *p = (int *)hash_lookup_entry(hash, k2, sizeof(k2));
+    printf("empty value: %s\n", p && *p == 42 && hash_lookup_entry(hash, k1, sizeof(k1)) ? "ok" : "neighbour corrupted");
+    hash_destroy(hash);
+}
+
 int main(void)
 {
     stu2_t stu_arr[] =
@@ -227,5 +1132,324 @@ int main(void)
         printf("not found\n");
     }
 
+    hash_destroy(hash);
+    demo_empty_value();
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * bench.c 1..N 个线程的扩展性
+ * 每个线程 90% 查找(所有线程共享的 key) 5% 插入 5% 删除(自己的 key)
+ *   gcc -O2 -pthread -DHASH_CONCURRENT hash.c bench.c -o bench_striped && ./bench_striped 8
+ *   gcc -O2 -pthread hash.c bench.c -o bench_global && ./bench_global 8      (单线程版本外面包一把全局锁)
+ */
+#include "hash.h"
+#include "common.h"
+#include <pthread.h>
+#include <time.h>
+
+#define SHARED_KEYS 100000
+#define OPS_PER_THREAD 2000000
+#define MAX_THREADS 64
+
+#ifdef HASH_CONCURRENT
+#define BENCH_BUCKETS 16            // 从很小开始 测试中途扩容
+#define LOCKED(expr) (expr)
+#else
+#define BENCH_BUCKETS (1 << 18)     // 开放地址的版本不会扩容
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCKED(expr) do { pthread_mutex_lock(&global_lock); (expr); pthread_mutex_unlock(&global_lock); } while (0)
+#endif
+
+static hash_t *bench_hash;
+
+unsigned int hash_bench(unsigned int buckets, void *key)
+{
+    unsigned int k = *(unsigned int *)key * 2654435761u;
+    return k % buckets;
+}
+
+// 线程 id 放在高位 每个线程的 key 互不相同 也不会和共享的 key 冲突
+void* bench_thread(void *arg)
+{
+    unsigned int id = (unsigned int)(size_t)arg;
+    unsigned int r = id * 7919 + 1;
+    unsigned int next = 0, oldest = 0;
+    int i;
+    for (i=0; i<OPS_PER_THREAD; i++)
+    {
+        r = r * 1103515245 + 12345;
+        unsigned int op = (r >> 16) % 100;
+        if (op < 90)
+        {
+            unsigned int key = (r >> 8) % SHARED_KEYS;
+            void *value;
+            LOCKED(value = hash_lookup_entry(bench_hash, &key, sizeof(key)));
+            if (value == NULL)
+            {
+                fprintf(stderr, "lost shared key %u\n", key);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (op < 95 || oldest == next)
+        {
+            unsigned int key = (id + 1) << 24 | next++;
+            LOCKED(hash_add_entry(bench_hash, &key, sizeof(key), &i, sizeof(i)));
+        }
+        else
+        {
+            unsigned int key = (id + 1) << 24 | oldest++;
+            LOCKED(hash_free_entry(bench_hash, &key, sizeof(key)));
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    pthread_t pid[MAX_THREADS];
+    int n, i;
+
+    if (max_threads > MAX_THREADS)
+        max_threads = MAX_THREADS;
+
+    for (n=1; n<=max_threads; n*=2)
+    {
+        struct timespec t0, t1;
+        unsigned int key;
+
+        bench_hash = hash_alloc(BENCH_BUCKETS, hash_bench);
+        for (key=0; key<SHARED_KEYS; key++)
+        {
+            hash_add_entry(bench_hash, &key, sizeof(key), &key, sizeof(key));
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i=0; i<n; i++)
+        {
+            pthread_create(&pid[i], NULL, bench_thread, (void *)(size_t)i);
+        }
+        for (i=0; i<n; i++)
+        {
+            pthread_join(pid[i], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        double sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("%2d threads %8.2f Mops/s\n", n, (double)n * OPS_PER_THREAD / sec / 1e6);
+#ifdef HASH_STATS
+        hash_stats_t st;
+        hash_get_stats(bench_hash, &st);
+        printf("           load %.2f, %llu resizes %.2f ms, %u tombstones, %lu bytes\n",
+            st.load_factor, st.resizes, st.resize_seconds * 1e3, st.tombstones, st.bytes);
+#endif
+        hash_destroy(bench_hash);
+    }
+    return 0;
+}
+
+/*
+ * snapshot.c 从头一个个插入 和 hash_save / hash_open 之后直接查 的启动时间对比
+ *   gcc -O2 hash.c snapshot.c -o snapshot && ./snapshot [n] [path]
+ */
+#include "hash.h"
+#include "common.h"
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct snap_value
+{
+    unsigned int id;
+    char payload[28];
+} snap_value_t;
+
+unsigned int hash_snap(unsigned int buckets, void *key)
+{
+    unsigned long long k = *(unsigned long long *)key * 0x9e3779b97f4a7c15ull;
+    return (unsigned int)(k >> 32) % buckets;
+}
+
+static double snap_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 文件格式见 hash.c: 48 字节的文件头 后面是 32 字节的节点 key 的偏移在节点的第 16 字节
+#define SNAP_HEADER_SIZE 48
+#define SNAP_NODE_SIZE 32
+#define SNAP_NODE_KEY 16
+#define SNAP_SMALL 16
+
+// 截断的文件打不开 key 的偏移指到 blob 外面的节点查不到 提升后当作墓碑
+static void snap_corrupt(const char *path)
+{
+    unsigned long long key, bad = 1ull << 40;
+    snap_value_t value;
+    unsigned int i, status;
+    memset(&value, 'c', sizeof(value));
+
+    hash_t *hash = hash_alloc(SNAP_SMALL * 4, hash_snap);
+    for (i=0; i<SNAP_SMALL; i++)
+    {
+        key = i;
+        value.id = i;
+        hash_add_entry(hash, &key, sizeof(key), &value, sizeof(value));
+    }
+    // 文件操作不能放在 assert 里 -DNDEBUG 时会整个消失
+    FILE *fp = NULL;
+    if (hash_save(hash, path) != 0 || (fp = fopen(path, "r+b")) == NULL)
+    {
+        perror("snap_corrupt");
+        exit(1);
+    }
+    hash_destroy(hash);
+    for (i=0; i<SNAP_SMALL * 4; i++)
+    {
+        long pos = SNAP_HEADER_SIZE + (long)i * SNAP_NODE_SIZE;
+        if (fseek(fp, pos, SEEK_SET) != 0 || fread(&status, sizeof(status), 1, fp) != 1)
+        {
+            perror("snap_corrupt read");
+            exit(1);
+        }
+        // 每隔一个 ACTIVE 节点把 key 的偏移改到 blob 外面
+        if (status == 1 && i % 2 == 0)
+        {
+            if (fseek(fp, pos + SNAP_NODE_KEY, SEEK_SET) != 0 || fwrite(&bad, sizeof(bad), 1, fp) != 1)
+            {
+                perror("snap_corrupt write");
+                exit(1);
+            }
+        }
+    }
+    fclose(fp);
+
+    hash = hash_open(path, hash_snap);
+    assert(hash);
+    unsigned int found = 0, after = 0;
+    for (i=0; i<SNAP_SMALL; i++)
+    {
+        key = i;
+        snap_value_t *v = (snap_value_t *)hash_lookup_entry(hash, &key, sizeof(key));
+        assert(v == NULL || v->id == i);
+        found += v != NULL;
+    }
+#ifdef HASH_STATS
+    hash_stats_t stats;
+    hash_get_stats(hash, &stats);
+    assert(stats.size == found);
+#endif
+    key = SNAP_SMALL;
+    value.id = SNAP_SMALL;
+    hash_add_entry(hash, &key, sizeof(key), &value, sizeof(value));
+    for (i=0; i<=SNAP_SMALL; i++)
+    {
+        key = i;
+        snap_value_t *v = (snap_value_t *)hash_lookup_entry(hash, &key, sizeof(key));
+        assert(v == NULL || v->id == i);
+        after += v != NULL;
+    }
+    assert(found < SNAP_SMALL && after == found + 1);
+    hash_destroy(hash);
+    printf("corrupt nodes      %u of %u keys still found\n", found, SNAP_SMALL);
+
+    if (truncate(path, SNAP_HEADER_SIZE + SNAP_NODE_SIZE) != 0)
+    {
+        perror("snap_corrupt truncate");
+        exit(1);
+    }
+    hash = hash_open(path, hash_snap);
+    assert(hash == NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int n = argc > 1 ? (unsigned int)atoi(argv[1]) : 1000000;
+    const char *path = argc > 2 ? argv[2] : "hash.snap";
+    snap_value_t value;
+    unsigned long long key;
+    unsigned int i;
+    double t;
+
+    memset(&value, 'v', sizeof(value));
+    t = snap_now();
+    hash_t *hash = hash_alloc(n * 2, hash_snap);
+    for (i=0; i<n; i++)
+    {
+        key = i;
+        value.id = i;
+        hash_add_entry(hash, &key, sizeof(key), &value, sizeof(value));
+    }
+    printf("build %u entries   %8.1f ms\n", n, (snap_now() - t) * 1e3);
+
+    t = snap_now();
+    if (hash_save(hash, path) != 0)
+    {
+        perror("hash_save");
+        return 1;
+    }
+    printf("hash_save          %8.1f ms\n", (snap_now() - t) * 1e3);
+    hash_destroy(hash);
+
+    // 打开到能查到第一个 key 就是重启之后能开始服务的时间
+    t = snap_now();
+    hash = hash_open(path, hash_snap);
+    if (hash == NULL)
+    {
+        fprintf(stderr, "hash_open %s failed\n", path);
+        return 1;
+    }
+    key = n / 2;
+    snap_value_t *v = (snap_value_t *)hash_lookup_entry(hash, &key, sizeof(key));
+    printf("open + first find  %8.3f ms\n", (snap_now() - t) * 1e3);
+    assert(v && v->id == n / 2);
+
+    t = snap_now();
+    for (i=0; i<n; i++)
+    {
+        key = i;
+        v = (snap_value_t *)hash_lookup_entry(hash, &key, sizeof(key));
+        if (v == NULL || v->id != i)
+        {
+            fprintf(stderr, "bad value for %u\n", i);
+            return 1;
+        }
+    }
+    key = n;
+    assert(hash_lookup_entry(hash, &key, sizeof(key)) == NULL);
+    printf("find all (mapped)  %8.1f ns/op\n", (snap_now() - t) * 1e9 / n);
+
+    // 第一次修改触发提升 之后和普通的表一样
+    t = snap_now();
+    key = 0;
+    hash_free_entry(hash, &key, sizeof(key));
+    printf("promote            %8.1f ms\n", (snap_now() - t) * 1e3);
+    for (i=n; i<n+n/4; i++)
+    {
+        key = i;
+        value.id = i;
+        hash_add_entry(hash, &key, sizeof(key), &value, sizeof(value));
+    }
+    for (i=1; i<n+n/4; i++)
+    {
+        key = i;
+        v = (snap_value_t *)hash_lookup_entry(hash, &key, sizeof(key));
+        if (v == NULL || v->id != i)
+        {
+            fprintf(stderr, "bad value for %u after promote\n", i);
+            return 1;
+        }
+        v->payload[0] = 'w';            // 映射里的 value 提升以后可以写
+    }
+    key = 0;
+    assert(hash_lookup_entry(hash, &key, sizeof(key)) == NULL);
+    hash_destroy(hash);
+
+    snap_corrupt(path);
+    unlink(path);
+    printf("ok\n");
+    return 0;
+}
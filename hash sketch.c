@@ -0,0 +1,814 @@
+/*
+ * 流式的基数和频率估计 不保存 key 本身 内存和 key 的个数无关
+ *
+ * HyperLogLog: 64 位 hash 的高 p 位选寄存器 剩下的位里第一个 1 的位置(rank)记最大值
+ *   m = 2^p 个寄存器 相对误差约 1.04/sqrt(m) p = 14 时 16K 字节 误差 0.8%
+ *   稀疏: key 少的时候只记出现过的寄存器 (下标 << 6 | rank) 排好序的 uint32 数组
+ *     新来的先放进一个小的缓冲区 满了排序后和数组归并 数组比稠密的还大时转成稠密
+ *   稠密: 每个寄存器一个字节 合并就是逐字节取最大值 SSE2/AVX2 一次 16/32 个
+ *   估计: 调和平均加偏差修正 值小的时候用线性计数(空寄存器的个数)
+ *
+ * count-min sketch: depth 行 每行 width 个计数器 一个 key 在每行各对应一个计数器 估计值取各行的最小值
+ *   只会高估 高估量不超过 e/width * 总数的概率是 1 - e^-depth
+ *   conservative update: 加的时候只把比 (最小值 + count) 小的计数器抬到这个值 而不是每行都加 高估少很多
+ *   每行的下标由一个 64 位 hash 的两半 h1 + i*h2 得到(Kirsch-Mitzenmacher) 不用算 depth 次 hash
+ *
+ * hash 可以选 hash hash-function.c 里的 WYHash(64 位) 或者 leveldb 的 Hash(批量时走 hash_many 的 AVX2 版本)
+ * leveldb 的 Hash 只有 32 位 再打散成 64 位 不同的 key 超过一亿左右时 hash 冲突会让 HyperLogLog 明显偏低
+ *
+ * 两种 sketch 都可以序列化 每个线程各自统计 序列化以后传给一个线程合并 合并的结果和一个 sketch 统计全部 key 一样
+ * (count-min 合并的是各自 conservative update 之后的计数器 仍然只会高估)
+ * 序列化的整数是本机字节序
+ */
+
+// sketch.h file
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum sketch_hash {
+	SKETCH_WYHASH,
+	SKETCH_LEVELDB,
+} sketch_hash_t;
+
+uint64_t sketch_hash(sketch_hash_t kind, const void *key, size_t len);
+void sketch_hash_many(sketch_hash_t kind, const void * const *keys, const size_t *lens, size_t n, uint64_t *out);
+
+// HyperLogLog precision 是 HLL_MIN_PRECISION 到 HLL_MAX_PRECISION
+#define HLL_MIN_PRECISION 4
+#define HLL_MAX_PRECISION 18
+
+typedef struct hll hll_t;
+
+hll_t * hll_alloc(unsigned int precision, sketch_hash_t hash);
+void hll_destroy(hll_t *h);
+void hll_add(hll_t *h, const void *key, size_t len);
+void hll_add_hash(hll_t *h, uint64_t hash);
+void hll_add_many(hll_t *h, const void * const *keys, const size_t *lens, size_t n);
+double hll_count(hll_t *h);
+// precision 或者 hash 不同返回 -1
+int hll_merge(hll_t *dst, hll_t *src);
+size_t hll_memory(const hll_t *h);
+// 返回需要的字节数 cap 够的时候才写 buf
+size_t hll_serialize(hll_t *h, void *buf, size_t cap);
+// 格式不对返回 NULL
+hll_t * hll_deserialize(const void *buf, size_t len);
+
+// count-min width 向上取到 2 的幂 depth 不超过 CMS_MAX_DEPTH
+#define CMS_MAX_DEPTH 16
+
+typedef struct cms cms_t;
+
+cms_t * cms_alloc(unsigned int width, unsigned int depth, sketch_hash_t hash);
+void cms_destroy(cms_t *c);
+void cms_add(cms_t *c, const void *key, size_t len, uint32_t count);
+void cms_add_hash(cms_t *c, uint64_t hash, uint32_t count);
+// 每个 key 加 1
+void cms_add_many(cms_t *c, const void * const *keys, const size_t *lens, size_t n);
+uint32_t cms_estimate(const cms_t *c, const void *key, size_t len);
+uint32_t cms_estimate_hash(const cms_t *c, uint64_t hash);
+uint64_t cms_total(const cms_t *c);
+// width depth 或者 hash 不同返回 -1
+int cms_merge(cms_t *dst, const cms_t *src);
+size_t cms_memory(const cms_t *c);
+size_t cms_serialize(const cms_t *c, void *buf, size_t cap);
+cms_t * cms_deserialize(const void *buf, size_t len);
+
+#endif
+
+// sketch.c file
+
+#include "sketch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// 在 hash hash-function.c 里
+uint64_t WYHash(const void *key, size_t len, uint64_t seed);
+void hash_many(const char * const *keys, const size_t *lens, size_t n, uint32_t *out);
+
+#define SKETCH_SEED 0x2f0a9c3d5e7b1468ull
+#define SKETCH_BATCH 64
+
+// 32 位 hash 打散成 64 位(splitmix64 的收尾) 高低位都用得上
+static inline uint64_t
+spread32(uint32_t h) {
+	uint64_t x = h;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+uint64_t
+sketch_hash(sketch_hash_t kind, const void *key, size_t len) {
+	if (kind == SKETCH_LEVELDB) {
+		uint32_t h;
+		const char *k = (const char *)key;
+		hash_many(&k, &len, 1, &h);
+		return spread32(h);
+	}
+	return WYHash(key, len, SKETCH_SEED);
+}
+
+void
+sketch_hash_many(sketch_hash_t kind, const void * const *keys, const size_t *lens, size_t n, uint64_t *out) {
+	size_t i, j;
+	if (kind == SKETCH_LEVELDB) {
+		uint32_t h[SKETCH_BATCH];
+		for (i = 0; i < n; i += SKETCH_BATCH) {
+			size_t g = n - i < SKETCH_BATCH ? n - i : SKETCH_BATCH;
+			hash_many((const char * const *)keys + i, lens + i, g, h);
+			for (j = 0; j < g; j++)
+				out[i + j] = spread32(h[j]);
+		}
+		return;
+	}
+	for (i = 0; i < n; i++)
+		out[i] = WYHash(keys[i], lens[i], SKETCH_SEED);
+}
+
+// =======================================================================================
+// HyperLogLog
+
+#define HLL_MAGIC 0x314c4c48u           // "HLL1"
+#define HLL_BUFFER 256                  // 稀疏时的插入缓冲
+#define HLL_RANK_BITS 6
+
+struct hll {
+	unsigned int p;
+	sketch_hash_t hash;
+	uint8_t *regs;                      // 稠密 稀疏时为 NULL
+	uint32_t *sparse;                   // 按 (下标 << 6 | rank) 排序 每个下标只有一个
+	uint32_t nsparse;
+	uint32_t cap_sparse;
+	uint32_t nbuf;
+	uint32_t buf[HLL_BUFFER];
+};
+
+struct hll_header {
+	uint32_t magic;
+	uint8_t p;
+	uint8_t hash;
+	uint8_t dense;
+	uint8_t pad;
+	uint32_t nsparse;
+};
+
+hll_t *
+hll_alloc(unsigned int precision, sketch_hash_t hash) {
+	if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION)
+		return NULL;
+	hll_t *h = (hll_t *)calloc(1, sizeof(*h));
+	assert(h);
+	h->p = precision;
+	h->hash = hash;
+	return h;
+}
+
+void
+hll_destroy(hll_t *h) {
+	free(h->regs);
+	free(h->sparse);
+	free(h);
+}
+
+size_t
+hll_memory(const hll_t *h) {
+	return sizeof(*h) + (h->regs ? (1u << h->p) : h->cap_sparse * sizeof(uint32_t));
+}
+
+static int
+u32_cmp(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+hll_to_dense(hll_t *h) {
+	uint32_t i;
+	h->regs = (uint8_t *)calloc(1u << h->p, 1);
+	assert(h->regs);
+	for (i = 0; i < h->nsparse; i++) {
+		uint32_t idx = h->sparse[i] >> HLL_RANK_BITS;
+		uint8_t rank = h->sparse[i] & ((1u << HLL_RANK_BITS) - 1);
+		if (h->regs[idx] < rank)
+			h->regs[idx] = rank;
+	}
+	for (i = 0; i < h->nbuf; i++) {
+		uint32_t idx = h->buf[i] >> HLL_RANK_BITS;
+		uint8_t rank = h->buf[i] & ((1u << HLL_RANK_BITS) - 1);
+		if (h->regs[idx] < rank)
+			h->regs[idx] = rank;
+	}
+	free(h->sparse);
+	h->sparse = NULL;
+	h->nsparse = h->cap_sparse = h->nbuf = 0;
+}
+
+// 缓冲区排序后和稀疏数组归并 同一个下标只留最大的 rank(排序后同下标的按 rank 升序 留最后一个)
+static void
+hll_flush(hll_t *h) {
+	uint32_t i = 0, j = 0, k = 0;
+	if (h->regs || h->nbuf == 0)
+		return;
+	qsort(h->buf, h->nbuf, sizeof(uint32_t), u32_cmp);
+	uint32_t n = h->nsparse + h->nbuf;
+	uint32_t *out = (uint32_t *)malloc(n * sizeof(uint32_t));
+	assert(out);
+	while (i < h->nsparse || j < h->nbuf) {
+		uint32_t v = (j == h->nbuf || (i < h->nsparse && h->sparse[i] < h->buf[j])) ? h->sparse[i++] : h->buf[j++];
+		if (k > 0 && (out[k - 1] >> HLL_RANK_BITS) == (v >> HLL_RANK_BITS))
+			out[k - 1] = v;
+		else
+			out[k++] = v;
+	}
+	free(h->sparse);
+	h->sparse = out;
+	h->nsparse = k;
+	h->cap_sparse = n;
+	h->nbuf = 0;
+	// 稀疏数组比稠密的寄存器还大了
+	if ((size_t)h->nsparse * sizeof(uint32_t) > (1u << h->p))
+		hll_to_dense(h);
+}
+
+static inline void
+hll_set(hll_t *h, uint32_t idx, uint32_t rank) {
+	if (h->regs) {
+		if (h->regs[idx] < rank)
+			h->regs[idx] = (uint8_t)rank;
+		return;
+	}
+	h->buf[h->nbuf++] = idx << HLL_RANK_BITS | rank;
+	if (h->nbuf == HLL_BUFFER)
+		hll_flush(h);
+}
+
+// 高 p 位是寄存器下标 剩下的 64-p 位里第一个 1 的位置是 rank 全 0 时 rank = 64-p+1
+void
+hll_add_hash(hll_t *h, uint64_t hash) {
+	uint32_t idx = (uint32_t)(hash >> (64 - h->p));
+	uint64_t w = hash << h->p | (1ull << (h->p - 1));
+	hll_set(h, idx, (uint32_t)__builtin_clzll(w) + 1);
+}
+
+void
+hll_add(hll_t *h, const void *key, size_t len) {
+	hll_add_hash(h, sketch_hash(h->hash, key, len));
+}
+
+void
+hll_add_many(hll_t *h, const void * const *keys, const size_t *lens, size_t n) {
+	uint64_t hash[SKETCH_BATCH];
+	size_t i, j;
+	for (i = 0; i < n; i += SKETCH_BATCH) {
+		size_t g = n - i < SKETCH_BATCH ? n - i : SKETCH_BATCH;
+		sketch_hash_many(h->hash, keys + i, lens + i, g, hash);
+		if (h->regs) {
+			// 稠密时先把要写的寄存器都 prefetch 上 p 大的时候寄存器数组不在 L1 里
+			for (j = 0; j < g; j++)
+				__builtin_prefetch(h->regs + (hash[j] >> (64 - h->p)), 1);
+		}
+		for (j = 0; j < g; j++)
+			hll_add_hash(h, hash[j]);
+	}
+}
+
+double
+hll_count(hll_t *h) {
+	uint32_t m = 1u << h->p, i, zeros = 0;
+	double sum = 0;
+
+	hll_flush(h);
+	if (h->regs == NULL) {
+		// 稀疏时寄存器大多是 0 线性计数已经很准
+		zeros = m - h->nsparse;
+		return zeros ? m * log((double)m / zeros) : m;
+	}
+	for (i = 0; i < m; i++) {
+		sum += ldexp(1.0, -h->regs[i]);
+		zeros += h->regs[i] == 0;
+	}
+	double alpha = m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709 : 0.7213 / (1 + 1.079 / m);
+	double e = alpha * m * m / sum;
+	if (e <= 2.5 * m && zeros)
+		e = m * log((double)m / zeros);
+	return e;
+}
+
+// 稠密的合并就是逐字节取最大值
+static void
+max_bytes(uint8_t *dst, const uint8_t *src, size_t n) {
+	size_t i = 0;
+#ifdef __AVX2__
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_max_epu8(a, b));
+	}
+#endif
+#ifdef __SSE2__
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_max_epu8(a, b));
+	}
+#endif
+	for (; i < n; i++)
+		dst[i] = dst[i] > src[i] ? dst[i] : src[i];
+}
+
+int
+hll_merge(hll_t *dst, hll_t *src) {
+	uint32_t i;
+	if (dst->p != src->p || dst->hash != src->hash)
+		return -1;
+	hll_flush(src);
+	if (src->regs == NULL) {
+		for (i = 0; i < src->nsparse; i++)
+			hll_set(dst, src->sparse[i] >> HLL_RANK_BITS, src->sparse[i] & ((1u << HLL_RANK_BITS) - 1));
+		return 0;
+	}
+	if (dst->regs == NULL) {
+		hll_flush(dst);
+		if (dst->regs == NULL)
+			hll_to_dense(dst);
+	}
+	max_bytes(dst->regs, src->regs, 1u << dst->p);
+	return 0;
+}
+
+size_t
+hll_serialize(hll_t *h, void *buf, size_t cap) {
+	struct hll_header hd;
+	hll_flush(h);
+	size_t body = h->regs ? (1u << h->p) : h->nsparse * sizeof(uint32_t);
+	size_t size = sizeof(hd) + body;
+	if (cap < size)
+		return size;
+	memset(&hd, 0, sizeof(hd));
+	hd.magic = HLL_MAGIC;
+	hd.p = (uint8_t)h->p;
+	hd.hash = (uint8_t)h->hash;
+	hd.dense = h->regs != NULL;
+	hd.nsparse = h->nsparse;
+	memcpy(buf, &hd, sizeof(hd));
+	memcpy((char *)buf + sizeof(hd), h->regs ? (const void *)h->regs : (const void *)h->sparse, body);
+	return size;
+}
+
+hll_t *
+hll_deserialize(const void *buf, size_t len) {
+	struct hll_header hd;
+	uint32_t i;
+	if (len < sizeof(hd))
+		return NULL;
+	memcpy(&hd, buf, sizeof(hd));
+	if (hd.magic != HLL_MAGIC || hd.p < HLL_MIN_PRECISION || hd.p > HLL_MAX_PRECISION
+		|| hd.hash > SKETCH_LEVELDB)
+		return NULL;
+	size_t body = hd.dense ? (1u << hd.p) : (size_t)hd.nsparse * sizeof(uint32_t);
+	if (len != sizeof(hd) + body)
+		return NULL;
+
+	hll_t *h = hll_alloc(hd.p, (sketch_hash_t)hd.hash);
+	const char *p = (const char *)buf + sizeof(hd);
+	if (hd.dense) {
+		h->regs = (uint8_t *)malloc(body);
+		assert(h->regs);
+		memcpy(h->regs, p, body);
+		return h;
+	}
+	h->sparse = (uint32_t *)malloc(body + 1);
+	assert(h->sparse);
+	memcpy(h->sparse, p, body);
+	h->nsparse = h->cap_sparse = hd.nsparse;
+	// 必须严格递增而且下标在范围里 否则后面的归并会出错
+	for (i = 0; i < h->nsparse; i++) {
+		if ((h->sparse[i] >> HLL_RANK_BITS) >= (1u << hd.p)
+			|| (i > 0 && (h->sparse[i - 1] >> HLL_RANK_BITS) >= (h->sparse[i] >> HLL_RANK_BITS))) {
+			hll_destroy(h);
+			return NULL;
+		}
+	}
+	return h;
+}
+
+// =======================================================================================
+// count-min sketch
+
+#define CMS_MAGIC 0x31534d43u           // "CMS1"
+
+struct cms {
+	uint32_t width;                     // 2 的幂
+	uint32_t depth;
+	sketch_hash_t hash;
+	uint64_t total;
+	uint32_t *count;                    // depth 行 每行 width 个
+};
+
+struct cms_header {
+	uint32_t magic;
+	uint32_t width;
+	uint32_t depth;
+	uint32_t hash;
+	uint64_t total;
+};
+
+static cms_t *
+cms_new(uint32_t width, uint32_t depth, sketch_hash_t hash) {
+	cms_t *c = (cms_t *)malloc(sizeof(*c));
+	assert(c);
+	c->width = width;
+	c->depth = depth;
+	c->hash = hash;
+	c->total = 0;
+	c->count = (uint32_t *)calloc((size_t)width * depth, sizeof(uint32_t));
+	assert(c->count);
+	return c;
+}
+
+cms_t *
+cms_alloc(unsigned int width, unsigned int depth, sketch_hash_t hash) {
+	uint32_t w = 1;
+	if (depth == 0 || depth > CMS_MAX_DEPTH || width == 0 || width > (1u << 31))
+		return NULL;
+	while (w < width)
+		w <<= 1;
+	return cms_new(w, depth, hash);
+}
+
+void
+cms_destroy(cms_t *c) {
+	free(c->count);
+	free(c);
+}
+
+size_t
+cms_memory(const cms_t *c) {
+	return sizeof(*c) + (size_t)c->width * c->depth * sizeof(uint32_t);
+}
+
+uint64_t
+cms_total(const cms_t *c) {
+	return c->total;
+}
+
+// 第 i 行的下标 h2 是奇数 width 是 2 的幂 各行的下标互不相关
+static inline uint32_t *
+cms_cell(const cms_t *c, uint64_t hash, uint32_t i) {
+	uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+	return c->count + (size_t)i * c->width + ((h1 + i * h2) & (c->width - 1));
+}
+
+static inline uint32_t
+sat_add(uint32_t a, uint32_t b) {
+	uint32_t s = a + b;
+	return s < a ? UINT32_MAX : s;
+}
+
+// 定义 CMS_PLAIN_UPDATE 时每行都加 count 用来和 conservative update 对比
+void
+cms_add_hash(cms_t *c, uint64_t hash, uint32_t count) {
+	uint32_t *cell[CMS_MAX_DEPTH];
+	uint32_t i;
+	c->total += count;
+#ifdef CMS_PLAIN_UPDATE
+	for (i = 0; i < c->depth; i++) {
+		cell[i] = cms_cell(c, hash, i);
+		*cell[i] = sat_add(*cell[i], count);
+	}
+#else
+	uint32_t min = UINT32_MAX;
+	for (i = 0; i < c->depth; i++) {
+		cell[i] = cms_cell(c, hash, i);
+		if (*cell[i] < min)
+			min = *cell[i];
+	}
+	uint32_t target = sat_add(min, count);
+	for (i = 0; i < c->depth; i++) {
+		if (*cell[i] < target)
+			*cell[i] = target;
+	}
+#endif
+}
+
+void
+cms_add(cms_t *c, const void *key, size_t len, uint32_t count) {
+	cms_add_hash(c, sketch_hash(c->hash, key, len), count);
+}
+
+// 一批 key 先算 hash 再把每个 key 每行的计数器都 prefetch 上 最后再更新
+// 表比 cache 大的时候 depth 次 cache miss 可以重叠起来
+void
+cms_add_many(cms_t *c, const void * const *keys, const size_t *lens, size_t n) {
+	uint64_t hash[SKETCH_BATCH];
+	size_t i, j;
+	uint32_t d;
+	for (i = 0; i < n; i += SKETCH_BATCH) {
+		size_t g = n - i < SKETCH_BATCH ? n - i : SKETCH_BATCH;
+		sketch_hash_many(c->hash, keys + i, lens + i, g, hash);
+		for (j = 0; j < g; j++) {
+			for (d = 0; d < c->depth; d++)
+				__builtin_prefetch(cms_cell(c, hash[j], d), 1);
+		}
+		for (j = 0; j < g; j++)
+			cms_add_hash(c, hash[j], 1);
+	}
+}
+
+uint32_t
+cms_estimate_hash(const cms_t *c, uint64_t hash) {
+	uint32_t i, min = UINT32_MAX;
+	for (i = 0; i < c->depth; i++) {
+		uint32_t v = *cms_cell(c, hash, i);
+		if (v < min)
+			min = v;
+	}
+	return min;
+}
+
+uint32_t
+cms_estimate(const cms_t *c, const void *key, size_t len) {
+	return cms_estimate_hash(c, sketch_hash(c->hash, key, len));
+}
+
+// 逐个计数器饱和相加 循环很简单 -O2 -ftree-vectorize / -O3 下会被向量化
+int
+cms_merge(cms_t *dst, const cms_t *src) {
+	size_t i, n = (size_t)dst->width * dst->depth;
+	if (dst->width != src->width || dst->depth != src->depth || dst->hash != src->hash)
+		return -1;
+	for (i = 0; i < n; i++) {
+		uint32_t s = dst->count[i] + src->count[i];
+		dst->count[i] = s | -(uint32_t)(s < dst->count[i]);
+	}
+	dst->total += src->total;
+	return 0;
+}
+
+size_t
+cms_serialize(const cms_t *c, void *buf, size_t cap) {
+	struct cms_header hd;
+	size_t body = (size_t)c->width * c->depth * sizeof(uint32_t);
+	size_t size = sizeof(hd) + body;
+	if (cap < size)
+		return size;
+	memset(&hd, 0, sizeof(hd));
+	hd.magic = CMS_MAGIC;
+	hd.width = c->width;
+	hd.depth = c->depth;
+	hd.hash = c->hash;
+	hd.total = c->total;
+	memcpy(buf, &hd, sizeof(hd));
+	memcpy((char *)buf + sizeof(hd), c->count, body);
+	return size;
+}
+
+cms_t *
+cms_deserialize(const void *buf, size_t len) {
+	struct cms_header hd;
+	if (len < sizeof(hd))
+		return NULL;
+	memcpy(&hd, buf, sizeof(hd));
+	if (hd.magic != CMS_MAGIC || hd.hash > SKETCH_LEVELDB
+		|| hd.depth == 0 || hd.depth > CMS_MAX_DEPTH
+		|| hd.width == 0 || (hd.width & (hd.width - 1)) != 0
+		|| len != sizeof(hd) + (size_t)hd.width * hd.depth * sizeof(uint32_t))
+		return NULL;
+	cms_t *c = cms_new(hd.width, hd.depth, (sketch_hash_t)hd.hash);
+	memcpy(c->count, (const char *)buf + sizeof(hd), len - sizeof(hd));
+	c->total = hd.total;
+	return c;
+}
+
+// bench.c file
+
+/*
+ * HyperLogLog: 不同的 precision 下的误差和内存 逐个加和 hll_add_many 的吞吐
+ *   分成 4 份分别统计(模拟 4 个线程) 序列化 反序列化以后合并 结果要和一个 sketch 统计全部的完全一样
+ * count-min: Zipf 分布的 key 流 最热的 100 个 key 和随机的 key 的平均高估量 合并后的结果也只会高估
+ *   gcc -O2 -mavx2 sketch.c bench.c "hash hash-function.c" -lm -o sketch_bench && ./sketch_bench [distinct]
+ *   再加 -DCMS_PLAIN_UPDATE 编一次 对比不用 conservative update 时的高估量
+ */
+
+#include "sketch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <time.h>
+
+#define KEY_LEN 24
+#define PARTS 4
+#define CMS_STREAM 4000000
+
+static double
+now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *Mem;
+static const void **Keys;
+static size_t *Lens;
+
+static void
+make_keys(size_t n) {
+	size_t i;
+	Mem = (char *)malloc(n * KEY_LEN);
+	Keys = (const void **)malloc(n * sizeof(void *));
+	Lens = (size_t *)malloc(n * sizeof(size_t));
+	for (i = 0; i < n; i++) {
+		char *k = Mem + i * KEY_LEN;
+		Lens[i] = (size_t)snprintf(k, KEY_LEN, "user:%zu", i);
+		Keys[i] = k;
+	}
+}
+
+// 每个 key 出现两次 先按顺序一遍 再倒着一遍 估计值应该还是 n
+static void
+bench_hll(sketch_hash_t kind, const char *name, size_t n) {
+	unsigned int p;
+	size_t i;
+	for (p = 10; p <= 16; p += 2) {
+		hll_t *h = hll_alloc(p, kind);
+		hll_t *single = hll_alloc(p, kind);
+		double t = now();
+		for (i = 0; i < n; i++)
+			hll_add(single, Keys[i], Lens[i]);
+		double t_single = now() - t;
+		t = now();
+		hll_add_many(h, Keys, Lens, n);
+		for (i = n; i > 0; i -= i < 1024 ? i : 1024) {
+			size_t g = i < 1024 ? i : 1024;
+			hll_add_many(h, Keys + i - g, Lens + i - g, g);
+		}
+		double t_many = (now() - t) / 2;
+		double est = hll_count(h);
+		assert(est == hll_count(single));
+
+		// 分成 PARTS 份 序列化后合并
+		hll_t *merged = hll_alloc(p, kind);
+		for (i = 0; i < PARTS; i++) {
+			hll_t *part = hll_alloc(p, kind);
+			size_t lo = n * i / PARTS, hi = n * (i + 1) / PARTS;
+			hll_add_many(part, Keys + lo, Lens + lo, hi - lo);
+			size_t size = hll_serialize(part, NULL, 0);
+			char *buf = (char *)malloc(size);
+			size_t written = hll_serialize(part, buf, size);
+			assert(written == size);
+			hll_t *copy = hll_deserialize(buf, written);
+			assert(copy);
+			int r = hll_merge(merged, copy);
+			assert(r == 0);
+			(void)r;
+			hll_destroy(copy);
+			hll_destroy(part);
+			free(buf);
+		}
+		assert(hll_count(merged) == est);
+
+		printf("hll %-7s p=%-2u %8zu keys: estimate %10.0f error %+6.2f%% (std %.2f%%), %6zu bytes, add %5.1f Mkeys/s, add_many %5.1f Mkeys/s\n",
+			name, p, n, est, (est - n) * 100.0 / n, 104.0 / sqrt((double)(1u << p)), hll_memory(h),
+			n / t_single / 1e6, n / t_many / 1e6);
+		hll_destroy(merged);
+		hll_destroy(single);
+		hll_destroy(h);
+	}
+}
+
+// 小基数时一直是稀疏的 内存比稠密的小很多
+static void
+bench_hll_sparse(void) {
+	size_t n;
+	for (n = 10; n <= 10000; n *= 10) {
+		hll_t *h = hll_alloc(14, SKETCH_WYHASH);
+		hll_add_many(h, Keys, Lens, n);
+		double est = hll_count(h);
+		printf("hll sparse p=14 %6zu keys: estimate %8.1f, %6zu bytes, serialized %6zu bytes\n",
+			n, est, hll_memory(h), hll_serialize(h, NULL, 0));
+		hll_destroy(h);
+	}
+}
+
+// 第 i 个 key 出现的概率正比于 1/(i+1)
+static size_t
+zipf_next(const double *cdf, size_t n, double u) {
+	size_t lo = 0, hi = n;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < n ? lo : n - 1;
+}
+
+static void
+bench_cms(size_t n) {
+	double *cdf = (double *)malloc(n * sizeof(double));
+	uint32_t *truth = (uint32_t *)calloc(n, sizeof(uint32_t));
+	const void **stream = (const void **)malloc(CMS_STREAM * sizeof(void *));
+	size_t *lens = (size_t *)malloc(CMS_STREAM * sizeof(size_t));
+	double sum = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		sum += 1.0 / (i + 1);
+		cdf[i] = sum;
+	}
+	srand(1);
+	for (i = 0; i < CMS_STREAM; i++) {
+		size_t k = zipf_next(cdf, n, (double)rand() / RAND_MAX * sum);
+		truth[k]++;
+		stream[i] = Keys[k];
+		lens[i] = Lens[k];
+	}
+
+	cms_t *c = cms_alloc(1 << 16, 4, SKETCH_WYHASH);
+	double t = now();
+	cms_add_many(c, stream, lens, CMS_STREAM);
+	double t_many = now() - t;
+
+	cms_t *merged = cms_alloc(1 << 16, 4, SKETCH_WYHASH);
+	for (i = 0; i < PARTS; i++) {
+		cms_t *part = cms_alloc(1 << 16, 4, SKETCH_WYHASH);
+		size_t lo = CMS_STREAM * i / PARTS, hi = CMS_STREAM * (i + 1) / PARTS;
+		cms_add_many(part, stream + lo, lens + lo, hi - lo);
+		size_t size = cms_serialize(part, NULL, 0);
+		char *buf = (char *)malloc(size);
+		size_t written = cms_serialize(part, buf, size);
+		assert(written == size);
+		cms_t *copy = cms_deserialize(buf, written);
+		assert(copy);
+		int r = cms_merge(merged, copy);
+		assert(r == 0);
+		(void)r;
+		cms_destroy(copy);
+		cms_destroy(part);
+		free(buf);
+	}
+	assert(cms_total(merged) == CMS_STREAM);
+
+	double over_hot = 0, over_rand = 0, over_merged = 0;
+	for (i = 0; i < 100; i++) {
+		uint32_t e = cms_estimate(c, Keys[i], Lens[i]);
+		assert(e >= truth[i]);
+		over_hot += e - truth[i];
+	}
+	for (i = 0; i < 10000; i++) {
+		size_t k = (size_t)rand() % n;
+		uint32_t e = cms_estimate(c, Keys[k], Lens[k]);
+		uint32_t em = cms_estimate(merged, Keys[k], Lens[k]);
+		assert(e >= truth[k] && em >= truth[k]);
+		over_rand += e - truth[k];
+		over_merged += em - truth[k];
+	}
+#ifdef CMS_PLAIN_UPDATE
+	const char *mode = "plain";
+#else
+	const char *mode = "conservative";
+#endif
+	printf("cms %s %ux%u %zu bytes, %d adds over %zu keys: %.1f Madds/s, "
+		"mean overestimate hot %.1f random %.1f merged random %.1f (e/width * total = %.0f)\n",
+		mode, 1 << 16, 4, cms_memory(c), CMS_STREAM, n, CMS_STREAM / t_many / 1e6,
+		over_hot / 100, over_rand / 10000, over_merged / 10000, exp(1.0) / (1 << 16) * CMS_STREAM);
+
+	cms_destroy(c);
+	cms_destroy(merged);
+	free(cdf);
+	free(truth);
+	free(stream);
+	free(lens);
+}
+
+int
+main(int argc, char *argv[]) {
+	size_t n = argc > 1 ? (size_t)atol(argv[1]) : 1000000;
+	make_keys(n);
+	bench_hll(SKETCH_WYHASH, "wyhash", n);
+	bench_hll(SKETCH_LEVELDB, "leveldb", n);
+	bench_hll_sparse();
+	bench_cms(n);
+	free(Mem);
+	free(Keys);
+	free(Lens);
+	return 0;
+}
@@ -4,6 +4,11 @@
 
 #define SKIPLIST_MAXLEVEL 32
 #define SKIPLIST_P 0.25
+/* members shorter than this are stored inside the node */
+#define SKIPLIST_INLINE 20
+/* nodes of each level come from their own slab, chunks grow up to this size */
+#define SKIPLIST_SLAB_MIN 8
+#define SKIPLIST_CHUNK (64 * 1024)
 
 typedef struct slobj {
     char *ptr;
@@ -11,30 +16,43 @@ typedef struct slobj {
 } slobj;
 
 typedef struct skiplistNode {
-    slobj* obj;
+    slobj obj;
     double score;
     struct skiplistNode *backward;
+    unsigned int height;
+    char buf[SKIPLIST_INLINE];
     struct skiplistLevel {
         struct skiplistNode *forward;
         unsigned int span;
     }level[];
 } skiplistNode;
 
+typedef struct slSlab {
+    void *free;         /* freed nodes, linked through their first word */
+    char *cur, *end;    /* unused part of the newest chunk */
+    unsigned int grow;  /* nodes in the next chunk */
+} slSlab;
+
 typedef struct skiplist {
     struct skiplistNode *header, *tail;
     unsigned long length;
     int level;
+    slSlab slab[SKIPLIST_MAXLEVEL];
+    void *chunks;               /* every chunk of every slab, released by slFree */
+    unsigned long heapobjs;     /* members too long to be inline */
 } skiplist;
 
 typedef void (*slDeleteCb) (void *ud, slobj *obj);
-slobj* slCreateObj(const char* ptr, size_t length);
-void slFreeObj(slobj *obj);
 
 skiplist *slCreate(void);
 void slFree(skiplist *sl);
 void slDump(skiplist *sl);
 
-void slInsert(skiplist *sl, double score, slobj *obj);
+/* the member is copied, obj may point to a temporary buffer */
+skiplistNode *slInsert(skiplist *sl, double score, slobj *obj);
+/* build an empty skiplist from pairs sorted by (score, member), returns 0
+ * and leaves sl untouched when sl is not empty or the input is not sorted */
+int slBulkLoad(skiplist *sl, const double *scores, slobj *objs, unsigned long n);
 int slDelete(skiplist *sl, double score, slobj *obj);
 unsigned long slDeleteByRank(skiplist *sl, unsigned int start, unsigned int end, slDeleteCb cb, void* ud);
 
@@ -44,6 +62,29 @@ skiplistNode* slGetNodeByRank(skiplist *sl, unsigned long rank);
 skiplistNode *slFirstInRange(skiplist *sl, double min, double max);
 skiplistNode *slLastInRange(skiplist *sl, double min, double max);
 
+/* sorted set: the skiplist plus an open addressing table from member to its
+ * node, the member string is only kept in the node */
+#define ZSET_MIN_SLOTS 16
+
+typedef struct zset {
+    skiplist *sl;
+    struct zsetSlot {
+        skiplistNode *node;     /* NULL when empty */
+        unsigned int hash;
+    } *slots;
+    unsigned long mask;         /* number of slots - 1 */
+} zset;
+
+zset *zsetCreate(void);
+void zsetFree(zset *zs);
+/* returns 1 when member is new, 0 when only its score changed */
+int zsetAdd(zset *zs, double score, slobj *member);
+int zsetRem(zset *zs, slobj *member);
+skiplistNode *zsetFind(zset *zs, slobj *member);
+/* 1-based, 0 when member is not in the set */
+unsigned long zsetRank(zset *zs, slobj *member);
+unsigned long zsetDeleteByRank(zset *zs, unsigned int start, unsigned int end);
+
 // skiplist.c
 /*
  *  author: xjdrew
@@ -59,10 +100,48 @@ skiplistNode *slLastInRange(skiplist *sl, double min, double max);
 #include "skiplist.h"
 
 
-skiplistNode *slCreateNode(int level, double score, slobj *obj) {
-    skiplistNode *n = malloc(sizeof(*n) + level * sizeof(struct skiplistLevel));
-    n->score = score;
-    n->obj   = obj;
+#define slNodeSize(level) (sizeof(skiplistNode) + (level) * sizeof(struct skiplistLevel))
+
+/* Nodes are never handed back to malloc one by one: a freed node goes on the
+ * free list of its level and is reused by the next insert of that level. */
+static void *slSlabAlloc(skiplist *sl, int level) {
+    slSlab *s = &sl->slab[level-1];
+    size_t size = slNodeSize(level);
+    void *p = s->free;
+
+    if (p) {
+        s->free = *(void **)p;
+        return p;
+    }
+    if (s->cur == s->end) {
+        char *chunk = malloc(sizeof(void *) + size * s->grow);
+        *(void **)chunk = sl->chunks;
+        sl->chunks = chunk;
+        s->cur = chunk + sizeof(void *);
+        s->end = s->cur + size * s->grow;
+        if (size * s->grow * 2 <= SKIPLIST_CHUNK)
+            s->grow *= 2;
+    }
+    p = s->cur;
+    s->cur += size;
+    return p;
+}
+
+skiplistNode *slCreateNode(skiplist *sl, int level, double score, slobj *obj) {
+    skiplistNode *n = slSlabAlloc(sl, level);
+    n->score  = score;
+    n->height = level;
+    n->obj.length = obj->length;
+    if (obj->length < SKIPLIST_INLINE) {
+        n->obj.ptr = n->buf;
+    } else {
+        n->obj.ptr = malloc(obj->length + 1);
+        sl->heapobjs++;
+    }
+    if (obj->length) {
+        memcpy(n->obj.ptr, obj->ptr, obj->length);
+    }
+    n->obj.ptr[obj->length] = '\0';
     return n;
 }
 
@@ -73,7 +152,18 @@ skiplist *slCreate(void) {
     sl = malloc(sizeof(*sl));
     sl->level = 1;
     sl->length = 0;
-    sl->header = slCreateNode(SKIPLIST_MAXLEVEL, 0, NULL);
+    for (j=0; j < SKIPLIST_MAXLEVEL; j++) {
+        sl->slab[j].free = NULL;
+        sl->slab[j].cur = sl->slab[j].end = NULL;
+        sl->slab[j].grow = SKIPLIST_SLAB_MIN;
+    }
+    sl->chunks = NULL;
+    sl->heapobjs = 0;
+    sl->header = malloc(slNodeSize(SKIPLIST_MAXLEVEL));
+    sl->header->obj.ptr = NULL;
+    sl->header->obj.length = 0;
+    sl->header->score = 0;
+    sl->header->height = SKIPLIST_MAXLEVEL;
     for (j=0; j < SKIPLIST_MAXLEVEL; j++) {
         sl->header->level[j].forward = NULL;
         sl->header->level[j].span = 0;
@@ -83,38 +173,34 @@ skiplist *slCreate(void) {
     return sl;
 }
 
-slobj* slCreateObj(const char* ptr, size_t length) {
-    slobj *obj = malloc(sizeof(*obj));
-    obj->ptr    = malloc(length + 1);
-
-    if(ptr) {
-        memcpy(obj->ptr, ptr, length);
+void slFreeNode(skiplist *sl, skiplistNode *node) {
+    slSlab *s = &sl->slab[node->height-1];
+    if (node->obj.ptr != node->buf) {
+        free(node->obj.ptr);
+        sl->heapobjs--;
     }
-    obj->ptr[length] = '\0';
-
-    obj->length = length;
-    return obj;
-}
-
-void slFreeObj(slobj *obj) {
-    free(obj->ptr);
-    free(obj);
-}
-
-void slFreeNode(skiplistNode *node) {
-    slFreeObj(node->obj);
-    free(node);
+    *(void **)node = s->free;
+    s->free = node;
 }
 
+/* The chunks are released as a whole, nodes are only visited when some
+ * member lives outside its node. */
 void slFree(skiplist *sl) {
-    skiplistNode *node = sl->header->level[0].forward, *next;
+    skiplistNode *node = sl->header->level[0].forward;
+    void *chunk, *next;
 
-    free(sl->header);
-    while(node) {
-        next = node->level[0].forward;
-        slFreeNode(node);
-        node = next;
+    while(sl->heapobjs && node) {
+        if (node->obj.ptr != node->buf) {
+            free(node->obj.ptr);
+            sl->heapobjs--;
+        }
+        node = node->level[0].forward;
+    }
+    for (chunk = sl->chunks; chunk; chunk = next) {
+        next = *(void **)chunk;
+        free(chunk);
     }
+    free(sl->header);
     free(sl);
 }
 
@@ -135,7 +221,7 @@ int equalslObj(slobj *a, slobj *b) {
     return compareslObj(a, b) == 0;
 }
 
-void slInsert(skiplist *sl, double score, slobj *obj) {
+skiplistNode *slInsert(skiplist *sl, double score, slobj *obj) {
     skiplistNode *update[SKIPLIST_MAXLEVEL], *x;
     unsigned int rank[SKIPLIST_MAXLEVEL];
     int i, level;
@@ -147,7 +233,7 @@ void slInsert(skiplist *sl, double score, slobj *obj) {
         while (x->level[i].forward &&
             (x->level[i].forward->score < score ||
                 (x->level[i].forward->score == score &&
-                compareslObj(x->level[i].forward->obj,obj) < 0))) {
+                compareslObj(&x->level[i].forward->obj,obj) < 0))) {
             rank[i] += x->level[i].span;
             x = x->level[i].forward;
         }
@@ -166,7 +252,7 @@ void slInsert(skiplist *sl, double score, slobj *obj) {
         }
         sl->level = level;
     }
-    x = slCreateNode(level,score,obj);
+    x = slCreateNode(sl,level,score,obj);
     for (i = 0; i < level; i++) {
         x->level[i].forward = update[i]->level[i].forward;
         update[i]->level[i].forward = x;
@@ -187,6 +273,60 @@ void slInsert(skiplist *sl, double score, slobj *obj) {
     else
         sl->tail = x;
     sl->length++;
+    return x;
+}
+
+/* Levels are not random here: every 4th node (the 1/SKIPLIST_P of
+ * slRandomLevel) is one level higher, so node at rank r gets one extra level
+ * for each factor of 4 in r. Each level is linked to the previous node of
+ * that level, whose rank is remembered to compute the span. */
+int slBulkLoad(skiplist *sl, const double *scores, slobj *objs, unsigned long n) {
+    skiplistNode *last[SKIPLIST_MAXLEVEL], *x = NULL, *prev = NULL;
+    unsigned long lastrank[SKIPLIST_MAXLEVEL], i, r;
+    int j, level;
+
+    if (sl->length != 0)
+        return 0;
+    for (i = 1; i < n; i++) {
+        if (scores[i-1] > scores[i] ||
+            (scores[i-1] == scores[i] && compareslObj(&objs[i-1], &objs[i]) >= 0))
+            return 0;
+    }
+
+    for (j = 0; j < SKIPLIST_MAXLEVEL; j++) {
+        last[j] = sl->header;
+        lastrank[j] = 0;
+    }
+    sl->level = 1;
+    for (i = 0; i < n; i++) {
+        r = i + 1;
+        level = 1;
+        while (level < SKIPLIST_MAXLEVEL && r % 4 == 0) {
+            r /= 4;
+            level++;
+        }
+        if (level > sl->level)
+            sl->level = level;
+
+        x = slCreateNode(sl, level, scores[i], &objs[i]);
+        for (j = 0; j < level; j++) {
+            last[j]->level[j].forward = x;
+            last[j]->level[j].span = i + 1 - lastrank[j];
+            last[j] = x;
+            lastrank[j] = i + 1;
+        }
+        x->backward = prev;
+        prev = x;
+    }
+
+    /* the last node of each level spans to the end of the list */
+    for (j = 0; j < sl->level; j++) {
+        last[j]->level[j].forward = NULL;
+        last[j]->level[j].span = n - lastrank[j];
+    }
+    sl->tail = x;
+    sl->length = n;
+    return 1;
 }
 
 /* Internal function used by slDelete, slDeleteByScore */
@@ -220,16 +360,16 @@ int slDelete(skiplist *sl, double score, slobj *obj) {
         while (x->level[i].forward &&
             (x->level[i].forward->score < score ||
                 (x->level[i].forward->score == score &&
-                compareslObj(x->level[i].forward->obj,obj) < 0)))
+                compareslObj(&x->level[i].forward->obj,obj) < 0)))
             x = x->level[i].forward;
         update[i] = x;
     }
     /* We may have multiple elements with the same score, what we need
      * is to find the element with both the right score and object. */
     x = x->level[0].forward;
-    if (x && score == x->score && equalslObj(x->obj,obj)) {
+    if (x && score == x->score && equalslObj(&x->obj,obj)) {
         slDeleteNode(sl, x, update);
-        slFreeNode(x);
+        slFreeNode(sl, x);
         return 1;
     } else {
         return 0; /* not found */
@@ -258,8 +398,8 @@ unsigned long slDeleteByRank(skiplist *sl, unsigned int start, unsigned int end,
     while (x && traversed <= end) {
         skiplistNode *next = x->level[0].forward;
         slDeleteNode(sl,x,update);
-        cb(ud, x->obj);
-        slFreeNode(x);
+        cb(ud, &x->obj);
+        slFreeNode(sl, x);
         removed++;
         traversed++;
         x = next;
@@ -281,13 +421,13 @@ unsigned long slGetRank(skiplist *sl, double score, slobj *o) {
         while (x->level[i].forward &&
             (x->level[i].forward->score < score ||
                 (x->level[i].forward->score == score &&
-                compareslObj(x->level[i].forward->obj,o) <= 0))) {
+                compareslObj(&x->level[i].forward->obj,o) <= 0))) {
             rank += x->level[i].span;
             x = x->level[i].forward;
         }
 
-        /* x might be equal to sl->header, so test if obj is non-NULL */
-        if (x->obj && equalslObj(x->obj, o)) {
+        /* x might be equal to sl->header, so test if obj.ptr is non-NULL */
+        if (x->obj.ptr && equalslObj(&x->obj, o)) {
             return rank;
         }
     }
@@ -389,10 +529,160 @@ void slDump(skiplist *sl) {
     while(x->level[0].forward) {
         x = x->level[0].forward;
         i++;
-        printf("node %d: score:%f, member:%s\n", i, x->score, x->obj->ptr);
+        printf("node %d: score:%f, member:%s\n", i, x->score, x->obj.ptr);
     }
 }
 
+/* ---------------------------------- zset ---------------------------------- */
+
+static unsigned int zsetHash(const char *p, size_t len) {
+    unsigned long long h = 0x9e3779b97f4a7c15ULL ^ len, w;
+    while (len >= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+        p += 8;
+        len -= 8;
+    }
+    w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    return (unsigned int)(h ^ (h >> 32));
+}
+
+static struct zsetSlot *zsetLookup(zset *zs, slobj *member, unsigned int hash) {
+    unsigned long i = hash & zs->mask;
+    while (zs->slots[i].node) {
+        if (zs->slots[i].hash == hash && equalslObj(&zs->slots[i].node->obj, member))
+            return &zs->slots[i];
+        i = (i + 1) & zs->mask;
+    }
+    return NULL;
+}
+
+static void zsetPlace(zset *zs, skiplistNode *node, unsigned int hash) {
+    unsigned long i = hash & zs->mask;
+    while (zs->slots[i].node)
+        i = (i + 1) & zs->mask;
+    zs->slots[i].node = node;
+    zs->slots[i].hash = hash;
+}
+
+static void zsetResize(zset *zs, unsigned long size) {
+    struct zsetSlot *old = zs->slots;
+    unsigned long i, n = zs->mask + 1;
+
+    zs->slots = calloc(size, sizeof(*zs->slots));
+    zs->mask = size - 1;
+    for (i = 0; i < n; i++) {
+        if (old[i].node)
+            zsetPlace(zs, old[i].node, old[i].hash);
+    }
+    free(old);
+}
+
+/* No tombstones: the following slots of the cluster are moved back when
+ * their home slot is not between the hole and themselves. */
+static void zsetUnlink(zset *zs, struct zsetSlot *slot) {
+    unsigned long i = slot - zs->slots, j = i, k;
+    for (;;) {
+        j = (j + 1) & zs->mask;
+        if (zs->slots[j].node == NULL)
+            break;
+        k = zs->slots[j].hash & zs->mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        zs->slots[i] = zs->slots[j];
+        i = j;
+    }
+    zs->slots[i].node = NULL;
+}
+
+static void zsetShrink(zset *zs) {
+    unsigned long size = zs->mask + 1;
+    if (size > ZSET_MIN_SLOTS && zs->sl->length * 8 < size) {
+        while (size > ZSET_MIN_SLOTS && zs->sl->length * 4 < size)
+            size /= 2;
+        zsetResize(zs, size);
+    }
+}
+
+zset *zsetCreate(void) {
+    zset *zs = malloc(sizeof(*zs));
+    zs->sl = slCreate();
+    zs->slots = calloc(ZSET_MIN_SLOTS, sizeof(*zs->slots));
+    zs->mask = ZSET_MIN_SLOTS - 1;
+    return zs;
+}
+
+void zsetFree(zset *zs) {
+    slFree(zs->sl);
+    free(zs->slots);
+    free(zs);
+}
+
+skiplistNode *zsetFind(zset *zs, slobj *member) {
+    struct zsetSlot *slot = zsetLookup(zs, member, zsetHash(member->ptr, member->length));
+    return slot ? slot->node : NULL;
+}
+
+int zsetAdd(zset *zs, double score, slobj *member) {
+    unsigned int hash = zsetHash(member->ptr, member->length);
+    struct zsetSlot *slot = zsetLookup(zs, member, hash);
+    skiplistNode *x;
+
+    if (slot) {
+        x = slot->node;
+        if (x->score == score)
+            return 0;
+        /* the node keeps its place, only the score changes */
+        if ((x->backward == NULL || x->backward->score < score) &&
+            (x->level[0].forward == NULL || x->level[0].forward->score > score)) {
+            x->score = score;
+            return 0;
+        }
+        slDelete(zs->sl, x->score, member);
+        slot->node = slInsert(zs->sl, score, member);
+        return 0;
+    }
+
+    /* keep the load factor under 3/4 */
+    if ((zs->sl->length + 1) * 4 > (zs->mask + 1) * 3)
+        zsetResize(zs, (zs->mask + 1) * 2);
+    zsetPlace(zs, slInsert(zs->sl, score, member), hash);
+    return 1;
+}
+
+int zsetRem(zset *zs, slobj *member) {
+    struct zsetSlot *slot = zsetLookup(zs, member, zsetHash(member->ptr, member->length));
+    double score;
+
+    if (slot == NULL)
+        return 0;
+    score = slot->node->score;
+    zsetUnlink(zs, slot);
+    slDelete(zs->sl, score, member);
+    zsetShrink(zs);
+    return 1;
+}
+
+unsigned long zsetRank(zset *zs, slobj *member) {
+    skiplistNode *x = zsetFind(zs, member);
+    return x ? slGetRank(zs->sl, x->score, &x->obj) : 0;
+}
+
+static void zsetDeleteCb(void *ud, slobj *obj) {
+    zset *zs = ud;
+    zsetUnlink(zs, zsetLookup(zs, obj, zsetHash(obj->ptr, obj->length)));
+}
+
+unsigned long zsetDeleteByRank(zset *zs, unsigned int start, unsigned int end) {
+    unsigned long removed = slDeleteByRank(zs->sl, start, end, zsetDeleteCb, zs);
+    zsetShrink(zs);
+    return removed;
+}
+
 
 // lua-skiplist.c
 /*
@@ -421,10 +711,43 @@ _insert(lua_State *L) {
     skiplist *sl = _to_skiplist(L);
     double score = luaL_checknumber(L, 2);
     luaL_checktype(L, 3, LUA_TSTRING);
-    size_t len;
-    const char* ptr = lua_tolstring(L, 3, &len);
-    slobj *obj = slCreateObj(ptr, len);
-    slInsert(sl, score, obj);
+    slobj obj;
+    obj.ptr = (char *)lua_tolstring(L, 3, &obj.length);
+    slInsert(sl, score, &obj);
+    return 0;
+}
+
+/* sl:load(scores, members), both arrays sorted by (score, member) */
+static int
+_load(lua_State *L) {
+    skiplist *sl = _to_skiplist(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    size_t i, n = lua_rawlen(L, 2);
+    if (lua_rawlen(L, 3) != n) {
+        return luaL_error(L, "scores and members must have the same length");
+    }
+
+    /* userdata instead of malloc, it is collected if luaL_error jumps out */
+    double *scores = lua_newuserdata(L, n * (sizeof(double) + sizeof(slobj)) + 1);
+    slobj *objs = (slobj *)(scores + n);
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(L, 2, i + 1);
+        if (!lua_isnumber(L, -1)) {
+            return luaL_error(L, "score %d is not a number", (int)(i + 1));
+        }
+        scores[i] = lua_tonumber(L, -1);
+        lua_rawgeti(L, 3, i + 1);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            return luaL_error(L, "member %d is not a string", (int)(i + 1));
+        }
+        /* the string is still referenced by the members table */
+        objs[i].ptr = (char *)lua_tolstring(L, -1, &objs[i].length);
+        lua_pop(L, 2);
+    }
+    if (!slBulkLoad(sl, scores, objs, n)) {
+        return luaL_error(L, "skiplist is not empty or input is not sorted");
+    }
     return 0;
 }
 
@@ -489,8 +812,7 @@ _get_rank(lua_State *L) {
 }
 
 static int
-_get_rank_range(lua_State *L) {
-    skiplist *sl = _to_skiplist(L);
+_rank_range(lua_State *L, skiplist *sl) {
     unsigned long r1 = luaL_checkunsigned(L, 2);
     unsigned long r2 = luaL_checkunsigned(L, 3);
     int reverse, rangelen;
@@ -508,7 +830,7 @@ _get_rank_range(lua_State *L) {
     while(node && n < rangelen) {
         n++;
 
-        lua_pushlstring(L, node->obj->ptr, node->obj->length);
+        lua_pushlstring(L, node->obj.ptr, node->obj.length);
         lua_rawseti(L, -2, n);
         node = reverse? node->backward : node->level[0].forward;
     } 
@@ -516,8 +838,7 @@ _get_rank_range(lua_State *L) {
 }
 
 static int
-_get_score_range(lua_State *L) {
-    skiplist *sl = _to_skiplist(L);
+_score_range(lua_State *L, skiplist *sl) {
     double s1 = luaL_checknumber(L, 2);
     double s2 = luaL_checknumber(L, 3);
     int reverse; 
@@ -541,7 +862,7 @@ _get_score_range(lua_State *L) {
         }
         n++;
 
-        lua_pushlstring(L, node->obj->ptr, node->obj->length);
+        lua_pushlstring(L, node->obj.ptr, node->obj.length);
         lua_rawseti(L, -2, n);
 
         node = reverse? node->backward:node->level[0].forward;
@@ -549,6 +870,16 @@ _get_score_range(lua_State *L) {
     return 1;
 }
 
+static int
+_get_rank_range(lua_State *L) {
+    return _rank_range(L, _to_skiplist(L));
+}
+
+static int
+_get_score_range(lua_State *L) {
+    return _score_range(L, _to_skiplist(L));
+}
+
 static int
 _dump(lua_State *L) {
     skiplist *sl = _to_skiplist(L);
@@ -580,6 +911,7 @@ int luaopen_skiplist_c(lua_State *L) {
 
     luaL_Reg l[] = {
         {"insert", _insert},
+        {"load", _load},
         {"delete", _delete},
         {"delete_by_rank", _delete_by_rank},
 
@@ -603,6 +935,395 @@ int luaopen_skiplist_c(lua_State *L) {
     return 1;
 }
 
+/* zset object: every member operation is a single call */
+static inline zset*
+_to_zset(lua_State *L) {
+    zset **zs = lua_touserdata(L, 1);
+    if(zs==NULL) {
+        luaL_error(L, "must be zset object");
+    }
+    return *zs;
+}
+
+static inline void
+_check_member(lua_State *L, int idx, slobj *obj) {
+    luaL_checktype(L, idx, LUA_TSTRING);
+    obj->ptr = (char *)lua_tolstring(L, idx, &obj->length);
+}
+
+static int
+_zadd(lua_State *L) {
+    zset *zs = _to_zset(L);
+    double score = luaL_checknumber(L, 2);
+    slobj obj;
+    _check_member(L, 3, &obj);
+    lua_pushboolean(L, zsetAdd(zs, score, &obj));
+    return 1;
+}
+
+static int
+_zrem(lua_State *L) {
+    zset *zs = _to_zset(L);
+    slobj obj;
+    _check_member(L, 2, &obj);
+    lua_pushboolean(L, zsetRem(zs, &obj));
+    return 1;
+}
+
+static int
+_zscore(lua_State *L) {
+    zset *zs = _to_zset(L);
+    slobj obj;
+    _check_member(L, 2, &obj);
+    skiplistNode *node = zsetFind(zs, &obj);
+    if(node == NULL) {
+        return 0;
+    }
+    lua_pushnumber(L, node->score);
+    return 1;
+}
+
+static int
+_zrank(lua_State *L) {
+    zset *zs = _to_zset(L);
+    slobj obj;
+    _check_member(L, 2, &obj);
+    unsigned long rank = zsetRank(zs, &obj);
+    if(rank == 0) {
+        return 0;
+    }
+    lua_pushunsigned(L, rank);
+    return 1;
+}
+
+static int
+_zcount(lua_State *L) {
+    zset *zs = _to_zset(L);
+    lua_pushunsigned(L, zs->sl->length);
+    return 1;
+}
+
+static int
+_zrank_range(lua_State *L) {
+    return _rank_range(L, _to_zset(L)->sl);
+}
+
+static int
+_zscore_range(lua_State *L) {
+    return _score_range(L, _to_zset(L)->sl);
+}
+
+static int
+_zdelete_by_rank(lua_State *L) {
+    zset *zs = _to_zset(L);
+    unsigned int start = luaL_checkunsigned(L, 2);
+    unsigned int end = luaL_checkunsigned(L, 3);
+    if (start > end) {
+        unsigned int tmp = start;
+        start = end;
+        end = tmp;
+    }
+    lua_pushunsigned(L, zsetDeleteByRank(zs, start, end));
+    return 1;
+}
+
+static int
+_zdump(lua_State *L) {
+    zset *zs = _to_zset(L);
+    slDump(zs->sl);
+    return 0;
+}
+
+static int
+_znew(lua_State *L) {
+    zset *pzs = zsetCreate();
+
+    zset **zs = (zset**) lua_newuserdata(L, sizeof(zset*));
+    *zs = pzs;
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int
+_zrelease(lua_State *L) {
+    zset *zs = _to_zset(L);
+    zsetFree(zs);
+    return 0;
+}
+
+/* require "skiplist.zset" finds this in skiplist.so as well. It returns
+ * { new = constructor, methods = the __index table }, zset.lua adds the
+ * methods written in lua to that table */
+int luaopen_skiplist_zset(lua_State *L) {
+    luaL_checkversion(L);
+
+    luaL_Reg l[] = {
+        {"add", _zadd},
+        {"rem", _zrem},
+        {"score", _zscore},
+        {"rank", _zrank},
+        {"count", _zcount},
+
+        {"get_rank_range", _zrank_range},
+        {"get_score_range", _zscore_range},
+        {"delete_by_rank", _zdelete_by_rank},
+
+        {"dump", _zdump},
+        {NULL, NULL}
+    };
+
+    lua_createtable(L, 0, 2);       /* module */
+    lua_createtable(L, 0, 2);       /* metatable */
+
+    luaL_newlib(L, l);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -4, "methods");
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, _zrelease);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushcclosure(L, _znew, 1);
+    lua_setfield(L, -2, "new");
+    return 1;
+}
+
+// bench.c
+/*
+ * leaderboard churn: insert n members, delete them all, insert them again
+ * with new scores (the second round reuses the freed nodes), then bulk load
+ * the sorted result into another skiplist, then the same members in a zset
+ *   gcc -O2 skiplist.c bench.c -o bench && ./bench [n] [member length]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "skiplist.h"
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long
+rss_kb(void) {
+    long size = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void
+check(skiplist *sl, unsigned long n) {
+    skiplistNode *x = sl->header->level[0].forward;
+    unsigned long i = 0;
+    for (; x; x = x->level[0].forward, i++) {
+        assert(x->level[0].forward == NULL || x->score <= x->level[0].forward->score);
+    }
+    assert(i == n && sl->length == n);
+}
+
+/* every node can be found through the table and the table holds nothing else */
+static void
+check_zset(zset *zs) {
+    skiplistNode *x;
+    unsigned long i, used = 0;
+    check(zs->sl, zs->sl->length);
+    for (x = zs->sl->header->level[0].forward; x; x = x->level[0].forward)
+        assert(zsetFind(zs, &x->obj) == x);
+    for (i = 0; i <= zs->mask; i++)
+        used += zs->slots[i].node != NULL;
+    assert(used == zs->sl->length);
+}
+
+static void
+bench_zset(char *mem, int len, unsigned long n) {
+    double t, t_add, t_update, t_score, t_rank, t_rem;
+    unsigned long i, added, found, removed;
+    slobj obj;
+    zset *zs = zsetCreate();
+
+    obj.length = len;
+    /* results are counted in the timed loops and asserted after them, as in main */
+    added = 0;
+    t = now();
+    for (i = 0; i < n; i++) {
+        obj.ptr = mem + i * (len + 1);
+        added += zsetAdd(zs, random() % 100000, &obj);
+    }
+    t_add = now() - t;
+    assert(added == n);
+
+    t = now();
+    for (i = 0; i < n; i++) {
+        obj.ptr = mem + i * (len + 1);
+        added += zsetAdd(zs, random() % 100000, &obj);
+    }
+    t_update = now() - t;
+    assert(added == n);
+    check_zset(zs);
+
+    found = 0;
+    t = now();
+    for (i = 0; i < n; i++) {
+        obj.ptr = mem + i * (len + 1);
+        found += zsetFind(zs, &obj) != NULL;
+    }
+    t_score = now() - t;
+    assert(found == n);
+
+    found = 0;
+    t = now();
+    for (i = 0; i < n; i++) {
+        obj.ptr = mem + i * (len + 1);
+        found += zsetRank(zs, &obj) != 0;
+    }
+    t_rank = now() - t;
+    assert(found == n);
+    for (i = 0; i < n; i += 101) {
+        obj.ptr = mem + i * (len + 1);
+        assert(slGetNodeByRank(zs->sl, zsetRank(zs, &obj)) == zsetFind(zs, &obj));
+    }
+
+    /* keep the lowest n/2, the rest is removed one by one */
+    removed = zsetDeleteByRank(zs, n / 2 + 1, n);
+    assert(removed == n - n / 2 && zs->sl->length == n / 2);
+    check_zset(zs);
+    t = now();
+    for (i = 0; i < n; i++) {
+        obj.ptr = mem + i * (len + 1);
+        removed += zsetRem(zs, &obj);
+    }
+    t_rem = now() - t;
+    assert(removed == n && zs->sl->length == 0);
+    check_zset(zs);
+    assert(zs->mask + 1 == ZSET_MIN_SLOTS);
+    zsetFree(zs);
+
+    printf("zset: add %.2f Mops/s, update %.2f Mops/s, score %.2f Mops/s, rank %.2f Mops/s, rem %.2f Mops/s\n",
+        n / t_add / 1e6, n / t_update / 1e6, n / t_score / 1e6, n / t_rank / 1e6, n / t_rem / 1e6);
+}
+
+int
+main(int argc, char *argv[]) {
+    unsigned long n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000, i;
+    int len = argc > 2 ? atoi(argv[2]) : 12;
+    char *mem;
+    double *score, t, t_insert, t_delete, t_reinsert, t_load, t_free;
+    slobj obj;
+
+    if (n == 0) n = 1;     /* score[0] is read below */
+    if (len < 8) len = 8;
+    mem = malloc(n * (len + 1));
+    score = malloc(n * sizeof(double));
+    srandom(1);
+    for (i = 0; i < n; i++) {
+        char *p = mem + i * (len + 1);
+        unsigned long v = i;
+        int j;
+        for (j = len - 1; j >= 0; j--, v /= 10)
+            p[j] = '0' + v % 10;
+        p[len] = '\0';
+        score[i] = random() % 100000;
+    }
+    obj.length = len;
+
+    long rss0 = rss_kb();
+    skiplist *sl = slCreate();
+    t = now();
+    for (i = 0; i < n; i++) {
+        obj.ptr = mem + i * (len + 1);
+        slInsert(sl, score[i], &obj);
+    }
+    t_insert = now() - t;
+    long rss1 = rss_kb();
+    check(sl, n);
+
+    /* count inside the timed loop and assert outside it, so -DNDEBUG still times the deletes */
+    unsigned long deleted = 0;
+    t = now();
+    for (i = 0; i < n; i++) {
+        obj.ptr = mem + i * (len + 1);
+        deleted += slDelete(sl, score[i], &obj);
+    }
+    t_delete = now() - t;
+    assert(deleted == n);
+    check(sl, 0);
+
+    for (i = 0; i < n; i++)
+        score[i] = random() % 100000;
+    t = now();
+    for (i = 0; i < n; i++) {
+        obj.ptr = mem + i * (len + 1);
+        slInsert(sl, score[i], &obj);
+    }
+    t_reinsert = now() - t;
+    long rss2 = rss_kb();
+    check(sl, n);
+    obj.ptr = mem;
+    assert(slGetRank(sl, score[0], &obj) > 0);
+
+    /* rebuild a second list from the sorted content of the first one */
+    double *sorted = malloc(n * sizeof(double));
+    slobj *objs = malloc(n * sizeof(slobj));
+    skiplistNode *x = sl->header->level[0].forward;
+    for (i = 0; i < n; i++, x = x->level[0].forward) {
+        sorted[i] = x->score;
+        objs[i] = x->obj;
+    }
+    skiplist *bl = slCreate();
+    t = now();
+    int loaded = slBulkLoad(bl, sorted, objs, n);
+    t_load = now() - t;
+    assert(loaded);
+    loaded = slBulkLoad(bl, sorted, objs, n);
+    assert(!loaded);
+    (void)loaded;
+    check(bl, n);
+    for (i = 0, x = bl->header->level[0].forward; i < n; i++, x = x->level[0].forward) {
+        assert(x->backward == (i ? slGetNodeByRank(bl, i) : NULL));
+        assert(slGetRank(bl, x->score, &x->obj) == i + 1);
+    }
+    assert(bl->tail == slGetNodeByRank(bl, n));
+    /* it stays a normal skiplist afterwards */
+    deleted = 0;
+    for (i = 0; i < n; i += 2)
+        deleted += slDelete(bl, sorted[i], &objs[i]);
+    assert(deleted == (n + 1) / 2);
+    for (i = 0; i < n; i += 2)
+        slInsert(bl, sorted[i], &objs[i]);
+    check(bl, n);
+    for (i = 0; i < n; i += 97)
+        assert(slGetRank(bl, sorted[i], &objs[i]) == i + 1);
+    slFree(bl);
+    free(sorted);
+    free(objs);
+
+    t = now();
+    slFree(sl);
+    t_free = now() - t;
+
+    printf("%lu members of %d bytes: insert %.2f Mops/s, delete %.2f Mops/s, reinsert %.2f Mops/s, bulk load %.2f Mops/s, free %.1f ms\n",
+        n, len, n / t_insert / 1e6, n / t_delete / 1e6, n / t_reinsert / 1e6, n / t_load / 1e6, t_free * 1e3);
+    printf("RSS +%ld KB after insert (%.1f bytes/member), +%ld KB after churn\n",
+        rss1 - rss0, (rss1 - rss0) * 1024.0 / n, rss2 - rss0);
+    bench_zset(mem, len, n);
+    free(mem);
+    free(score);
+    return 0;
+}
+
 // Makefile
 
 all: skiplist.so
@@ -610,8 +1331,14 @@ all: skiplist.so
 skiplist.so: skiplist.h skiplist.c lua-skiplist.c
     gcc -g3 -O0 -Wall -fPIC --shared $^ -o $@
 
+bench: skiplist.h skiplist.c bench.c
+    gcc -O2 -Wall skiplist.c bench.c -o $@
+
+bench_zset: skiplist.so
+    lua bench_zset.lua
+
 test:
     lua test_sl.lua
 
 clean:
-    -rm skiplist.so
+    -rm skiplist.so bench
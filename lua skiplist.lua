@@ -1,59 +1,31 @@
 -- zset.lua
 
-local skiplist = require "skiplist.c"
+-- the member -> node table lives in C (skiplist.zset), add/rem/score/rank
+-- and count are C functions called directly through the metatable
+local zset = require "skiplist.zset"
 
-local mt = {}
-mt.__index = mt
-
-function mt:add(score, member)
-    local old = self.tbl[member]
-    if old then
-        if old == score then
-            return
-        end
-        self.sl:delete(old, member)
-    end
-
-    self.sl:insert(score, member)
-    self.tbl[member] = score
-end
-
-function mt:rem(member)
-    local score = self.tbl[member]
-    if score then
-        self.sl:delete(score, member)
-        self.tbl[member] = nil
-    end
-end
-
-function mt:count()
-    return self.sl:get_count()
-end
+local mt = zset.methods
 
 function mt:_reverse_rank(r)
-    return self.sl:get_count() - r + 1
+    return self:count() - r + 1
 end
 
 function mt:limit(count)
-    local total = self.sl:get_count()
+    local total = self:count()
     if total <= count then
         return 0
     end
-    return self.sl:delete_by_rank(count+1, total, function (member)
-        self.tbl[member] = nil
-    end)
+    return self:delete_by_rank(count+1, total)
 end
 
 function mt:rev_limit(count)
-    local total = self.sl:get_count()
+    local total = self:count()
     if total <= count then
         return 0
     end
     local from = self:_reverse_rank(count+1)
     local to   = self:_reverse_rank(total)
-    return self.sl:delete_by_rank(from, to, function (member)
-        self.tbl[member] = nil
-    end)
+    return self:delete_by_rank(from, to)
 end
 
 function mt:rev_range(r1, r2)
@@ -70,7 +42,7 @@ function mt:range(r1, r2)
     if r2 < 1 then
         r2 = 1
     end
-    return self.sl:get_rank_range(r1, r2)
+    return self:get_rank_range(r1, r2)
 end
 
 function mt:rev_rank(member)
@@ -81,33 +53,12 @@ function mt:rev_rank(member)
     return r
 end
 
-function mt:rank(member)
-    local score = self.tbl[member]
-    if not score then
-        return nil
-    end
-    return self.sl:get_rank(score, member)
-end
-
 function mt:range_by_score(s1, s2)
-    return self.sl:get_score_range(s1, s2)
-end
-
-function mt:score(member)
-    return self.tbl[member]
-end
-
-function mt:dump()
-    self.sl:dump()
+    return self:get_score_range(s1, s2)
 end
 
 local M = {}
-function M.new()
-    local obj = {}
-    obj.sl = skiplist()
-    obj.tbl = {}
-    return setmetatable(obj, mt)
-end
+M.new = zset.new
 return M
 
 -- test.lua
@@ -239,9 +190,121 @@ function delete_cb(member)
 end
 sl:delete_by_rank(15, 10, delete_cb)
 
+local scores, members = {}, {}
+for i=1, total do
+    scores[i] = i
+    members[i] = tostring(i)
+end
+local bl = c()
+bl:load(scores, members)
+assert(bl:get_count() == total)
+local r = math.random(total)
+assert(bl:get_rank(r, tostring(r)) == r)
+local t = bl:get_rank_range(1, 10)
+for i, name in ipairs(t) do
+    assert(name == tostring(i))
+end
+assert(not pcall(bl.load, bl, scores, members))
+bl = nil
+
 print(collectgarbage("count"))
 sl = nil
 collectgarbage("collect")
 print(collectgarbage("count"))
 
+-- bench_zset.lua
+-- ops/sec of the C zset against the previous zset.lua, which kept
+-- member -> score in a lua table next to skiplist.c
+-- lua 5.2, skiplist.so at -O2, 200000 members, one core:
+--   lua tbl  add 0.44-0.52M  update 0.31-0.35M  score 2.3-2.7M  rank 0.52-0.58M  rem 0.67-0.75M
+--   c zset   add 0.76-0.78M  update 0.38M       score 2.7-3.2M  rank 0.63-0.73M  rem 0.80-0.97M
+local zset = require "zset"
+local c = require "skiplist.c"
+
+local old = {}
+old.__index = old
+
+function old.new()
+    return setmetatable({sl = c(), tbl = {}}, old)
+end
+
+function old:add(score, member)
+    local s = self.tbl[member]
+    if s then
+        if s == score then
+            return
+        end
+        self.sl:delete(s, member)
+    end
+    self.sl:insert(score, member)
+    self.tbl[member] = score
+end
+
+function old:rem(member)
+    local score = self.tbl[member]
+    if score then
+        self.sl:delete(score, member)
+        self.tbl[member] = nil
+    end
+end
+
+function old:score(member)
+    return self.tbl[member]
+end
+
+function old:rank(member)
+    local score = self.tbl[member]
+    if not score then
+        return nil
+    end
+    return self.sl:get_rank(score, member)
+end
+
+function old:count()
+    return self.sl:get_count()
+end
+
+local n = tonumber(arg and arg[1]) or 200000
+local members, scores = {}, {}
+for i=1, n do
+    members[i] = "player:" .. i
+    scores[i] = math.random(100000)
+end
+
+local function bench(name, zs)
+    local function run(op, f)
+        local t = os.clock()
+        f()
+        t = os.clock() - t
+        print(string.format("%-8s %-7s %10.0f ops/s", name, op, n / t))
+    end
+    run("add", function()
+        for i=1, n do
+            zs:add(scores[i], members[i])
+        end
+    end)
+    run("update", function()
+        for i=1, n do
+            zs:add(scores[n-i+1], members[i])
+        end
+    end)
+    run("score", function()
+        for i=1, n do
+            assert(zs:score(members[i]) == scores[n-i+1])
+        end
+    end)
+    run("rank", function()
+        for i=1, n do
+            assert(zs:rank(members[i]))
+        end
+    end)
+    run("rem", function()
+        for i=1, n do
+            zs:rem(members[i])
+        end
+    end)
+    assert(zs:count() == 0)
+end
 
+bench("lua tbl", old.new())
+bench("c zset", zset.new())